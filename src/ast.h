@@ -32,6 +32,7 @@
 
 namespace lox {
 
+  class Function;
   class Token;
   class Value;
 
@@ -113,6 +114,8 @@ namespace lox {
     Expr* callee;
     Vector<Expr*> arguments;
     Token* stop;
+    // Global function the stack compiler inlines the call to, if the Inliner found it can.
+    mutable const Function* inlined = nullptr;
 
     EXPR_ACCEPT_METHODS
     GET_TOKENS_METHODS(callee->getStart(), stop)
@@ -6,8 +6,84 @@
 
 namespace lox {
 
+  class Shape;
+
   typedef uint8_t instruction;
 
+  // Inline cache of an OP_GET_PROPERTY or OP_SET_PROPERTY instruction, keyed by the shape of the
+  // last instance the instruction accessed. For a store that added the field, `transition` is the
+  // shape the instance moved to.
+  struct PropertyCache {
+    Shape* shape = nullptr;
+    Shape* transition = nullptr;
+    int slot = 0;
+  };
+
+  // Polymorphic inline cache of an OP_INVOKE or OP_SUPER_INVOKE instruction: the methods it called
+  // for up to SIZE receiver types. OP_INVOKE keys entries by the receiver's shape, which also
+  // proves the instance has no field shadowing the method; OP_SUPER_INVOKE keys them by the
+  // superclass. A site that sees more types is megamorphic and keeps doing full lookups for them.
+  //
+  // Entries are dropped when the VM's method epoch moves on (see VM::invalidateInvokeCaches).
+  class InvokeCache {
+   public:
+    static constexpr int SIZE = 4;
+
+    ObjClosure* find(const void* key, uint32_t epoch) {
+      if (epoch != epoch_) {
+        count_ = 0;
+        epoch_ = epoch;
+      }
+      for (int i = 0; i < count_; i++) {
+        if (entries_[i].key == key) return entries_[i].method;
+      }
+      return nullptr;
+    }
+
+    // `klass` is the class the method was found in, kept alive by the owning function.
+    void add(const void* key, ObjClass* klass, ObjClosure* method) {
+      if (count_ < SIZE) entries_[count_++] = {key, klass, method};
+    }
+
+    int count() const {
+      return count_;
+    }
+
+    ObjClass* klass(int index) const {
+      return entries_[index].klass;
+    }
+
+    ObjClosure* method(int index) const {
+      return entries_[index].method;
+    }
+
+   private:
+    struct Entry {
+      const void* key;
+      ObjClass* klass;
+      ObjClosure* method;
+    };
+
+    Entry entries_[SIZE];
+    int count_ = 0;
+    uint32_t epoch_ = 0;
+  };
+
+  // A call the compiler inlined into the chunk. The code evaluates the callee and the arguments as
+  // for any call, then OP_INLINE_GUARD at `guard` checks that the callee is a closure of `fn`, the
+  // function the callee's global held when the chunk was compiled. If it is, the body follows at
+  // [start, end) and reads the arguments from their stack slots; if not, the guard jumps to a real
+  // call. Runtime errors in the body report `fn` as a frame of its own.
+  struct InlinedCall {
+    ObjFunction* fn = nullptr;
+    // The first closure of `fn` the guard saw, which native code compares the callee with. The
+    // chunk's function keeps it alive, so no other object can take its address.
+    ObjClosure* closure = nullptr;
+    int guard = 0;
+    int start = 0;
+    int end = 0;
+  };
+
   class Chunk {
    public:
     void write(instruction inst, int line) {
@@ -19,10 +95,21 @@ namespace lox {
       code_[index] = inst;
     }
 
+    // Drops every instruction from [count] onwards, used by the compiler to replace a sequence it
+    // has just emitted with a superinstruction.
+    void truncate(int count) {
+      code_.truncate(count);
+      lines_.truncate(count);
+    }
+
     instruction getCode(int index) const {
       return code_[index];
     }
 
+    const instruction* code() const {
+      return code_.data();
+    }
+
     int getLine(int index) const {
       return lines_[index];
     }
@@ -33,6 +120,8 @@ namespace lox {
 
     int addConstant(Value value) {
       constants_.push(value);
+      propertyCaches_.push(PropertyCache());
+      invokeCacheIndices_.push(-1);
       return constants_.size() - 1;
     }
 
@@ -44,10 +133,53 @@ namespace lox {
       return constants_;
     }
 
+    // Property instructions find their cache through their name operand. The compiler adds a new
+    // constant for every identifier it emits, so no two instructions share an entry.
+    PropertyCache& propertyCache(int constant) {
+      return propertyCaches_[constant];
+    }
+
+    const Vector<PropertyCache>& propertyCaches() const {
+      return propertyCaches_;
+    }
+
+    // Invoke instructions also find their cache through their name operand, but only names the
+    // compiler registered with addInvokeCache have one.
+    void addInvokeCache(int constant) {
+      invokeCacheIndices_[constant] = invokeCaches_.size();
+      invokeCaches_.push(InvokeCache());
+    }
+
+    InvokeCache& invokeCache(int constant) {
+      return invokeCaches_[invokeCacheIndices_[constant]];
+    }
+
+    const Vector<InvokeCache>& invokeCaches() const {
+      return invokeCaches_;
+    }
+
+    int addInlinedCall(const InlinedCall& call) {
+      inlinedCalls_.push(call);
+      return inlinedCalls_.size() - 1;
+    }
+
+    InlinedCall& inlinedCall(int index) {
+      return inlinedCalls_[index];
+    }
+
+    // In the order of their guards, so a call inlined into the body of another comes after it.
+    const Vector<InlinedCall>& inlinedCalls() const {
+      return inlinedCalls_;
+    }
+
    private:
     Vector<instruction> code_;
     Vector<int> lines_;
     Vector<Value> constants_;
+    Vector<PropertyCache> propertyCaches_; // Parallel to constants_.
+    Vector<int16_t> invokeCacheIndices_;   // Parallel to constants_.
+    Vector<InvokeCache> invokeCaches_;
+    Vector<InlinedCall> inlinedCalls_;
   };
 
 } // namespace lox
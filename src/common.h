@@ -44,6 +44,13 @@
 
 #define FLEXIBLE_ARRAY (1)
 
+// Dispatch flags
+// VM::run dispatches with labels-as-values (direct threading) where the compiler supports it.
+// Define NO_COMPUTED_GOTO to build the portable switch-based loop instead.
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
 // GC flags
 #ifdef STRESS_GC
 #define DEBUG_STRESS_GC
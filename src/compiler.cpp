@@ -2,6 +2,7 @@
 
 #include "common.h"
 #include "debug.h"
+#include "inliner.h"
 #include "lexer.h"
 #include "op_code.h"
 #include "parser.h"
@@ -10,6 +11,90 @@
 
 namespace lox {
 
+  // Collects the names of the variables assigned in a list of statements, including the ones in
+  // nested functions and methods.
+  class AssignedNameScanner
+    : public Expr::Visitor<void>
+    , public Stmt::Visitor<void> {
+   public:
+    AssignedNameScanner(Vector<Token*>& names)
+      : names_(names) {}
+
+    void scan(const Vector<Stmt*>& stmts) {
+      for (int i = 0; i < stmts.size(); i++) stmts[i]->accept(this);
+    }
+
+   private:
+    virtual void visit(const Assign* expr) {
+      int i = 0;
+      while (i < names_.size() && !(*names_[i] == *expr->name)) i++;
+      if (i == names_.size()) names_.push(expr->name);
+      expr->value->accept(this);
+    }
+    virtual void visit(const Binary* expr) {
+      expr->left->accept(this);
+      expr->right->accept(this);
+    }
+    virtual void visit(const Call* expr) {
+      expr->callee->accept(this);
+      for (int i = 0; i < expr->arguments.size(); i++) expr->arguments[i]->accept(this);
+    }
+    virtual void visit(const Get* expr) {
+      expr->object->accept(this);
+    }
+    virtual void visit(const Grouping* expr) {
+      expr->expression->accept(this);
+    }
+    virtual void visit(const Literal* expr) {}
+    virtual void visit(const Logical* expr) {
+      expr->left->accept(this);
+      expr->right->accept(this);
+    }
+    virtual void visit(const Set* expr) {
+      expr->object->accept(this);
+      expr->value->accept(this);
+    }
+    virtual void visit(const Super* expr) {}
+    virtual void visit(const This* expr) {}
+    virtual void visit(const Unary* expr) {
+      expr->right->accept(this);
+    }
+    virtual void visit(const Variable* expr) {}
+
+    virtual void visit(const Block* stmt) {
+      scan(stmt->statements);
+    }
+    virtual void visit(const Class* stmt) {
+      for (int i = 0; i < stmt->methods.size(); i++) scan(stmt->methods[i]->body);
+    }
+    virtual void visit(const Expression* stmt) {
+      stmt->expression->accept(this);
+    }
+    virtual void visit(const Function* stmt) {
+      scan(stmt->body);
+    }
+    virtual void visit(const If* stmt) {
+      stmt->condition->accept(this);
+      stmt->thenBranch->accept(this);
+      if (stmt->elseBranch) stmt->elseBranch->accept(this);
+    }
+    virtual void visit(const Print* stmt) {
+      stmt->expression->accept(this);
+    }
+    virtual void visit(const Return* stmt) {
+      if (stmt->value) stmt->value->accept(this);
+    }
+    virtual void visit(const Var* stmt) {
+      if (stmt->initializer) stmt->initializer->accept(this);
+    }
+    virtual void visit(const While* stmt) {
+      stmt->condition->accept(this);
+      stmt->body->accept(this);
+    }
+
+    Vector<Token*>& names_;
+  };
+
   Compiler::Compiler(VM& vm, Compiler* parent, const char* source)
     : Compiler(vm, parent, source, nullptr, TYPE_SCRIPT) {}
 
@@ -56,6 +141,8 @@ namespace lox {
     if (!parser.parse()) return nullptr;
 
     const ParseResult& result = parser.result();
+    if (vm_.config().inlining) Inliner(vm_.config().inlineBudget).run(result.stmts);
+    scanAssignedNames(result.stmts);
     for (int i = 0; i < result.stmts.size(); i++) {
       result.stmts[i]->accept(this);
     }
@@ -66,6 +153,7 @@ namespace lox {
 
   void Compiler::endCompiler(SRC) {
     emitReturn(token);
+    function_->setStackSize(computeStackSize());
 
 #ifdef DEBUG_PRINT_CODE
     if (!hadError_)
@@ -76,28 +164,217 @@ namespace lox {
     vm_.setCompiler(enclosing_); // TODO: accurate?
   }
 
+  // Net effect of the instruction at `offset` on the stack depth when execution falls through it.
+  static int stackEffect(const Chunk& chunk, int offset) {
+    switch (chunk.getCode(offset)) {
+      case OP_CONSTANT:
+      case OP_NIL:
+      case OP_TRUE:
+      case OP_FALSE:
+      case OP_GET_LOCAL:
+      case OP_GET_GLOBAL:
+      case OP_GET_UPVALUE:
+      case OP_GET_CAPTURED:
+      case OP_CLOSURE:
+      case OP_CLASS:
+      case OP_GET_LOCAL_PROPERTY:
+      case OP_ADD_LOCAL_CONSTANT: return 1;
+      case OP_GET_LOCALS: return 2;
+      case OP_POP:
+      case OP_DEFINE_GLOBAL:
+      case OP_SET_PROPERTY:
+      case OP_GET_SUPER:
+      case OP_EQUAL:
+      case OP_GREATER:
+      case OP_LESS:
+      case OP_ADD:
+      case OP_SUBTRACT:
+      case OP_MULTIPLY:
+      case OP_DIVIDE:
+      case OP_PRINT:
+      case OP_CLOSE_UPVALUE:
+      case OP_RETURN:
+      case OP_INHERIT:
+      case OP_METHOD:
+      case OP_END_CLASS:
+      case OP_AND:
+      case OP_OR:
+      case OP_SET_LOCAL_POP:
+      case OP_ADD_NUM:
+      case OP_ADD_STR:
+      case OP_ADD_GENERIC:
+      case OP_EQUAL_NUM:
+      case OP_EQUAL_GENERIC: return -1;
+      case OP_LESS_JUMP: return -2;
+      case OP_CALL:
+      case OP_TAIL_CALL: return -chunk.getCode(offset + 1);
+      case OP_INVOKE:
+      case OP_TAIL_INVOKE: return -chunk.getCode(offset + 2);
+      case OP_CALL_0:
+      case OP_CALL_1:
+      case OP_CALL_2:
+      case OP_CALL_3: return -(chunk.getCode(offset) - OP_CALL_0);
+      case OP_INVOKE_0:
+      case OP_INVOKE_1:
+      case OP_INVOKE_2:
+      case OP_INVOKE_3: return -(chunk.getCode(offset) - OP_INVOKE_0);
+      case OP_SUPER_INVOKE: return -chunk.getCode(offset + 2) - 1;
+      default: return 0;
+    }
+  }
+
+  int Compiler::computeStackSize() const {
+    int maxDepth;
+    stackDepth(&maxDepth);
+    return maxDepth;
+  }
+
+  int Compiler::stackDepth(int* maxDepth) const {
+    const Chunk& chunk = currentChunk();
+
+    // Depth on entry to each offset reached by a forward jump. Loops are stack neutral, so one pass
+    // in code order sees every depth: code after an unconditional jump or a return is only
+    // reachable through a jump that was already seen.
+    Vector<int> jumpDepths(chunk.count() + 1);
+    for (int i = 0; i <= chunk.count(); i++) jumpDepths.push(-1);
+
+    int depth = 1 + function_->arity(); // Callee and arguments.
+    *maxDepth = depth;
+    bool reachable = true;
+    int offset = 0;
+    while (true) {
+      if (jumpDepths[offset] != -1) {
+        depth = reachable && depth > jumpDepths[offset] ? depth : jumpDepths[offset];
+        reachable = true;
+      }
+      if (offset == chunk.count()) break;
+
+      // Depth at the target of a forward jump. OP_AND and OP_OR only pop their operand when they
+      // fall through; OP_LESS_JUMP pops both of its operands either way.
+      instruction op = chunk.getCode(offset);
+      int targetDepth = -1;
+      switch (op) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_AND:
+        case OP_OR:
+        case OP_LOCAL_CONSTANT_LESS_JUMP:
+        case OP_INLINE_GUARD: targetDepth = depth; break;
+        case OP_LESS_JUMP: targetDepth = depth - 2; break;
+        default: break;
+      }
+      int next = Disassembler::nextOffset(chunk, offset);
+      if (targetDepth != -1) {
+        // Jumps that aren't patched yet land after the code emitted so far.
+        int target = next + (chunk.getCode(next - 2) << 8 | chunk.getCode(next - 1));
+        if (target <= chunk.count() && targetDepth > jumpDepths[target]) {
+          jumpDepths[target] = targetDepth;
+        }
+      }
+
+      depth += stackEffect(chunk, offset);
+      // Instructions may push a couple of temporaries beyond their net effect (e.g. the slow path
+      // of OP_ADD_LOCAL_CONSTANT), so the peak allows for them.
+      if (depth + 2 > *maxDepth) *maxDepth = depth + 2;
+      if (op == OP_JUMP || op == OP_LOOP || op == OP_RETURN) reachable = false;
+      offset = next;
+    }
+    return depth;
+  }
+
   void Compiler::emitByte(SRC, instruction inst) {
     currentChunk().write(inst, token->line);
   }
 
-  void Compiler::emitBytes(SRC, instruction inst1, instruction inst2) {
-    emitByte(token, inst1);
-    emitByte(token, inst2);
+  void Compiler::emitBytes(SRC, instruction op, instruction operand) {
+    emitOp(token, op);
+    emitByte(token, operand);
+  }
+
+  void Compiler::emitBytes(SRC, instruction op, instruction operand1, instruction operand2) {
+    emitOp(token, op);
+    emitByte(token, operand1);
+    emitByte(token, operand2);
+  }
+
+  void Compiler::emitOp(SRC, instruction op) {
+    fuseSuperinstructions();
+
+    if (recentOpCount_ == FUSE_WINDOW) {
+      for (int i = 1; i < FUSE_WINDOW; i++) recentOps_[i - 1] = recentOps_[i];
+      recentOpCount_--;
+    }
+    recentOps_[recentOpCount_++] = currentChunk().count();
+    emitByte(token, op);
+  }
+
+  void Compiler::emitOps(SRC, instruction op1, instruction op2) {
+    emitOp(token, op1);
+    emitOp(token, op2);
+  }
+
+  bool Compiler::endsWith(std::initializer_list<OpCode> ops) const {
+    int n = ops.size();
+    if (!vm_.config().superinstructions || recentOpCount_ < n) return false;
+
+    // A jump may land on the first instruction of the sequence, but not inside it.
+    int first = recentOpCount_ - n;
+    if (recentOps_[first] < lastJumpTarget_) return false;
+
+    const Chunk& chunk = currentChunk();
+    int i = first;
+    for (OpCode op : ops) {
+      if (chunk.getCode(recentOps_[i]) != op) return false;
+      int next = i + 1 < recentOpCount_ ? recentOps_[i + 1] : chunk.count();
+      if (Disassembler::nextOffset(chunk, recentOps_[i]) != next) return false;
+      i++;
+    }
+    return true;
+  }
+
+  int Compiler::recentOperand(int nthFromLast, int index) const {
+    return currentChunk().getCode(recentOps_[recentOpCount_ - nthFromLast] + 1 + index);
+  }
+
+  void Compiler::replaceRecent(int n, std::initializer_list<instruction> fused) {
+    int start = recentOps_[recentOpCount_ - n];
+    int line = currentChunk().getLine(start);
+
+    currentChunk().truncate(start);
+    recentOpCount_ -= n;
+    recentOps_[recentOpCount_++] = start;
+    for (instruction inst : fused) currentChunk().write(inst, line);
+  }
+
+  void Compiler::fuseSuperinstructions() {
+    // The set below comes from running tool/opcode_stats over bench/ and the integration tests.
+    if (endsWith({OP_SET_LOCAL, OP_POP})) {
+      replaceRecent(2, {OP_SET_LOCAL_POP, (instruction)recentOperand(2, 0)});
+    } else if (endsWith({OP_GET_LOCAL, OP_CONSTANT, OP_ADD})) {
+      replaceRecent(3, {OP_ADD_LOCAL_CONSTANT, (instruction)recentOperand(3, 0),
+                        (instruction)recentOperand(2, 0)});
+    } else if (endsWith({OP_GET_LOCAL, OP_GET_PROPERTY})) {
+      replaceRecent(2, {OP_GET_LOCAL_PROPERTY, (instruction)recentOperand(2, 0),
+                        (instruction)recentOperand(1, 0)});
+    } else if (endsWith({OP_GET_LOCAL, OP_GET_LOCAL})) {
+      replaceRecent(2, {OP_GET_LOCALS, (instruction)recentOperand(2, 0),
+                        (instruction)recentOperand(1, 0)});
+    }
   }
 
-  void Compiler::emitBytes(SRC, instruction inst1, instruction inst2, instruction inst3) {
-    emitByte(token, inst1);
-    emitByte(token, inst2);
-    emitByte(token, inst3);
+  int Compiler::markJumpTarget() {
+    fuseSuperinstructions();
+    lastJumpTarget_ = currentChunk().count();
+    return lastJumpTarget_;
   }
 
   void Compiler::emitReturn(SRC) {
     if (function_->type() == TYPE_INITIALIZER)
       emitBytes(token, OP_GET_LOCAL, 0);
     else
-      emitByte(token, OP_NIL);
+      emitOp(token, OP_NIL);
 
-    emitByte(token, OP_RETURN);
+    emitOp(token, OP_RETURN);
   }
 
   void Compiler::emitConstant(SRC, Value value) {
@@ -117,9 +394,23 @@ namespace lox {
     return makeConstant(idt, vm_.allocateObj<ObjString>(idt->start, idt->length)->asValue());
   }
 
+  int Compiler::globalSlot(Token* name) {
+    int slot = vm_.globalSlot(vm_.allocateObj<ObjString>(name->start, name->length));
+    if (slot > UINT16_MAX) {
+      error(name, "Too many global variables.");
+      return 0;
+    }
+    return slot;
+  }
+
+  void Compiler::emitGlobal(SRC, OpCode op, int slot) {
+    emitBytes(token, op, (slot >> 8) & 0xff, slot & 0xff);
+  }
+
   int Compiler::addConstant(Value value) {
     vm_.pushRoot(value);
     int constant = currentChunk().addConstant(value);
+    function_->gcWriteBarrier(value);
     vm_.popRoot();
 
     return constant;
@@ -146,7 +437,7 @@ namespace lox {
       declareVariableLocal(var);
       return -1; // dummy
     }
-    return identifierConstant(var);
+    return globalSlot(var);
   }
 
   void Compiler::declareVariableLocal(Token* var) {
@@ -167,26 +458,43 @@ namespace lox {
       return;
     }
     locals_.emplace(var);
+    locals_[-1].isCapturableByValue = !isAssignedName(var);
   }
 
-  void Compiler::defineVariable(Token* var, instruction global) {
+  void Compiler::defineVariable(Token* var, int global) {
     if (isLocalScope()) {
       markInitialized();
       return;
     }
     ASSERT(global != -1, "Global slot must be given.");
-    emitBytes(var, OP_DEFINE_GLOBAL, global);
+    emitGlobal(var, OP_DEFINE_GLOBAL, global);
   }
 
   void Compiler::namedVariable(Token* name, bool isSetOp) {
-    int index = resolveLocal(name);
+    int index = resolveInlinedParam(name);
+    if (index != -1 && inlinedParams_->arguments) {
+      const InlinedParams* params = inlinedParams_;
+      inlinedParams_ = params->enclosing;
+      (*params->arguments)[index]->accept(this);
+      inlinedParams_ = params;
+      return;
+    }
+    if (index != -1) {
+      index += inlinedParams_->firstSlot;
+    } else {
+      index = resolveLocal(name);
+    }
     if (index != -1) {
       emitBytes(name, isSetOp ? OP_SET_LOCAL : OP_GET_LOCAL, index);
     } else if ((index = resolveUpvalue(name)) != -1) {
-      emitBytes(name, isSetOp ? OP_SET_UPVALUE : OP_GET_UPVALUE, index);
+      if (upvalues_[index].isValue) {
+        ASSERT(!isSetOp, "Variables captured by value are never assigned.");
+        emitBytes(name, OP_GET_CAPTURED, index);
+      } else {
+        emitBytes(name, isSetOp ? OP_SET_UPVALUE : OP_GET_UPVALUE, index);
+      }
     } else {
-      instruction slot = identifierConstant(name);
-      emitBytes(name, isSetOp ? OP_SET_GLOBAL : OP_GET_GLOBAL, slot);
+      emitGlobal(name, isSetOp ? OP_SET_GLOBAL : OP_GET_GLOBAL, globalSlot(name));
     }
   }
 
@@ -196,6 +504,26 @@ namespace lox {
     locals_[-1].depth = scopeDepth_;
   }
 
+  void Compiler::scanAssignedNames(const Vector<Stmt*>& stmts) {
+    AssignedNameScanner(assignedNames_).scan(stmts);
+  }
+
+  bool Compiler::isAssignedName(Token* name) {
+    for (int i = 0; i < assignedNames_.size(); i++) {
+      if (*assignedNames_[i] == *name) return true;
+    }
+    return false;
+  }
+
+  int Compiler::resolveInlinedParam(Token* name) const {
+    if (!inlinedParams_) return -1;
+    const Vector<Token*>& names = *inlinedParams_->names;
+    for (int i = 0; i < names.size(); i++) {
+      if (*names[i] == *name) return i;
+    }
+    return -1;
+  }
+
   int Compiler::resolveLocal(Token* name) {
     for (int i = locals_.size() - 1; i >= 0; i--) {
       if (*locals_[i].name == *name) {
@@ -212,19 +540,23 @@ namespace lox {
 
     int local = enclosing_->resolveLocal(name);
     if (local != -1) {
-      enclosing_->locals_[local].isCapturedAsUpvalue = true;
-      return addUpvalue(name, local, true);
+      Local& captured = enclosing_->locals_[local];
+      if (!captured.isCapturableByValue) {
+        captured.isCapturedAsUpvalue = true;
+        enclosing_->function_->setHasCapturedLocals();
+      }
+      return addUpvalue(name, local, true, captured.isCapturableByValue);
     }
 
     int upvalue = enclosing_->resolveUpvalue(name);
     if (upvalue != -1) {
-      return addUpvalue(name, upvalue, false);
+      return addUpvalue(name, upvalue, false, enclosing_->upvalues_[upvalue].isValue);
     }
 
     return -1;
   }
 
-  int Compiler::addUpvalue(SRC, int index, bool isLocal) {
+  int Compiler::addUpvalue(SRC, int index, bool isLocal, bool isValue) {
     // Look for an existing one.
     for (int i = 0; i < function_->upvalueCount(); i++) {
       CompilerUpvalue& upvalue = upvalues_[i];
@@ -236,7 +568,7 @@ namespace lox {
       return 0;
     }
     // Add new upvalue.
-    upvalues_.emplace(index, isLocal);
+    upvalues_.emplace(index, isLocal, isValue);
     return function_->getAndIncrementUpvalue();
   }
 
@@ -250,45 +582,141 @@ namespace lox {
     expr->right->accept(this);
 
     switch (expr->op->type) {
-      case TOKEN_BANG_EQUAL: emitBytes(expr->op, OP_EQUAL, OP_NOT); break;
-      case TOKEN_EQUAL_EQUAL: emitByte(expr->op, OP_EQUAL); break;
-      case TOKEN_GREATER: emitByte(expr->op, OP_GREATER); break;
-      case TOKEN_GREATER_EQUAL: emitBytes(expr->op, OP_LESS, OP_NOT); break;
-      case TOKEN_LESS: emitByte(expr->op, OP_LESS); break;
-      case TOKEN_LESS_EQUAL: emitBytes(expr->op, OP_GREATER, OP_NOT); break;
-      case TOKEN_PLUS: emitByte(expr->op, OP_ADD); break;
-      case TOKEN_MINUS: emitByte(expr->op, OP_SUBTRACT); break;
-      case TOKEN_STAR: emitByte(expr->op, OP_MULTIPLY); break;
-      case TOKEN_SLASH: emitByte(expr->op, OP_DIVIDE); break;
+      case TOKEN_BANG_EQUAL: emitOps(expr->op, OP_EQUAL, OP_NOT); break;
+      case TOKEN_EQUAL_EQUAL: emitOp(expr->op, OP_EQUAL); break;
+      case TOKEN_GREATER: emitOp(expr->op, OP_GREATER); break;
+      case TOKEN_GREATER_EQUAL: emitOps(expr->op, OP_LESS, OP_NOT); break;
+      case TOKEN_LESS: emitOp(expr->op, OP_LESS); break;
+      case TOKEN_LESS_EQUAL: emitOps(expr->op, OP_GREATER, OP_NOT); break;
+      case TOKEN_PLUS: emitOp(expr->op, OP_ADD); break;
+      case TOKEN_MINUS: emitOp(expr->op, OP_SUBTRACT); break;
+      case TOKEN_STAR: emitOp(expr->op, OP_MULTIPLY); break;
+      case TOKEN_SLASH: emitOp(expr->op, OP_DIVIDE); break;
       default: UNREACHABLE();
     }
   }
 
   void Compiler::visit(const Call* expr) {
+    // Only the outermost call of a return value is in tail position, not calls in its operands.
+    bool tail = tailCall_;
+    tailCall_ = false;
+
+    if (expr->inlined && inlineCall(expr)) return;
+
     if (typeid(*expr->callee) == typeid(Get)) {
-      invoke(static_cast<Get*>(expr->callee), expr->arguments);
+      invoke(static_cast<Get*>(expr->callee), expr->arguments, tail);
     } else if (typeid(*expr->callee) == typeid(Super)) {
       superInvoke(static_cast<Super*>(expr->callee), expr->arguments);
     } else {
       // Normal function call
       expr->callee->accept(this);
       compileArguments(expr->arguments);
-      emitBytes(expr->callee->getStart(), OP_CALL, expr->arguments.size());
+      emitCall(expr->callee->getStart(), expr->arguments.size(), tail);
     }
   }
 
-  void Compiler::invoke(const Get* get, const Vector<Expr*>& arguments) {
+  void Compiler::emitCall(SRC, int argCount, bool tail) {
+    if (!tail && argCount <= FIXED_ARITY_CALL_MAX) {
+      emitOp(token, OP_CALL_0 + argCount);
+    } else {
+      emitBytes(token, tail ? OP_TAIL_CALL : OP_CALL, argCount);
+    }
+  }
+
+  bool Compiler::inlineCall(const Call* expr) {
+    const Compiler* script = this;
+    while (script->enclosing_) script = script->enclosing_;
+    ObjFunction* fn = nullptr;
+    for (int i = 0; i < script->functions_.size() && !fn; i++) {
+      if (script->functions_[i].declaration == expr->inlined) fn = script->functions_[i].fn;
+    }
+
+    // The callee and the arguments go where a call would have them, and the body reads the
+    // arguments from there. Arguments that are literals or locals can't fail or have effects, so
+    // when all of them are, the body reads them directly instead and only the call evaluates them.
+    // Local slots and guard operands are single bytes.
+    int maxDepth;
+    int calleeSlot = stackDepth(&maxDepth);
+    int argCount = expr->arguments.size();
+    Chunk& chunk = currentChunk();
+    if (!fn || calleeSlot < 1 || calleeSlot + argCount >= LOCALS_MAX ||
+        chunk.inlinedCalls().size() > UINT8_MAX) {
+      return false;
+    }
+    bool substitute = true;
+    for (int i = 0; i < argCount && substitute; i++) {
+      substitute = isSubstitutableArgument(expr->arguments[i]);
+    }
+    int pushedArgs = substitute ? 0 : argCount;
+
+    Token* token = expr->callee->getStart();
+    expr->callee->accept(this);
+    if (!substitute) compileArguments(expr->arguments);
+
+    emitOp(token, OP_INLINE_GUARD);
+    InlinedCall call;
+    call.fn = fn;
+    call.guard = chunk.count() - 1;
+    call.start = chunk.count() + 4;
+    int index = chunk.addInlinedCall(call);
+    emitByte(token, pushedArgs);
+    emitByte(token, index);
+    emitByte(token, 0xff);
+    emitByte(token, 0xff);
+    int guardJump = chunk.count() - 2;
+
+    InlinedParams params = {&expr->inlined->params, substitute ? &expr->arguments : nullptr,
+                            calleeSlot + 1, inlinedParams_};
+    const InlinedParams* enclosingParams = inlinedParams_;
+    inlinedParams_ = &params;
+    static_cast<const Return*>(expr->inlined->body[0])->value->accept(this);
+    inlinedParams_ = enclosingParams;
+    // Nothing after the body is fused into it, so its range stays exact.
+    chunk.inlinedCall(index).end = markJumpTarget();
+
+    // The result takes the callee's place, as a return would leave it.
+    emitBytes(token, OP_SET_LOCAL, calleeSlot);
+    for (int i = 0; i <= pushedArgs; i++) emitOp(token, OP_POP);
+    int endJump = emitJump(token, OP_JUMP);
+
+    patchJump(token, guardJump);
+    if (substitute) compileArguments(expr->arguments);
+    emitCall(token, argCount, false);
+    patchJump(token, endJump);
+    return true;
+  }
+
+  bool Compiler::isSubstitutableArgument(const Expr* arg) const {
+    if (typeid(*arg) == typeid(Literal)) return true;
+    if (typeid(*arg) != typeid(Variable)) return false;
+    // Substituted parameters of an enclosing inlined body are literals or locals themselves.
+    Token* name = static_cast<const Variable*>(arg)->name;
+    if (resolveInlinedParam(name) != -1) return true;
+    for (int i = locals_.size() - 1; i >= 0; i--) {
+      if (*locals_[i].name == *name) return locals_[i].isInitialized();
+    }
+    return false;
+  }
+
+  void Compiler::invoke(const Get* get, const Vector<Expr*>& arguments, bool tail) {
     get->object->accept(this);
     compileArguments(arguments);
-    emitBytes(get->object->getStart(), OP_INVOKE, identifierConstant(get->name), arguments.size());
+    int name = identifierConstant(get->name);
+    currentChunk().addInvokeCache(name);
+    if (!tail && arguments.size() <= FIXED_ARITY_CALL_MAX) {
+      emitBytes(get->object->getStart(), OP_INVOKE_0 + arguments.size(), name);
+    } else {
+      emitBytes(get->object->getStart(), tail ? OP_TAIL_INVOKE : OP_INVOKE, name, arguments.size());
+    }
   }
 
   void Compiler::superInvoke(const Super* super, const Vector<Expr*>& arguments) {
     preprocessSuper(super);
     compileArguments(arguments);
     namedVariable(super->getStart()); // 'super'
-    emitBytes(super->getStart(), OP_SUPER_INVOKE, identifierConstant(super->method),
-              arguments.size());
+    int name = identifierConstant(super->method);
+    currentChunk().addInvokeCache(name);
+    emitBytes(super->getStart(), OP_SUPER_INVOKE, name, arguments.size());
   }
 
   void Compiler::compileArguments(const Vector<Expr*>& arguments) {
@@ -319,9 +747,9 @@ namespace lox {
         emitConstant(value, Number(n).asValue());
         break;
       }
-      case TOKEN_FALSE: emitByte(value, OP_FALSE); break;
-      case TOKEN_NIL: emitByte(value, OP_NIL); break;
-      case TOKEN_TRUE: emitByte(value, OP_TRUE); break;
+      case TOKEN_FALSE: emitOp(value, OP_FALSE); break;
+      case TOKEN_NIL: emitOp(value, OP_NIL); break;
+      case TOKEN_TRUE: emitOp(value, OP_TRUE); break;
       case TOKEN_STRING: {
         // Trim double quotes.
         ObjString* s = vm_.allocateObj<ObjString>(value->start + 1, value->length - 2);
@@ -373,8 +801,8 @@ namespace lox {
     expr->right->accept(this);
 
     switch (expr->op->type) {
-      case TOKEN_BANG: emitByte(expr->op, OP_NOT); break;
-      case TOKEN_MINUS: emitByte(expr->op, OP_NEGATE); break;
+      case TOKEN_BANG: emitOp(expr->op, OP_NOT); break;
+      case TOKEN_MINUS: emitOp(expr->op, OP_NEGATE); break;
       default: UNREACHABLE();
     }
   }
@@ -393,7 +821,7 @@ namespace lox {
     scopeDepth_--;
     while (!locals_.isEmpty() && locals_[-1].depth > scopeDepth_) {
       Local local = locals_.removeAt(-1);
-      emitByte(token, local.isCapturedAsUpvalue ? OP_CLOSE_UPVALUE : OP_POP);
+      emitOp(token, local.isCapturedAsUpvalue ? OP_CLOSE_UPVALUE : OP_POP);
     }
   }
 
@@ -402,11 +830,11 @@ namespace lox {
   }
 
   void Compiler::visit(const Class* stmt) {
-    instruction slot = identifierConstant(stmt->name);
+    instruction name = identifierConstant(stmt->name);
+    int global = parseVariable(stmt->name);
 
-    if (isLocalScope()) declareVariableLocal(stmt->name);
-    emitBytes(stmt->name, OP_CLASS, slot);
-    defineVariable(stmt->name, slot);
+    emitBytes(stmt->name, OP_CLASS, name);
+    defineVariable(stmt->name, global);
 
     ClassInfo classInfo(currentClass_, stmt->name, !!stmt->superclass);
     currentClass_ = &classInfo;
@@ -422,14 +850,14 @@ namespace lox {
       markInitialized();
 
       namedVariable(stmt->name, false); // Push subclass
-      emitByte(stmt->superclass->name, OP_INHERIT);
+      emitOp(stmt->superclass->name, OP_INHERIT);
     }
 
     namedVariable(stmt->name, false);
     for (int i = 0; i < stmt->methods.size(); i++) {
       compileMethod(stmt->methods[i]);
     }
-    emitByte(stmt->getStop(), OP_POP); // Pop subclass
+    emitOp(stmt->getStop(), OP_END_CLASS); // Builds the dispatch table and pops the class
 
     if (stmt->superclass) endScope(stmt->superclass->name);
     currentClass_ = currentClass_->enclosing;
@@ -445,25 +873,36 @@ namespace lox {
 
   void Compiler::visit(const Expression* stmt) {
     stmt->expression->accept(this);
-    emitByte(stmt->stop, OP_POP);
+    emitOp(stmt->stop, OP_POP);
   }
 
   void Compiler::visit(const Function* stmt) {
-    instruction slot = parseVariable(stmt->name);
-    if (isLocalScope()) markInitialized();
+    int global = parseVariable(stmt->name);
+    if (!isLocalScope()) {
+      functions_.push({stmt, compileFunction(stmt, TYPE_FUNCTION)});
+      defineVariable(stmt->name, global);
+      return;
+    }
 
+    // A recursive function captures its own slot before OP_CLOSURE stores it, so only by
+    // reference.
+    markInitialized();
+    bool isCapturableByValue = locals_[-1].isCapturableByValue;
+    locals_[-1].isCapturableByValue = false;
     compileFunction(stmt, TYPE_FUNCTION);
-    defineVariable(stmt->name, slot);
+    locals_[-1].isCapturableByValue = isCapturableByValue;
   }
 
-  void Compiler::compileFunction(const Function* fn, FunctionType type) {
+  ObjFunction* Compiler::compileFunction(const Function* fn, FunctionType type) {
     Compiler fnCompiler(vm_, this, fn, type);
     fnCompiler.doCompileFunction(fn);
 
     emitClosure(fn->getStart(), fnCompiler.function_, fnCompiler.upvalues_);
+    return fnCompiler.function_;
   }
 
   void Compiler::doCompileFunction(const Function* fn) {
+    scanAssignedNames(fn->body);
     beginScope();
 
     ASSERT(fn->params.size() <= MAX_FUNC_PARAMS,
@@ -483,7 +922,10 @@ namespace lox {
 
     for (int i = 0; i < upvalues.size(); i++) {
       // TODO: Token line is not consistent here.
-      emitByte(token, upvalues[i].isLocal ? 1 : 0);
+      CaptureKind kind = !upvalues[i].isLocal ? CAPTURE_UPVALUE
+                         : upvalues[i].isValue ? CAPTURE_LOCAL_VALUE
+                                               : CAPTURE_LOCAL;
+      emitByte(token, kind);
       emitByte(token, upvalues[i].index);
     }
   }
@@ -491,14 +933,15 @@ namespace lox {
   void Compiler::visit(const If* stmt) {
     stmt->condition->accept(this);
 
-    int thenJumpOffset = emitJump(stmt->getStart(), OP_JUMP_IF_FALSE);
-    emitByte(stmt->getStart(), OP_POP);
+    bool consumesCondition;
+    int thenJumpOffset = emitJumpIfFalse(stmt->getStart(), &consumesCondition);
+    if (!consumesCondition) emitOp(stmt->getStart(), OP_POP);
 
     stmt->thenBranch->accept(this);
     int elseJumpOffset = emitJump(stmt->getStart(), OP_JUMP);
 
     patchJump(stmt->getStart(), thenJumpOffset);
-    emitByte(stmt->getStart(), OP_POP);
+    if (!consumesCondition) emitOp(stmt->getStart(), OP_POP);
 
     if (stmt->elseBranch) stmt->elseBranch->accept(this);
 
@@ -506,14 +949,32 @@ namespace lox {
   }
 
   int Compiler::emitJump(SRC, instruction opCode) {
-    emitByte(token, opCode);
+    emitOp(token, opCode);
     emitByte(token, 0xff);
     emitByte(token, 0xff);
     return currentChunk().count() - 2;
   }
 
+  int Compiler::emitJumpIfFalse(SRC, bool* consumesCondition) {
+    // Compare-and-branch superinstructions pop their operands instead of leaving the condition on
+    // the stack, so the caller must not emit the usual OP_POP on either branch.
+    *consumesCondition = true;
+    if (endsWith({OP_GET_LOCAL, OP_CONSTANT, OP_LESS})) {
+      replaceRecent(3, {OP_LOCAL_CONSTANT_LESS_JUMP, (instruction)recentOperand(3, 0),
+                        (instruction)recentOperand(2, 0), 0xff, 0xff});
+      return currentChunk().count() - 2;
+    }
+    if (endsWith({OP_LESS})) {
+      replaceRecent(1, {OP_LESS_JUMP, 0xff, 0xff});
+      return currentChunk().count() - 2;
+    }
+
+    *consumesCondition = false;
+    return emitJump(token, OP_JUMP_IF_FALSE);
+  }
+
   void Compiler::patchJump(SRC, int offset) {
-    int jump = currentChunk().count() - offset - 2;
+    int jump = markJumpTarget() - offset - 2;
 
     if (jump > UINT16_MAX) {
       error(token, "Too much code to jump over.");
@@ -525,7 +986,7 @@ namespace lox {
 
   void Compiler::visit(const Print* stmt) {
     stmt->expression->accept(this);
-    emitByte(stmt->start, OP_PRINT);
+    emitOp(stmt->start, OP_PRINT);
   }
 
   void Compiler::visit(const Return* stmt) {
@@ -536,43 +997,48 @@ namespace lox {
       if (function_->type() == TYPE_INITIALIZER) {
         error(stmt->getStart(), "Can't return a value from an initializer.");
       }
+      // The OP_RETURN stays after a tail call: calls the VM can't make in place (classes, bound
+      // methods, errors) run as normal calls and return through it.
+      tailCall_ = typeid(*stmt->value) == typeid(Call);
       stmt->value->accept(this);
-      emitByte(stmt->value->getStart(), OP_RETURN);
+      emitOp(stmt->value->getStart(), OP_RETURN);
     } else {
       emitReturn(stmt->getStart());
     }
   }
 
   void Compiler::visit(const Var* stmt) {
-    instruction slot = parseVariable(stmt->name);
+    int global = parseVariable(stmt->name);
 
     if (stmt->initializer)
       stmt->initializer->accept(this);
     else
-      emitByte(stmt->name, OP_NIL);
+      emitOp(stmt->name, OP_NIL);
 
-    defineVariable(stmt->name, slot);
+    defineVariable(stmt->name, global);
   }
 
   void Compiler::visit(const While* stmt) {
-    int loopStart = currentChunk().count();
+    int loopStart = markJumpTarget();
 
     stmt->condition->accept(this);
-    int exitJumpOffset = emitJump(stmt->getStart(), OP_JUMP_IF_FALSE);
-    emitByte(stmt->getStart(), OP_POP);
+    bool consumesCondition;
+    int exitJumpOffset = emitJumpIfFalse(stmt->getStart(), &consumesCondition);
+    if (!consumesCondition) emitOp(stmt->getStart(), OP_POP);
 
     stmt->body->accept(this);
     emitLoop(stmt->getStart(), loopStart);
 
     patchJump(stmt->getStart(), exitJumpOffset);
-    emitByte(stmt->getStart(), OP_POP);
+    if (!consumesCondition) emitOp(stmt->getStart(), OP_POP);
   }
 
   void Compiler::emitLoop(SRC, int loopStart) {
-    int backJumpDistance = currentChunk().count() - loopStart + 3;
+    emitOp(token, OP_LOOP);
+
+    int backJumpDistance = currentChunk().count() - loopStart + 2;
     if (backJumpDistance > UINT16_MAX) error(token, "Loop body too large.");
 
-    emitByte(token, OP_LOOP);
     emitByte(token, (backJumpDistance >> 8) & 0xff);
     emitByte(token, backJumpDistance & 0xff);
   }
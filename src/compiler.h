@@ -2,6 +2,7 @@
 
 #include "ast.h"
 #include "lexer.h"
+#include "op_code.h"
 #include "value/object.h"
 
 namespace lox {
@@ -19,17 +20,22 @@ namespace lox {
 
     Token* name = nullptr;
     int depth = -1;
-    bool isCapturedAsUpvalue = false;
+    bool isCapturedAsUpvalue = false; // By reference, so it's closed when going out of scope.
+    // Closures may copy the value instead of capturing the variable: it isn't assigned after its
+    // initialization, which has run by the time a closure is created.
+    bool isCapturableByValue = false;
   };
 
   struct CompilerUpvalue {
     CompilerUpvalue() {} // TODO: Essentially not necessary
-    CompilerUpvalue(int index, bool isLocal)
+    CompilerUpvalue(int index, bool isLocal, bool isValue)
       : index(index)
-      , isLocal(isLocal) {}
+      , isLocal(isLocal)
+      , isValue(isValue) {}
 
     int index = -1;
     bool isLocal = false;
+    bool isValue = false; // Holds a copy of the variable's value rather than an ObjUpvalue.
   };
 
   struct ClassInfo {
@@ -43,6 +49,23 @@ namespace lox {
     bool hasSuperclass;
   };
 
+  // Parameters of a function whose body is compiled in place of a call to it: either the
+  // argument expressions, compiled where the parameter is read, or the arguments' values, in
+  // consecutive stack slots from `firstSlot`. Arguments are compiled with the parameters of the
+  // body they appear in, `enclosing`.
+  struct InlinedParams {
+    const Vector<Token*>* names;
+    const Vector<Expr*>* arguments;
+    int firstSlot;
+    const InlinedParams* enclosing;
+  };
+
+  // A top-level function of the script, for calls inlined after it to guard against.
+  struct CompiledFunction {
+    const Function* declaration;
+    ObjFunction* fn;
+  };
+
   class Compiler
     : public Expr::Visitor<void>
     , public Stmt::Visitor<void> {
@@ -91,28 +114,50 @@ namespace lox {
     void endCompiler(SRC);
 
     void emitByte(SRC, instruction inst);
-    void emitBytes(SRC, instruction inst1, instruction inst2);
-    void emitBytes(SRC, instruction inst1, instruction inst2, instruction inst3);
+    void emitBytes(SRC, instruction op, instruction operand);
+    void emitBytes(SRC, instruction op, instruction operand1, instruction operand2);
+    void emitOp(SRC, instruction op);
+    void emitOps(SRC, instruction op1, instruction op2);
+
+    // Superinstructions: sequences of the most recently emitted opcodes are replaced with a fused
+    // opcode just before the next instruction starts, unless a jump may land inside them.
+    bool endsWith(std::initializer_list<OpCode> ops) const;
+    int recentOperand(int nthFromLast, int index) const;
+    void replaceRecent(int n, std::initializer_list<instruction> fused);
+    void fuseSuperinstructions();
+    int markJumpTarget();
     void emitReturn(SRC);
     void emitConstant(SRC, Value value);
 
     int makeConstant(SRC, Value value);
     int identifierConstant(SRC);
     int addConstant(Value value);
+    // Upper bound of the value stack slots a call frame of the function uses, counting from its
+    // callee slot.
+    int computeStackSize() const;
+    // Number of values on the stack, callee slot included, after the code emitted so far. Sets
+    // `maxDepth` to the peak computeStackSize() reports.
+    int stackDepth(int* maxDepth) const;
+    // Global variables are addressed by VM slot with a two-byte operand.
+    int globalSlot(Token* name);
+    void emitGlobal(SRC, OpCode op, int slot);
     void error(SRC, const char* message);
 
     int parseVariable(Token* var);
     void declareVariableLocal(Token* var);
     void addLocal(Token* var);
-    void defineVariable(Token* var, instruction global = -1);
+    void defineVariable(Token* var, int global = -1);
     void namedVariable(Token* name, bool isSetOp = false);
     void markInitialized();
+    void scanAssignedNames(const Vector<Stmt*>& stmts);
+    bool isAssignedName(Token* name);
 
     void namedProperty(Expr* receiver, Token* name, bool isSetOp = false);
 
+    int resolveInlinedParam(Token* name) const;
     int resolveLocal(Token* name);
     int resolveUpvalue(Token* name);
-    int addUpvalue(SRC, int index, bool isLocal);
+    int addUpvalue(SRC, int index, bool isLocal, bool isValue);
 
     bool isLocalScope() const {
       return scopeDepth_ > 0;
@@ -127,18 +172,24 @@ namespace lox {
     void compileBlock(const Vector<Stmt*>& stmts);
 
     int emitJump(SRC, instruction opCode);
+    int emitJumpIfFalse(SRC, bool* consumesCondition);
     void patchJump(SRC, int offset);
     void emitLoop(SRC, int loopStart);
 
     static constexpr int MAX_FUNC_PARAMS = 255;
-    void compileFunction(const Function* fn, FunctionType type);
+    ObjFunction* compileFunction(const Function* fn, FunctionType type);
     void doCompileFunction(const Function* fn);
     void emitClosure(SRC, ObjFunction* fn, const Vector<CompilerUpvalue>& upvalues);
     void compileArguments(const Vector<Expr*>& arguments);
+    void emitCall(SRC, int argCount, bool tail);
+    // Compiles a call the Inliner marked. Returns false, having emitted nothing, if it can't be
+    // inlined here after all.
+    bool inlineCall(const Call* expr);
+    bool isSubstitutableArgument(const Expr* arg) const;
 
     void compileMethod(const Function* method);
 
-    void invoke(const Get* get, const Vector<Expr*>& arguments);
+    void invoke(const Get* get, const Vector<Expr*>& arguments, bool tail);
     void superInvoke(const Super* super, const Vector<Expr*>& arguments);
     void preprocessSuper(const Super* super);
 
@@ -161,6 +212,23 @@ namespace lox {
 
     static constexpr int UPVALUES_MAX = 256;
     Vector<CompilerUpvalue> upvalues_; // TODO: Fixed size container
+
+    // Names assigned anywhere in the function, nested functions included. A local whose name isn't
+    // among them keeps its initial value and can be captured by value.
+    Vector<Token*> assignedNames_;
+
+    static constexpr int FUSE_WINDOW = 4;
+    int recentOps_[FUSE_WINDOW]; // Offsets of the last emitted opcodes, oldest first.
+    int recentOpCount_ = 0;
+    int lastJumpTarget_ = 0;
+
+    // Set by a return statement whose value is a call, which then compiles to a tail call.
+    bool tailCall_ = false;
+
+    // Filled in by the script's compiler only.
+    Vector<CompiledFunction> functions_;
+    // Set while the body of an inlined call is compiled.
+    const InlinedParams* inlinedParams_ = nullptr;
   };
 
 }; // namespace lox
@@ -4,6 +4,8 @@
 
 #include "chunk.h"
 #include "op_code.h"
+#include "register_op_code.h"
+#include "value/object.h"
 #include "value/value.h"
 
 namespace lox {
@@ -35,11 +37,12 @@ namespace lox {
         case OP_POP: return simpleInstruction("OP_POP", offset);
         case OP_GET_LOCAL: return byteInstruction("OP_GET_LOCAL", chunk, offset);
         case OP_SET_LOCAL: return byteInstruction("OP_SET_LOCAL", chunk, offset);
-        case OP_GET_GLOBAL: return constantInstruction("OP_GET_GLOBAL", chunk, offset);
-        case OP_DEFINE_GLOBAL: return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
-        case OP_SET_GLOBAL: return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+        case OP_GET_GLOBAL: return globalInstruction("OP_GET_GLOBAL", chunk, offset);
+        case OP_DEFINE_GLOBAL: return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+        case OP_SET_GLOBAL: return globalInstruction("OP_SET_GLOBAL", chunk, offset);
         case OP_GET_UPVALUE: return byteInstruction("OP_GET_UPVALUE", chunk, offset);
         case OP_SET_UPVALUE: return byteInstruction("OP_SET_UPVALUE", chunk, offset);
+        case OP_GET_CAPTURED: return byteInstruction("OP_GET_CAPTURED", chunk, offset);
         case OP_GET_PROPERTY: return constantInstruction("OP_GET_PROPERTY", chunk, offset);
         case OP_SET_PROPERTY: return constantInstruction("OP_SET_PROPERTY", chunk, offset);
         case OP_GET_SUPER: return constantInstruction("OP_GET_SUPER", chunk, offset);
@@ -61,6 +64,16 @@ namespace lox {
         case OP_CALL: return byteInstruction("OP_CALL", chunk, offset);
         case OP_INVOKE: return invokeInstruction("OP_INVOKE", chunk, offset);
         case OP_SUPER_INVOKE: return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+        case OP_TAIL_CALL: return byteInstruction("OP_TAIL_CALL", chunk, offset);
+        case OP_TAIL_INVOKE: return invokeInstruction("OP_TAIL_INVOKE", chunk, offset);
+        case OP_CALL_0: return simpleInstruction("OP_CALL_0", offset);
+        case OP_CALL_1: return simpleInstruction("OP_CALL_1", offset);
+        case OP_CALL_2: return simpleInstruction("OP_CALL_2", offset);
+        case OP_CALL_3: return simpleInstruction("OP_CALL_3", offset);
+        case OP_INVOKE_0: return constantInstruction("OP_INVOKE_0", chunk, offset);
+        case OP_INVOKE_1: return constantInstruction("OP_INVOKE_1", chunk, offset);
+        case OP_INVOKE_2: return constantInstruction("OP_INVOKE_2", chunk, offset);
+        case OP_INVOKE_3: return constantInstruction("OP_INVOKE_3", chunk, offset);
         case OP_CLOSURE: {
           offset++;
           uint8_t constant = chunk.getCode(offset++);
@@ -70,10 +83,13 @@ namespace lox {
 
           ObjFunction* fn = chunk.getConstant(constant).asFunction();
           for (int i = 0; i < fn->upvalueCount(); i++) {
-            int isLocal = chunk.getCode(offset++);
+            int kind = chunk.getCode(offset++);
             int index = chunk.getCode(offset++);
             printf("%04d      |                     %s %d\n", offset - 2,
-                   isLocal ? "local" : "upvalue", index);
+                   kind == CAPTURE_LOCAL_VALUE ? "value"
+                   : kind == CAPTURE_LOCAL     ? "local"
+                                               : "upvalue",
+                   index);
           }
           return offset;
         }
@@ -82,11 +98,177 @@ namespace lox {
         case OP_CLASS: return constantInstruction("OP_CLASS", chunk, offset);
         case OP_INHERIT: return simpleInstruction("OP_INHERIT", offset);
         case OP_METHOD: return constantInstruction("OP_METHOD", chunk, offset);
+        case OP_END_CLASS: return simpleInstruction("OP_END_CLASS", offset);
+        case OP_SET_LOCAL_POP: return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+        case OP_GET_LOCALS: return twoByteInstruction("OP_GET_LOCALS", chunk, offset);
+        case OP_GET_LOCAL_PROPERTY:
+          return localConstantInstruction("OP_GET_LOCAL_PROPERTY", chunk, offset);
+        case OP_ADD_LOCAL_CONSTANT:
+          return localConstantInstruction("OP_ADD_LOCAL_CONSTANT", chunk, offset);
+        case OP_LESS_JUMP: return jumpInstruction("OP_LESS_JUMP", 1, chunk, offset);
+        case OP_LOCAL_CONSTANT_LESS_JUMP: {
+          localConstantInstruction("OP_LOCAL_CONSTANT_LESS_JUMP", chunk, offset);
+          uint16_t jump = (uint16_t)(chunk.getCode(offset + 3) << 8 | chunk.getCode(offset + 4));
+          printf("%04d      |                     -> %d\n", offset + 3, offset + 5 + jump);
+          return offset + 5;
+        }
+        case OP_INLINE_GUARD: {
+          const InlinedCall& call = chunk.inlinedCalls()[chunk.getCode(offset + 2)];
+          uint16_t jump = (uint16_t)(chunk.getCode(offset + 3) << 8 | chunk.getCode(offset + 4));
+          printf("%-16s %4d '", "OP_INLINE_GUARD", chunk.getCode(offset + 1));
+          printValue(call.fn->asValue());
+          printf("' [%d, %d) else -> %d\n", call.start, call.end, offset + 5 + jump);
+          return offset + 5;
+        }
+        case OP_ADD_NUM: return simpleInstruction("OP_ADD_NUM", offset);
+        case OP_ADD_STR: return simpleInstruction("OP_ADD_STR", offset);
+        case OP_ADD_GENERIC: return simpleInstruction("OP_ADD_GENERIC", offset);
+        case OP_EQUAL_NUM: return simpleInstruction("OP_EQUAL_NUM", offset);
+        case OP_EQUAL_GENERIC: return simpleInstruction("OP_EQUAL_GENERIC", offset);
+        default: printf("Unknown opcode %d\n", instruction); return offset + 1;
+      }
+    }
+
+    // Offset of the instruction following the one at `offset`, decoded without printing.
+    static int nextOffset(const Chunk& chunk, int offset) {
+      switch (chunk.getCode(offset)) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_CAPTURED:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_INVOKE_0:
+        case OP_INVOKE_1:
+        case OP_INVOKE_2:
+        case OP_INVOKE_3:
+        case OP_SET_LOCAL_POP: return offset + 2;
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_AND:
+        case OP_OR:
+        case OP_LOOP:
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+        case OP_TAIL_INVOKE:
+        case OP_GET_LOCALS:
+        case OP_GET_LOCAL_PROPERTY:
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_LESS_JUMP: return offset + 3;
+        case OP_LOCAL_CONSTANT_LESS_JUMP:
+        case OP_INLINE_GUARD: return offset + 5;
+        case OP_CLOSURE: {
+          ObjFunction* fn = chunk.getConstant(chunk.getCode(offset + 1)).asFunction();
+          return offset + 2 + fn->upvalueCount() * 2;
+        }
+        default: return offset + 1;
+      }
+    }
+
+    static void disassembleRegisterChunk(const Chunk& chunk, const char* name) {
+      printf("== %s (registers) ==\n", name);
+
+      for (int offset = 0; offset < chunk.count();) {
+        offset = disassembleRegisterInstruction(chunk, offset);
+      }
+    }
+
+    static int disassembleRegisterInstruction(const Chunk& chunk, int offset) {
+      printf("%04d ", offset);
+      if (offset > 0 && chunk.getLine(offset) == chunk.getLine(offset - 1)) {
+        printf("   | ");
+      } else {
+        printf("%4d ", chunk.getLine(offset));
+      }
+
+      uint8_t instruction = chunk.getCode(offset);
+      const char* name = registerOpcodeName(instruction);
+      switch (instruction) {
+        case ROP_LOAD_NIL:
+        case ROP_LOAD_TRUE:
+        case ROP_LOAD_FALSE:
+        case ROP_PRINT:
+        case ROP_RETURN: return registerInstruction(name, chunk, offset, 1, -1);
+        case ROP_MOVE:
+        case ROP_NOT:
+        case ROP_NEGATE:
+        case ROP_CALL: return registerInstruction(name, chunk, offset, 2, -1);
+        case ROP_LOAD_CONSTANT:
+        case ROP_CLOSURE: return registerInstruction(name, chunk, offset, 2, 1);
+        case ROP_GET_GLOBAL:
+        case ROP_SET_GLOBAL:
+        case ROP_DEFINE_GLOBAL: {
+          printf("%-24s", name);
+          printRegisterOperands(chunk, offset, 1, -1);
+          printf(" G%d\n", chunk.getCode(offset + 2) << 8 | chunk.getCode(offset + 3));
+          return offset + 4;
+        }
+        case ROP_EQUAL:
+        case ROP_GREATER:
+        case ROP_LESS:
+        case ROP_ADD:
+        case ROP_SUBTRACT:
+        case ROP_MULTIPLY:
+        case ROP_DIVIDE: return registerInstruction(name, chunk, offset, 3, -1);
+        case ROP_ADD_CONSTANT:
+        case ROP_SUBTRACT_CONSTANT: return registerInstruction(name, chunk, offset, 3, 2);
+        case ROP_RETURN_NIL: return simpleInstruction(name, offset);
+        case ROP_JUMP: return jumpInstruction(name, 1, chunk, offset);
+        case ROP_LOOP: return jumpInstruction(name, -1, chunk, offset);
+        case ROP_JUMP_IF_FALSE:
+        case ROP_JUMP_IF_TRUE: return registerJumpInstruction(name, chunk, offset, 1, -1);
+        case ROP_JUMP_IF_NOT_LESS: return registerJumpInstruction(name, chunk, offset, 2, -1);
+        case ROP_JUMP_IF_NOT_LESS_K: return registerJumpInstruction(name, chunk, offset, 2, 1);
         default: printf("Unknown opcode %d\n", instruction); return offset + 1;
       }
     }
 
    private:
+    // Prints `count` operands; the one at `constantIndex` (if any) is shown as a constant.
+    static void printRegisterOperands(const Chunk& chunk, int offset, int count,
+                                      int constantIndex) {
+      for (int i = 0; i < count; i++) {
+        uint8_t operand = chunk.getCode(offset + 1 + i);
+        if (i == constantIndex) {
+          printf(" K%d '", operand);
+          printValue(chunk.getConstant(operand));
+          printf("'");
+        } else if (i == 1 && chunk.getCode(offset) == ROP_CALL) {
+          printf(" (%d args)", operand);
+        } else {
+          printf(" R%d", operand);
+        }
+      }
+    }
+
+    static int registerInstruction(const char* name, const Chunk& chunk, int offset, int count,
+                                   int constantIndex) {
+      printf("%-24s", name);
+      printRegisterOperands(chunk, offset, count, constantIndex);
+      printf("\n");
+      return offset + 1 + count;
+    }
+
+    static int registerJumpInstruction(const char* name, const Chunk& chunk, int offset,
+                                       int count, int constantIndex) {
+      printf("%-24s", name);
+      printRegisterOperands(chunk, offset, count, constantIndex);
+      int jumpOffset = offset + 1 + count;
+      uint16_t jump = (uint16_t)(chunk.getCode(jumpOffset) << 8 | chunk.getCode(jumpOffset + 1));
+      printf(" -> %d\n", jumpOffset + 2 + jump);
+      return jumpOffset + 2;
+    }
+
     static int constantInstruction(const char* name, const Chunk& chunk, int offset) {
       uint8_t constant = chunk.getCode(offset + 1);
       printf("%-16s %4d '", name, constant);
@@ -95,6 +277,13 @@ namespace lox {
       return offset + 2;
     }
 
+    // Globals are VM slots; their names aren't known to the chunk.
+    static int globalInstruction(const char* name, const Chunk& chunk, int offset) {
+      int slot = chunk.getCode(offset + 1) << 8 | chunk.getCode(offset + 2);
+      printf("%-16s %4d\n", name, slot);
+      return offset + 3;
+    }
+
     static int invokeInstruction(const char* name, const Chunk& chunk, int offset) {
       uint8_t constant = chunk.getCode(offset + 1);
       uint8_t argCount = chunk.getCode(offset + 2);
@@ -115,6 +304,20 @@ namespace lox {
       return offset + 2;
     }
 
+    static int twoByteInstruction(const char* name, const Chunk& chunk, int offset) {
+      printf("%-16s %4d %4d\n", name, chunk.getCode(offset + 1), chunk.getCode(offset + 2));
+      return offset + 3;
+    }
+
+    static int localConstantInstruction(const char* name, const Chunk& chunk, int offset) {
+      uint8_t slot = chunk.getCode(offset + 1);
+      uint8_t constant = chunk.getCode(offset + 2);
+      printf("%-16s %4d %4d '", name, slot, constant);
+      printValue(chunk.getConstant(constant));
+      printf("'\n");
+      return offset + 3;
+    }
+
     static int jumpInstruction(const char* name, int sign, const Chunk& chunk, int offset) {
       uint16_t jump = (uint16_t)(chunk.getCode(offset + 1) << 8);
       jump |= chunk.getCode(offset + 2);
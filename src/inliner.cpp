@@ -0,0 +1,355 @@
+#include "inliner.h"
+
+#include "common.h"
+#include "lexer.h"
+
+namespace lox {
+
+  static bool containsName(const Vector<Token*>& names, Token* name) {
+    for (int i = 0; i < names.size(); i++) {
+      if (*names[i] == *name) return true;
+    }
+    return false;
+  }
+
+  static void addName(Vector<Token*>& names, Token* name) {
+    if (!containsName(names, name)) names.push(name);
+  }
+
+  // Value of the only statement of an inlinable function, a return.
+  static const Expr* returnValue(const Function* fn) {
+    return static_cast<const Return*>(fn->body[0])->value;
+  }
+
+  // Collects the declared and assigned names of a script, including the ones in functions and
+  // methods.
+  class DeclarationScanner
+    : public Expr::Visitor<void>
+    , public Stmt::Visitor<void> {
+   public:
+    DeclarationScanner(Vector<Token*>& globalNames, Vector<Token*>& localNames,
+                       Vector<Token*>& assignedNames)
+      : globalNames_(globalNames)
+      , localNames_(localNames)
+      , assignedNames_(assignedNames) {}
+
+    void scan(const Vector<Stmt*>& stmts) {
+      for (int i = 0; i < stmts.size(); i++) stmts[i]->accept(this);
+    }
+
+   private:
+    void declare(Token* name) {
+      if (scopeDepth_ == 0) {
+        globalNames_.push(name);
+      } else {
+        addName(localNames_, name);
+      }
+    }
+
+    void scanFunction(const Function* fn) {
+      scopeDepth_++;
+      for (int i = 0; i < fn->params.size(); i++) addName(localNames_, fn->params[i]);
+      scan(fn->body);
+      scopeDepth_--;
+    }
+
+    virtual void visit(const Assign* expr) {
+      addName(assignedNames_, expr->name);
+      expr->value->accept(this);
+    }
+    virtual void visit(const Binary* expr) {
+      expr->left->accept(this);
+      expr->right->accept(this);
+    }
+    virtual void visit(const Call* expr) {
+      expr->callee->accept(this);
+      for (int i = 0; i < expr->arguments.size(); i++) expr->arguments[i]->accept(this);
+    }
+    virtual void visit(const Get* expr) {
+      expr->object->accept(this);
+    }
+    virtual void visit(const Grouping* expr) {
+      expr->expression->accept(this);
+    }
+    virtual void visit(const Literal* expr) {}
+    virtual void visit(const Logical* expr) {
+      expr->left->accept(this);
+      expr->right->accept(this);
+    }
+    virtual void visit(const Set* expr) {
+      expr->object->accept(this);
+      expr->value->accept(this);
+    }
+    virtual void visit(const Super* expr) {}
+    virtual void visit(const This* expr) {}
+    virtual void visit(const Unary* expr) {
+      expr->right->accept(this);
+    }
+    virtual void visit(const Variable* expr) {}
+
+    virtual void visit(const Block* stmt) {
+      scopeDepth_++;
+      scan(stmt->statements);
+      scopeDepth_--;
+    }
+    virtual void visit(const Class* stmt) {
+      declare(stmt->name);
+      for (int i = 0; i < stmt->methods.size(); i++) scanFunction(stmt->methods[i]);
+    }
+    virtual void visit(const Expression* stmt) {
+      stmt->expression->accept(this);
+    }
+    virtual void visit(const Function* stmt) {
+      declare(stmt->name);
+      scanFunction(stmt);
+    }
+    virtual void visit(const If* stmt) {
+      stmt->condition->accept(this);
+      stmt->thenBranch->accept(this);
+      if (stmt->elseBranch) stmt->elseBranch->accept(this);
+    }
+    virtual void visit(const Print* stmt) {
+      stmt->expression->accept(this);
+    }
+    virtual void visit(const Return* stmt) {
+      if (stmt->value) stmt->value->accept(this);
+    }
+    virtual void visit(const Var* stmt) {
+      declare(stmt->name);
+      if (stmt->initializer) stmt->initializer->accept(this);
+    }
+    virtual void visit(const While* stmt) {
+      stmt->condition->accept(this);
+      stmt->body->accept(this);
+    }
+
+    Vector<Token*>& globalNames_;
+    Vector<Token*>& localNames_;
+    Vector<Token*>& assignedNames_;
+    int scopeDepth_ = 0;
+  };
+
+  // Checks whether an expression is free of side effects and measures it, as the compiler will see
+  // it: calls that were inlined count as their arguments and the callee's body, any other call as
+  // a side effect.
+  class PureExprScanner : public Expr::Visitor<void> {
+   public:
+    // Reads of `params` aren't collected as free names.
+    PureExprScanner(const Vector<Token*>& params)
+      : params_(params) {}
+
+    void scan(const Expr* expr) {
+      expr->accept(this);
+    }
+
+    bool pure = true;
+    bool usesThis = false;
+    int size = 0; // Number of nodes, not counting groupings.
+    Vector<Token*> freeNames;
+
+   private:
+    virtual void visit(const Assign* expr) {
+      pure = false;
+    }
+    virtual void visit(const Binary* expr) {
+      size++;
+      expr->left->accept(this);
+      expr->right->accept(this);
+    }
+    virtual void visit(const Call* expr) {
+      if (!expr->inlined) {
+        pure = false;
+        return;
+      }
+      for (int i = 0; i < expr->arguments.size(); i++) expr->arguments[i]->accept(this);
+      // The callee was checked when it became a candidate; only its size and globals matter here.
+      PureExprScanner callee(expr->inlined->params);
+      callee.scan(returnValue(expr->inlined));
+      size += callee.size;
+      for (int i = 0; i < callee.freeNames.size(); i++) addName(freeNames, callee.freeNames[i]);
+    }
+    virtual void visit(const Get* expr) {
+      size++;
+      expr->object->accept(this);
+    }
+    virtual void visit(const Grouping* expr) {
+      expr->expression->accept(this);
+    }
+    virtual void visit(const Literal* expr) {
+      size++;
+    }
+    virtual void visit(const Logical* expr) {
+      size++;
+      expr->left->accept(this);
+      expr->right->accept(this);
+    }
+    virtual void visit(const Set* expr) {
+      pure = false;
+    }
+    virtual void visit(const Super* expr) {
+      pure = false;
+    }
+    virtual void visit(const This* expr) {
+      size++;
+      usesThis = true;
+    }
+    virtual void visit(const Unary* expr) {
+      size++;
+      expr->right->accept(this);
+    }
+    virtual void visit(const Variable* expr) {
+      size++;
+      if (!containsName(params_, expr->name)) addName(freeNames, expr->name);
+    }
+
+    const Vector<Token*>& params_;
+  };
+
+  Inliner::Inliner(int budget)
+    : budget_(budget) {}
+
+  void Inliner::run(const Vector<Stmt*>& stmts) {
+    DeclarationScanner(globalNames_, localNames_, assignedNames_).scan(stmts);
+    scan(stmts);
+  }
+
+  void Inliner::scan(const Vector<Stmt*>& stmts) {
+    for (int i = 0; i < stmts.size(); i++) stmts[i]->accept(this);
+  }
+
+  bool Inliner::isStableGlobal(Token* name) {
+    int declarations = 0;
+    for (int i = 0; i < globalNames_.size(); i++) {
+      if (*globalNames_[i] == *name) declarations++;
+    }
+    return declarations == 1 && !containsName(assignedNames_, name) &&
+           !containsName(localNames_, name);
+  }
+
+  void Inliner::addCandidate(const Function* fn) {
+    if (fn->body.size() != 1 || typeid(*fn->body[0]) != typeid(Return)) return;
+    const Expr* body = returnValue(fn);
+    if (!body || !isStableGlobal(fn->name)) return;
+
+    PureExprScanner scanner(fn->params);
+    scanner.scan(body);
+    bool inlinable = scanner.pure && !scanner.usesThis && scanner.size <= budget_;
+    // A local of the same name at the call site would be read instead of the global.
+    for (int i = 0; inlinable && i < scanner.freeNames.size(); i++) {
+      if (containsName(localNames_, scanner.freeNames[i])) inlinable = false;
+    }
+
+    if (inlinable) candidates_.push(fn);
+  }
+
+  const Function* Inliner::findCandidate(const Expr* callee) {
+    if (typeid(*callee) != typeid(Variable)) return nullptr;
+    Token* name = static_cast<const Variable*>(callee)->name;
+    for (int i = 0; i < candidates_.size(); i++) {
+      if (*candidates_[i]->name == *name) return candidates_[i];
+    }
+    return nullptr;
+  }
+
+  void Inliner::inlineCall(const Call* call) {
+    const Function* candidate = findCandidate(call->callee);
+    // A call with the wrong number of arguments is left to fail at runtime.
+    if (candidate && call->arguments.size() == candidate->params.size()) call->inlined = candidate;
+  }
+
+  void Inliner::visit(const Assign* expr) {
+    expr->value->accept(this);
+  }
+
+  void Inliner::visit(const Binary* expr) {
+    expr->left->accept(this);
+    expr->right->accept(this);
+  }
+
+  void Inliner::visit(const Call* expr) {
+    expr->callee->accept(this);
+    for (int i = 0; i < expr->arguments.size(); i++) expr->arguments[i]->accept(this);
+    inlineCall(expr);
+  }
+
+  void Inliner::visit(const Get* expr) {
+    expr->object->accept(this);
+  }
+
+  void Inliner::visit(const Grouping* expr) {
+    expr->expression->accept(this);
+  }
+
+  void Inliner::visit(const Literal* expr) {}
+
+  void Inliner::visit(const Logical* expr) {
+    expr->left->accept(this);
+    expr->right->accept(this);
+  }
+
+  void Inliner::visit(const Set* expr) {
+    expr->object->accept(this);
+    expr->value->accept(this);
+  }
+
+  void Inliner::visit(const Super* expr) {}
+
+  void Inliner::visit(const This* expr) {}
+
+  void Inliner::visit(const Unary* expr) {
+    expr->right->accept(this);
+  }
+
+  void Inliner::visit(const Variable* expr) {}
+
+  void Inliner::visit(const Block* stmt) {
+    scopeDepth_++;
+    scan(stmt->statements);
+    scopeDepth_--;
+  }
+
+  void Inliner::visit(const Class* stmt) {
+    scopeDepth_++;
+    for (int i = 0; i < stmt->methods.size(); i++) scan(stmt->methods[i]->body);
+    scopeDepth_--;
+  }
+
+  void Inliner::visit(const Expression* stmt) {
+    stmt->expression->accept(this);
+  }
+
+  void Inliner::visit(const Function* stmt) {
+    // Calls in the body are inlined first, so the function can be inlined with their expansions.
+    scopeDepth_++;
+    scan(stmt->body);
+    scopeDepth_--;
+
+    // The function becomes a candidate only after its declaration, so calls that may run before
+    // the declaration, and recursive calls, keep calling it.
+    if (scopeDepth_ == 0) addCandidate(stmt);
+  }
+
+  void Inliner::visit(const If* stmt) {
+    stmt->condition->accept(this);
+    stmt->thenBranch->accept(this);
+    if (stmt->elseBranch) stmt->elseBranch->accept(this);
+  }
+
+  void Inliner::visit(const Print* stmt) {
+    stmt->expression->accept(this);
+  }
+
+  void Inliner::visit(const Return* stmt) {
+    if (stmt->value) stmt->value->accept(this);
+  }
+
+  void Inliner::visit(const Var* stmt) {
+    if (stmt->initializer) stmt->initializer->accept(this);
+  }
+
+  void Inliner::visit(const While* stmt) {
+    stmt->condition->accept(this);
+    stmt->body->accept(this);
+  }
+
+}; // namespace lox
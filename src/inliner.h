@@ -0,0 +1,74 @@
+#pragma once
+
+#include "ast.h"
+#include "lib/vector.h"
+
+namespace lox {
+
+  // Optimization pass over a parsed script, run before it is compiled. A call to a small global
+  // function gets the function as Call::inlined, and the stack compiler emits the function's return
+  // value expression in place of the call (see Compiler::inlineCall).
+  //
+  // The call still evaluates its callee and arguments in order, and the compiled body reads the
+  // arguments from their stack slots. A guard then checks that the callee is the function that was
+  // inlined, since a later script on the same VM may redefine or assign the global, and makes a
+  // real call if it isn't. A runtime error in an inlined body reports the callee as a frame of its
+  // own, as if it had been called.
+  //
+  // A function is inlined only where the guard is bound to hold while the script runs: it is
+  // declared once at the top level, never assigned, never shadowed by a local of the same name,
+  // and the call comes after the declaration. Its body must be a single `return` of a
+  // side-effect free expression of at most `budget` nodes that reads only its parameters and
+  // globals that no local shadows, and calls only functions inlined before it, so it can't recurse
+  // or capture anything.
+  class Inliner
+    : public Expr::Visitor<void>
+    , public Stmt::Visitor<void> {
+   public:
+    Inliner(int budget);
+
+    void run(const Vector<Stmt*>& stmts);
+
+   private:
+    virtual void visit(const Assign* expr);
+    virtual void visit(const Binary* expr);
+    virtual void visit(const Call* expr);
+    virtual void visit(const Get* expr);
+    virtual void visit(const Grouping* expr);
+    virtual void visit(const Literal* expr);
+    virtual void visit(const Logical* expr);
+    virtual void visit(const Set* expr);
+    virtual void visit(const Super* expr);
+    virtual void visit(const This* expr);
+    virtual void visit(const Unary* expr);
+    virtual void visit(const Variable* expr);
+
+    virtual void visit(const Block* stmt);
+    virtual void visit(const Class* stmt);
+    virtual void visit(const Expression* stmt);
+    virtual void visit(const Function* stmt);
+    virtual void visit(const If* stmt);
+    virtual void visit(const Print* stmt);
+    virtual void visit(const Return* stmt);
+    virtual void visit(const Var* stmt);
+    virtual void visit(const While* stmt);
+
+    void scan(const Vector<Stmt*>& stmts);
+    bool isStableGlobal(Token* name);
+    void addCandidate(const Function* fn);
+    const Function* findCandidate(const Expr* callee);
+    void inlineCall(const Call* call);
+
+   private:
+    int budget_;
+    int scopeDepth_ = 0;
+
+    // Filled in by a pass over the whole script before any call is inlined.
+    Vector<Token*> globalNames_; // Once per top-level declaration, so duplicates are redeclarations.
+    Vector<Token*> localNames_;  // Names of locals, parameters, local functions and classes.
+    Vector<Token*> assignedNames_;
+
+    Vector<const Function*> candidates_;
+  };
+
+}; // namespace lox
@@ -0,0 +1,776 @@
+#include "jit.h"
+
+#include <stddef.h>
+
+#include "common.h"
+#include "debug.h"
+#include "lib/vector.h"
+#include "memory.h"
+#include "op_code.h"
+#include "value/object.h"
+#include "vm.h"
+#include "x64_assembler.h"
+
+namespace lox {
+
+  Value* Jit::slowPath(JitContext* context, Value* sp, const instruction* ip) {
+    // The instructions' semantics are the VM's, which run() shares (see VM::getGlobal). The
+    // native code only reloads the stack top, from the return value.
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)(ip[-2] << 8 | ip[-1]))
+#define READ_CONSTANT() (frame->closure->fn()->chunk().getConstant(READ_BYTE()))
+
+#define PUSH(value) (*sp++ = (value))
+
+#define RUN_HELPER(call) \
+  do {                   \
+    frame->ip = ip;      \
+    return (call);       \
+  } while (false)
+
+    VM* vm = context->vm;
+    CallFrame* frame = context->frame;
+    Value* slots = frame->slots;
+    instruction op = READ_BYTE();
+    switch (op) {
+      case OP_GET_GLOBAL: RUN_HELPER(vm->getGlobal(sp, READ_SHORT()));
+      case OP_SET_GLOBAL: RUN_HELPER(vm->setGlobal(sp, READ_SHORT()));
+      case OP_DEFINE_GLOBAL: RUN_HELPER(vm->defineGlobal(sp, READ_SHORT()));
+
+      case OP_GET_UPVALUE: RUN_HELPER(vm->getUpvalue(frame->closure, sp, READ_BYTE()));
+      case OP_SET_UPVALUE: RUN_HELPER(vm->setUpvalue(frame->closure, sp, READ_BYTE()));
+      case OP_GET_CAPTURED: RUN_HELPER(vm->getCaptured(frame->closure, sp, READ_BYTE()));
+
+      case OP_GET_LOCAL_PROPERTY:
+        PUSH(slots[READ_BYTE()]);
+        // Fall through.
+      case OP_GET_PROPERTY: RUN_HELPER(vm->getProperty(frame, sp, READ_BYTE()));
+      case OP_SET_PROPERTY: RUN_HELPER(vm->setProperty(frame, sp, READ_BYTE()));
+
+      case OP_EQUAL:
+      case OP_EQUAL_NUM:
+      case OP_EQUAL_GENERIC: RUN_HELPER(vm->equal(sp));
+
+      case OP_ADD_LOCAL_CONSTANT: {
+        PUSH(slots[READ_BYTE()]);
+        PUSH(READ_CONSTANT());
+      }
+        // Fall through.
+      case OP_ADD:
+      case OP_ADD_NUM:
+      case OP_ADD_STR:
+      case OP_ADD_GENERIC: RUN_HELPER(vm->addValues(sp));
+      case OP_SUBTRACT:
+      case OP_MULTIPLY:
+      case OP_DIVIDE:
+      case OP_GREATER:
+      case OP_LESS: RUN_HELPER(vm->numberOp(sp, op));
+      case OP_NEGATE: RUN_HELPER(vm->negate(sp));
+
+      // The native code only gets here when an operand isn't a number, and does the jump itself
+      // otherwise.
+      case OP_LESS_JUMP:
+        READ_SHORT();
+        RUN_HELPER(vm->notNumbers(sp));
+      case OP_LOCAL_CONSTANT_LESS_JUMP:
+        ip += 4;
+        RUN_HELPER(vm->notNumbers(sp));
+
+      case OP_PRINT: vm->out_ << *--sp << std::endl; return sp;
+
+      case OP_CLOSURE: {
+        ObjFunction* fn = READ_CONSTANT().asFunction();
+        RUN_HELPER(vm->makeClosure(frame, sp, fn, ip));
+      }
+      case OP_CLOSE_UPVALUE: RUN_HELPER(vm->closeUpvalue(sp));
+    }
+
+    UNREACHABLE();
+
+#undef RUN_HELPER
+#undef PUSH
+#undef READ_CONSTANT
+#undef READ_SHORT
+#undef READ_BYTE
+  }
+
+  JitContinuation Jit::callPath(JitContext* context, Value* sp, const instruction* ip) {
+    VM* vm = context->vm;
+    CallFrame* frame = context->frame;
+    instruction op = *ip++;
+    int argCount = 0;
+    instruction constant = 0;
+    switch (op) {
+      case OP_CALL:
+      case OP_TAIL_CALL: argCount = *ip++; break;
+      case OP_CALL_0:
+      case OP_CALL_1:
+      case OP_CALL_2:
+      case OP_CALL_3: argCount = op - OP_CALL_0; break;
+      case OP_INVOKE:
+      case OP_TAIL_INVOKE:
+      case OP_SUPER_INVOKE:
+        constant = *ip++;
+        argCount = *ip++;
+        break;
+      case OP_INVOKE_0:
+      case OP_INVOKE_1:
+      case OP_INVOKE_2:
+      case OP_INVOKE_3:
+        constant = *ip++;
+        argCount = op - OP_INVOKE_0;
+        break;
+    }
+    frame->ip = ip;
+    vm->stackTop_ = sp;
+
+    // The same calls as VM::run makes. A closure known to take `argCount` arguments, from the
+    // callee slot or the invoke cache, is entered directly when it is compiled too.
+    Chunk& chunk = frame->closure->fn()->chunk();
+    Value callee = vm->peek(argCount);
+    ObjClosure* closure = nullptr;
+    InvokeCache* cache = nullptr;
+    switch (op) {
+      case OP_CALL:
+      case OP_CALL_0:
+      case OP_CALL_1:
+      case OP_CALL_2:
+      case OP_CALL_3:
+        if (callee.isClosure() && callee.asClosure()->fn()->stackCallArity() == argCount) {
+          closure = callee.asClosure();
+        }
+        break;
+      case OP_INVOKE:
+      case OP_INVOKE_0:
+      case OP_INVOKE_1:
+      case OP_INVOKE_2:
+      case OP_INVOKE_3:
+      case OP_TAIL_INVOKE:
+        cache = &chunk.invokeCache(constant);
+        if (callee.isInstance()) closure = cache->find(callee.asInstance()->shape(), vm->methodEpoch_);
+        break;
+    }
+    if (closure && op != OP_TAIL_INVOKE && closure->fn()->jitCode_) {
+      Value* calleeSlot = sp - argCount - 1;
+      if (vm->frameCount_ < vm->frameCapacity_ && vm->frameCount_ < vm->config_.maxFrames &&
+          calleeSlot + closure->fn()->stackSize() + VM::FRAME_STACK_RESERVE <= vm->stackEnd_) {
+        CallFrame* top = &vm->frames_[vm->frameCount_++];
+        *top = CallFrame(closure, calleeSlot);
+        context->frame = top;
+        return {sp, closure->fn()->jitCode_->entries[0]};
+      }
+    }
+
+    bool ok;
+    switch (op) {
+      case OP_TAIL_CALL:
+        ok = callee.isClosure() ? vm->tailCall(callee.asClosure(), argCount)
+                                : vm->callValue(callee, argCount);
+        break;
+      case OP_INVOKE:
+      case OP_INVOKE_0:
+      case OP_INVOKE_1:
+      case OP_INVOKE_2:
+      case OP_INVOKE_3:
+      case OP_TAIL_INVOKE:
+        if (!closure) {
+          ok = vm->invoke(chunk.getConstant(constant).asString(), argCount, *cache);
+        } else if (op == OP_TAIL_INVOKE) {
+          ok = vm->tailCall(closure, argCount);
+        } else {
+          ok = vm->call(closure, argCount);
+        }
+        break;
+      case OP_SUPER_INVOKE: {
+        InvokeCache& cache = chunk.invokeCache(constant);
+        ObjClass* superclass = vm->pop().asClass();
+        ObjClosure* method = cache.find(superclass, vm->methodEpoch_);
+        ok = method ? vm->call(method, argCount)
+                    : vm->invokeFromClass(superclass, chunk.getConstant(constant).asString(),
+                                          argCount, cache, superclass);
+        break;
+      }
+      default: ok = vm->callValue(callee, argCount); break;
+    }
+    if (!ok) return {nullptr, nullptr};
+    return continueTop(context);
+  }
+
+  JitContinuation Jit::returnPath(JitContext* context, Value* sp, const instruction* ip) {
+    VM* vm = context->vm;
+    CallFrame* frame = context->frame;
+    // VM::run finishes the script, or the call from the other tier, itself.
+    if (vm->frameCount_ == vm->baseFrame_ + 1) {
+      frame->ip = ip;
+      return {sp, nullptr};
+    }
+
+    Value result = sp[-1];
+    if (frame->closure->fn()->hasCapturedLocals()) vm->closeUpvalues(frame->slots, sp - 1);
+    vm->frameCount_--;
+    vm->stackTop_ = frame->slots;
+    vm->push(result);
+    return continueTop(context);
+  }
+
+  bool Jit::guardPath(JitContext* context, Value* sp, const instruction* ip) {
+    return context->vm->isInlinedCallee(context->frame->closure->fn(), ip[2], sp[-1 - ip[1]]);
+  }
+
+  JitContinuation Jit::continueTop(JitContext* context) {
+    VM* vm = context->vm;
+    CallFrame* top = &vm->frames_[vm->frameCount_ - 1];
+    context->frame = top;
+    ObjFunction* fn = top->closure->fn();
+    if (fn->jitCode_) return {vm->stackTop_, fn->jitCode_->entries[top->ip - fn->chunk().code()]};
+    return {vm->stackTop_, vm->jitEntry(fn, top->ip)};
+  }
+
+#ifdef JIT_X64
+
+  // Translates one chunk. Native register use:
+  //   RBX  stack top (the interpreter's sp)
+  //   R12  frame slots
+  //   R13  JitContext*
+  //   R14  current CallFrame*, as in the context
+  //   R15  QNAN, to test for numbers
+  // RAX, RCX, RDX, XMM0 and XMM1 are scratch.
+  class JitCompiler {
+   public:
+    JitCompiler(VM& vm, ObjFunction* fn)
+      : vm_(vm)
+      , fn_(fn)
+      , chunk_(fn->chunk()) {}
+
+    JitCode* compile();
+
+   private:
+    struct Jump {
+      Jump() {}
+      Jump(int at, int target)
+        : at(at)
+        , target(target) {}
+
+      int at = 0;     // rel32 operand to patch.
+      int target = 0; // Code offset of the target instruction.
+    };
+
+    // Out of line path of an instruction whose inline template bailed out: it calls slowPath()
+    // and continues with the next instruction.
+    struct SlowPath {
+      int jumps[2] = {0, 0};
+      int jumpCount = 0;
+      int offset = 0;
+      int next = 0;
+    };
+
+    void emitPrologue();
+    void emitInstruction(int offset, int next);
+    void emitSlowPaths();
+
+    // Pushes RAX.
+    void emitPush(Reg reg);
+    void emitCallSlowPath(int offset);
+    // Leaves the instruction at `offset` to VM::run.
+    void emitExit(int offset);
+    // Calls `helper` for the call or return at `offset` and goes on where it says.
+    void emitContinuation(JitContinuation (*helper)(JitContext*, Value*, const instruction*),
+                          int offset);
+    void emitJump(int target);
+    void emitJumpIf(Cond cond, int target);
+    // Jumps to the slow path of the current instruction unless `reg` is a number. Clobbers RDX.
+    void emitNumberCheck(Reg reg);
+    void emitSlowJump();
+    void emitSlowJumpIf(Cond cond);
+    // Loads the address of global `slot` into RAX.
+    void emitGlobalAddress(int slot);
+    // Jumps to `falsey` if `reg` is nil or false. Clobbers RCX.
+    void emitFalseyJumps(Reg reg, int* first, int* second);
+    // Converts the flag set by `cond` into a Bool value in RAX. Clobbers RCX.
+    void emitBool(Cond cond);
+    // Pops two numbers, combines them with `op` and pushes the result.
+    void emitArithmetic(void (Assembler::*op)(Xmm, Xmm));
+    void emitComparison(bool less);
+
+    const instruction* ip(int offset) const {
+      return chunk_.code() + offset;
+    }
+
+    Value constant(int offset) const {
+      return chunk_.getConstant(chunk_.getCode(offset));
+    }
+
+    uint16_t shortOperand(int offset) const {
+      return (uint16_t)(chunk_.getCode(offset) << 8 | chunk_.getCode(offset + 1));
+    }
+
+   private:
+    VM& vm_;
+    ObjFunction* fn_;
+    Chunk& chunk_;
+    Assembler as_;
+    int exit_ = 0;     // Returns the stack top.
+    int epilogue_ = 0; // Returns RAX.
+
+    Vector<int, Memory::DefaultReallocator> native_; // Native offset of each instruction, or -1.
+    Vector<Jump, Memory::DefaultReallocator> jumps_;
+    Vector<int, Memory::DefaultReallocator> errorJumps_;
+    Vector<SlowPath, Memory::DefaultReallocator> slowPaths_;
+  };
+
+  JitCode* JitCompiler::compile() {
+    emitPrologue();
+
+    for (int i = 0; i < chunk_.count(); i++) native_.push(-1);
+    for (int offset = 0; offset < chunk_.count();) {
+      int next = Disassembler::nextOffset(chunk_, offset);
+      native_[offset] = as_.offset();
+      emitInstruction(offset, next);
+      offset = next;
+    }
+    emitSlowPaths();
+
+    for (int i = 0; i < jumps_.size(); i++) as_.patch(jumps_[i].at, native_[jumps_[i].target]);
+    for (int i = 0; i < errorJumps_.size(); i++) as_.patch(errorJumps_[i], epilogue_);
+
+    size_t size = as_.offset();
+    void* memory = as_.install();
+    if (!memory) return nullptr;
+
+    JitCode* code = new JitCode();
+    code->fn = reinterpret_cast<JitFn>(memory);
+    code->memory = memory;
+    code->size = size;
+    code->entryCount = chunk_.count();
+    code->entries = static_cast<const void**>(
+      Memory::DefaultReallocator::reallocate(nullptr, 0, sizeof(void*) * chunk_.count()));
+    for (int i = 0; i < chunk_.count(); i++) {
+      code->entries[i] = native_[i] == -1 ? nullptr : static_cast<uint8_t*>(memory) + native_[i];
+    }
+    return code;
+  }
+
+  void JitCompiler::emitPrologue() {
+    // Five pushes on top of the return address keep the stack 16-byte aligned for helper calls.
+    as_.push(RBX);
+    as_.push(R12);
+    as_.push(R13);
+    as_.push(R14);
+    as_.push(R15);
+    as_.mov(R13, RDI);
+    as_.mov(RBX, RSI);
+    as_.load(R14, R13, offsetof(JitContext, frame));
+    as_.load(R12, R14, offsetof(CallFrame, slots));
+    as_.movImm(R15, QNAN);
+    as_.jmp(RDX);
+
+    exit_ = as_.offset();
+    as_.mov(RAX, RBX);
+    epilogue_ = as_.offset();
+    as_.pop(R15);
+    as_.pop(R14);
+    as_.pop(R13);
+    as_.pop(R12);
+    as_.pop(RBX);
+    as_.ret();
+  }
+
+  void JitCompiler::emitPush(Reg reg) {
+    as_.store(RBX, 0, reg);
+    as_.addImm(RBX, sizeof(Value));
+  }
+
+  void JitCompiler::emitCallSlowPath(int offset) {
+    as_.mov(RDI, R13);
+    as_.mov(RSI, RBX);
+    as_.movImm(RDX, (uint64_t)(uintptr_t)ip(offset));
+    as_.movImm(RAX, (uint64_t)(uintptr_t)&Jit::slowPath);
+    as_.call(RAX);
+    as_.test(RAX, RAX);
+    errorJumps_.push(as_.jcc(COND_E));
+    as_.mov(RBX, RAX);
+  }
+
+  void JitCompiler::emitContinuation(
+    JitContinuation (*helper)(JitContext*, Value*, const instruction*), int offset) {
+    as_.mov(RDI, R13);
+    as_.mov(RSI, RBX);
+    as_.movImm(RDX, (uint64_t)(uintptr_t)ip(offset));
+    as_.movImm(RAX, (uint64_t)(uintptr_t)helper);
+    as_.call(RAX);
+    as_.test(RAX, RAX);
+    errorJumps_.push(as_.jcc(COND_E));
+    as_.mov(RBX, RAX);
+    as_.load(R14, R13, offsetof(JitContext, frame));
+    as_.load(R12, R14, offsetof(CallFrame, slots));
+    as_.test(RDX, RDX);
+    as_.patch(as_.jcc(COND_E), exit_);
+    as_.jmp(RDX);
+  }
+
+  void JitCompiler::emitExit(int offset) {
+    as_.movImm(RAX, (uint64_t)(uintptr_t)ip(offset));
+    as_.store(R14, offsetof(CallFrame, ip), RAX);
+    as_.patch(as_.jmp(), exit_);
+  }
+
+  void JitCompiler::emitJump(int target) {
+    jumps_.push(Jump(as_.jmp(), target));
+  }
+
+  void JitCompiler::emitJumpIf(Cond cond, int target) {
+    jumps_.push(Jump(as_.jcc(cond), target));
+  }
+
+  void JitCompiler::emitSlowJump() {
+    SlowPath& slow = slowPaths_[slowPaths_.size() - 1];
+    slow.jumps[slow.jumpCount++] = as_.jmp();
+  }
+
+  void JitCompiler::emitSlowJumpIf(Cond cond) {
+    SlowPath& slow = slowPaths_[slowPaths_.size() - 1];
+    slow.jumps[slow.jumpCount++] = as_.jcc(cond);
+  }
+
+  void JitCompiler::emitNumberCheck(Reg reg) {
+    as_.mov(RDX, reg);
+    as_.and_(RDX, R15);
+    as_.cmp(RDX, R15);
+    emitSlowJumpIf(COND_E);
+  }
+
+  void JitCompiler::emitGlobalAddress(int slot) {
+    // The global values move when new globals are added, so they're found through the VM.
+    as_.movImm(RAX, (uint64_t)(uintptr_t)vm_.globals_.dataAddress());
+    as_.load(RAX, RAX, 0);
+    as_.addImm(RAX, sizeof(Value) * slot);
+  }
+
+  void JitCompiler::emitFalseyJumps(Reg reg, int* first, int* second) {
+    as_.movImm(RCX, NIL_VAL);
+    as_.cmp(reg, RCX);
+    *first = as_.jcc(COND_E);
+    as_.movImm(RCX, FALSE_VAL);
+    as_.cmp(reg, RCX);
+    *second = as_.jcc(COND_E);
+  }
+
+  void JitCompiler::emitBool(Cond cond) {
+    as_.setcc(cond, RAX);
+    as_.movzxEaxAl();
+    as_.movImm(RCX, FALSE_VAL); // TRUE_VAL is FALSE_VAL + 1.
+    as_.add(RAX, RCX);
+  }
+
+  void JitCompiler::emitArithmetic(void (Assembler::*op)(Xmm, Xmm)) {
+    as_.load(RAX, RBX, -16);
+    as_.load(RCX, RBX, -8);
+    emitNumberCheck(RAX);
+    emitNumberCheck(RCX);
+    as_.movq(XMM0, RAX);
+    as_.movq(XMM1, RCX);
+    (as_.*op)(XMM0, XMM1);
+    as_.movq(RAX, XMM0);
+    as_.store(RBX, -16, RAX);
+    as_.subImm(RBX, sizeof(Value));
+  }
+
+  void JitCompiler::emitComparison(bool less) {
+    as_.load(RAX, RBX, -16);
+    as_.load(RCX, RBX, -8);
+    emitNumberCheck(RAX);
+    emitNumberCheck(RCX);
+    as_.movq(XMM0, RAX);
+    as_.movq(XMM1, RCX);
+    // "Above" is false for unordered operands, as the comparison has to be for NaN.
+    if (less) {
+      as_.ucomisd(XMM1, XMM0);
+    } else {
+      as_.ucomisd(XMM0, XMM1);
+    }
+    emitBool(COND_A);
+    as_.store(RBX, -16, RAX);
+    as_.subImm(RBX, sizeof(Value));
+  }
+
+  void JitCompiler::emitInstruction(int offset, int next) {
+    SlowPath slow;
+    slow.offset = offset;
+    slow.next = next;
+    slowPaths_.push(slow);
+
+    switch (chunk_.getCode(offset)) {
+      case OP_CONSTANT:
+        as_.movImm(RAX, constant(offset + 1).ptr());
+        emitPush(RAX);
+        break;
+      case OP_NIL: as_.movImm(RAX, NIL_VAL); emitPush(RAX); break;
+      case OP_TRUE: as_.movImm(RAX, TRUE_VAL); emitPush(RAX); break;
+      case OP_FALSE: as_.movImm(RAX, FALSE_VAL); emitPush(RAX); break;
+      case OP_POP: as_.subImm(RBX, sizeof(Value)); break;
+
+      case OP_GET_LOCAL:
+        as_.load(RAX, R12, sizeof(Value) * chunk_.getCode(offset + 1));
+        emitPush(RAX);
+        break;
+      case OP_SET_LOCAL:
+        as_.load(RAX, RBX, -8);
+        as_.store(R12, sizeof(Value) * chunk_.getCode(offset + 1), RAX);
+        break;
+      case OP_SET_LOCAL_POP:
+        as_.load(RAX, RBX, -8);
+        as_.store(R12, sizeof(Value) * chunk_.getCode(offset + 1), RAX);
+        as_.subImm(RBX, sizeof(Value));
+        break;
+      case OP_GET_LOCALS:
+        as_.load(RAX, R12, sizeof(Value) * chunk_.getCode(offset + 1));
+        as_.load(RCX, R12, sizeof(Value) * chunk_.getCode(offset + 2));
+        as_.store(RBX, 0, RAX);
+        as_.store(RBX, 8, RCX);
+        as_.addImm(RBX, 2 * sizeof(Value));
+        break;
+
+      case OP_ADD:
+      case OP_ADD_NUM:
+      case OP_ADD_STR:
+      case OP_ADD_GENERIC: emitArithmetic(&Assembler::addsd); break;
+      case OP_SUBTRACT: emitArithmetic(&Assembler::subsd); break;
+      case OP_MULTIPLY: emitArithmetic(&Assembler::mulsd); break;
+      case OP_DIVIDE: emitArithmetic(&Assembler::divsd); break;
+      case OP_LESS: emitComparison(true); break;
+      case OP_GREATER: emitComparison(false); break;
+
+      case OP_EQUAL:
+      case OP_EQUAL_NUM:
+      case OP_EQUAL_GENERIC:
+        as_.load(RAX, RBX, -16);
+        as_.load(RCX, RBX, -8);
+        emitNumberCheck(RAX);
+        emitNumberCheck(RCX);
+        as_.movq(XMM0, RAX);
+        as_.movq(XMM1, RCX);
+        // Equal and ordered, so NaN is not equal to itself.
+        as_.ucomisd(XMM0, XMM1);
+        as_.setcc(COND_E, RAX);
+        as_.setcc(COND_NP, RCX);
+        as_.andAlCl();
+        as_.movzxEaxAl();
+        as_.movImm(RCX, FALSE_VAL);
+        as_.add(RAX, RCX);
+        as_.store(RBX, -16, RAX);
+        as_.subImm(RBX, sizeof(Value));
+        break;
+
+      case OP_ADD_LOCAL_CONSTANT: {
+        Value k = constant(offset + 2);
+        if (!k.isNumber()) {
+          emitSlowJump();
+          break;
+        }
+        as_.load(RAX, R12, sizeof(Value) * chunk_.getCode(offset + 1));
+        emitNumberCheck(RAX);
+        as_.movq(XMM0, RAX);
+        as_.movImm(RCX, k.ptr());
+        as_.movq(XMM1, RCX);
+        as_.addsd(XMM0, XMM1);
+        as_.movq(RAX, XMM0);
+        emitPush(RAX);
+        break;
+      }
+
+      case OP_NOT:
+        as_.load(RDX, RBX, -8);
+        as_.movImm(RCX, NIL_VAL);
+        as_.cmp(RDX, RCX);
+        as_.setcc(COND_E, RAX);
+        as_.movImm(RCX, FALSE_VAL);
+        as_.cmp(RDX, RCX);
+        as_.setcc(COND_E, RCX);
+        as_.orAlCl();
+        as_.movzxEaxAl();
+        as_.movImm(RCX, FALSE_VAL);
+        as_.add(RAX, RCX);
+        as_.store(RBX, -8, RAX);
+        break;
+      case OP_NEGATE:
+        as_.load(RAX, RBX, -8);
+        emitNumberCheck(RAX);
+        as_.movImm(RCX, SIGN_BIT);
+        as_.xor_(RAX, RCX);
+        as_.store(RBX, -8, RAX);
+        break;
+
+      case OP_JUMP: emitJump(next + shortOperand(offset + 1)); break;
+      case OP_LOOP: emitJump(next - shortOperand(offset + 1)); break;
+      case OP_JUMP_IF_FALSE: {
+        int target = next + shortOperand(offset + 1);
+        int first, second;
+        as_.load(RAX, RBX, -8);
+        emitFalseyJumps(RAX, &first, &second);
+        jumps_.push(Jump(first, target));
+        jumps_.push(Jump(second, target));
+        break;
+      }
+      case OP_AND: {
+        int target = next + shortOperand(offset + 1);
+        int first, second;
+        as_.load(RAX, RBX, -8);
+        emitFalseyJumps(RAX, &first, &second);
+        jumps_.push(Jump(first, target));
+        jumps_.push(Jump(second, target));
+        as_.subImm(RBX, sizeof(Value));
+        break;
+      }
+      case OP_OR: {
+        int target = next + shortOperand(offset + 1);
+        int first, second;
+        as_.load(RAX, RBX, -8);
+        emitFalseyJumps(RAX, &first, &second);
+        emitJump(target);
+        as_.patch(first, as_.offset());
+        as_.patch(second, as_.offset());
+        as_.subImm(RBX, sizeof(Value));
+        break;
+      }
+      case OP_LESS_JUMP: {
+        int target = next + shortOperand(offset + 1);
+        as_.load(RAX, RBX, -16);
+        as_.load(RCX, RBX, -8);
+        emitNumberCheck(RAX);
+        emitNumberCheck(RCX);
+        as_.movq(XMM0, RAX);
+        as_.movq(XMM1, RCX);
+        as_.subImm(RBX, 2 * sizeof(Value));
+        as_.ucomisd(XMM1, XMM0);
+        emitJumpIf(COND_BE, target); // Not a < b, NaN included.
+        break;
+      }
+      case OP_LOCAL_CONSTANT_LESS_JUMP: {
+        int target = next + shortOperand(offset + 3);
+        Value k = constant(offset + 2);
+        if (!k.isNumber()) {
+          emitSlowJump();
+          break;
+        }
+        as_.load(RAX, R12, sizeof(Value) * chunk_.getCode(offset + 1));
+        emitNumberCheck(RAX);
+        as_.movq(XMM0, RAX);
+        as_.movImm(RCX, k.ptr());
+        as_.movq(XMM1, RCX);
+        as_.ucomisd(XMM1, XMM0);
+        emitJumpIf(COND_BE, target);
+        break;
+      }
+
+      case OP_INLINE_GUARD: {
+        int target = next + shortOperand(offset + 3);
+        const InlinedCall& call = chunk_.inlinedCall(chunk_.getCode(offset + 2));
+        as_.load(RAX, RBX, -(int)sizeof(Value) * (chunk_.getCode(offset + 1) + 1));
+        int cached = -1;
+        if (call.closure) {
+          as_.movImm(RCX, call.closure->asValue().ptr());
+          as_.cmp(RAX, RCX);
+          cached = as_.jcc(COND_E);
+        }
+        as_.mov(RDI, R13);
+        as_.mov(RSI, RBX);
+        as_.movImm(RDX, (uint64_t)(uintptr_t)ip(offset));
+        as_.movImm(RAX, (uint64_t)(uintptr_t)&Jit::guardPath);
+        as_.call(RAX);
+        as_.movzxEaxAl();
+        as_.test(RAX, RAX);
+        emitJumpIf(COND_E, target);
+        if (cached != -1) as_.patch(cached, as_.offset());
+        break;
+      }
+
+      // Undefined globals are reported by the slow path.
+      case OP_GET_GLOBAL:
+        emitGlobalAddress(shortOperand(offset + 1));
+        as_.load(RAX, RAX, 0);
+        as_.movImm(RCX, UNINITIALIZED);
+        as_.cmp(RAX, RCX);
+        emitSlowJumpIf(COND_E);
+        emitPush(RAX);
+        break;
+      case OP_SET_GLOBAL:
+        emitGlobalAddress(shortOperand(offset + 1));
+        as_.load(RDX, RAX, 0);
+        as_.movImm(RCX, UNINITIALIZED);
+        as_.cmp(RDX, RCX);
+        emitSlowJumpIf(COND_E);
+        as_.load(RCX, RBX, -8);
+        as_.store(RAX, 0, RCX);
+        break;
+      case OP_DEFINE_GLOBAL:
+        emitGlobalAddress(shortOperand(offset + 1));
+        as_.load(RCX, RBX, -8);
+        as_.store(RAX, 0, RCX);
+        as_.subImm(RBX, sizeof(Value));
+        break;
+
+      case OP_GET_UPVALUE:
+      case OP_SET_UPVALUE:
+      case OP_GET_CAPTURED:
+      case OP_GET_PROPERTY:
+      case OP_GET_LOCAL_PROPERTY:
+      case OP_SET_PROPERTY:
+      case OP_PRINT:
+      case OP_CLOSURE:
+      case OP_CLOSE_UPVALUE: emitCallSlowPath(offset); break;
+
+      case OP_CALL:
+      case OP_CALL_0:
+      case OP_CALL_1:
+      case OP_CALL_2:
+      case OP_CALL_3:
+      case OP_INVOKE:
+      case OP_INVOKE_0:
+      case OP_INVOKE_1:
+      case OP_INVOKE_2:
+      case OP_INVOKE_3:
+      case OP_SUPER_INVOKE:
+      case OP_TAIL_CALL:
+      case OP_TAIL_INVOKE: emitContinuation(&Jit::callPath, offset); break;
+      case OP_RETURN: emitContinuation(&Jit::returnPath, offset); break;
+
+      // Class definitions and super are rare enough to be left to VM::run.
+      default: emitExit(offset); break;
+    }
+  }
+
+  void JitCompiler::emitSlowPaths() {
+    for (int i = 0; i < slowPaths_.size(); i++) {
+      const SlowPath& slow = slowPaths_[i];
+      if (slow.jumpCount == 0) continue;
+      for (int j = 0; j < slow.jumpCount; j++) as_.patch(slow.jumps[j], as_.offset());
+      emitCallSlowPath(slow.offset);
+      emitJump(slow.next); // Chunks end with a return, so there is a next instruction.
+    }
+  }
+
+  bool Jit::compile(VM& vm, ObjFunction* fn) {
+    JitCompiler compiler(vm, fn);
+    JitCode* code = compiler.compile();
+    if (!code) return false;
+    fn->jitCode_ = code;
+    return true;
+  }
+
+  void Jit::release(JitCode* code) {
+    Assembler::uninstall(code->memory, code->size);
+    Memory::DefaultReallocator::reallocate(code->entries, sizeof(void*) * code->entryCount, 0);
+    delete code;
+  }
+
+#else
+
+  bool Jit::compile(VM& vm, ObjFunction* fn) {
+    return false;
+  }
+
+  void Jit::release(JitCode* code) {}
+
+#endif
+
+} // namespace lox
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "chunk.h"
+#include "value/value.h"
+
+namespace lox {
+
+  class VM;
+  class ObjFunction;
+  struct CallFrame;
+
+  // What native code runs in: the VM and the frame being executed, which changes as native code
+  // calls and returns.
+  struct JitContext {
+    VM* vm;
+    CallFrame* frame;
+  };
+
+  // Native code of a function, entered with the frame to run in `context`, its stack top and the
+  // address to start at. It returns when it gets to an instruction it leaves to VM::run, or to a
+  // frame whose function isn't compiled, with the stack top and the ip of every frame stored for
+  // VM::run to continue from. The new stack top is returned, or null after a runtime error.
+  typedef Value* (*JitFn)(JitContext* context, Value* sp, const void* entry);
+
+  // Result of the helpers that call and return: the new stack top, or null after a runtime error,
+  // and the native address to continue at, or null if the frame is left to VM::run.
+  struct JitContinuation {
+    Value* sp;
+    const void* next;
+  };
+
+  struct JitCode {
+    JitFn fn = nullptr;
+    void* memory = nullptr; // Executable mapping that holds the code.
+    size_t size = 0;
+    // Native address of every instruction, indexed by code offset, so that VM::run can enter the
+    // code wherever it is in the chunk: at a function's start, a loop header or after a call.
+    const void** entries = nullptr;
+    int entryCount = 0;
+  };
+
+  // Baseline compiler from stack bytecode to x86-64 machine code. Each instruction is translated
+  // on its own by a fixed template, with the value stack, locals and frame kept in the same memory
+  // the interpreter uses, so execution can move between VM::run and native code at any
+  // instruction boundary. Number operations and control flow are inlined, and most other
+  // instructions call into slowPath(), which does what VM::run would. Calls and returns go through
+  // callPath() and returnPath(), which switch frames and continue in the native code of the next
+  // one if it has any. Class definitions and super have no template: the native code leaves them
+  // to VM::run, which enters it again at the next call, return or loop back edge.
+  //
+  // On other architectures nothing is compiled.
+  class Jit {
+    friend class JitCompiler;
+
+   public:
+    // Compiles `fn` and sets its native code. Returns false if it can't be compiled.
+    static bool compile(VM& vm, ObjFunction* fn);
+
+    static void release(JitCode* code);
+
+   private:
+    static Value* slowPath(JitContext* context, Value* sp, const instruction* ip);
+    static JitContinuation callPath(JitContext* context, Value* sp, const instruction* ip);
+    static JitContinuation returnPath(JitContext* context, Value* sp, const instruction* ip);
+    // Check of the OP_INLINE_GUARD at `ip` when the callee isn't the closure it has cached.
+    static bool guardPath(JitContext* context, Value* sp, const instruction* ip);
+    // Where to continue once the top frame has changed.
+    static JitContinuation continueTop(JitContext* context);
+  };
+
+}; // namespace lox
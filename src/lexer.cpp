@@ -201,7 +201,7 @@ namespace lox {
   }
 
   void Lexer::freeToken(Token* token) {
-    Memory::deallocate(token);
+    Memory::deallocate(token, sizeof(Token));
   }
 
   // TODO: Optimize (Avoid duplication)
@@ -37,17 +37,15 @@ namespace lox {
     }
 
     void put(const K& key, const V& value) {
-      count_++;
-      ensureCapacity();
-
-      int index = static_cast<int>(key.hashCode() & 0x7fffffff) % capacity_;
-
-      while (!entries_[index].isEmpty() && !(entries_[index].key == key)) {
-        index = (index + 1) % capacity_;
+      int index = findIndex(key);
+      if (index != -1) {
+        entries_[index].value = value;
+        return;
       }
 
-      entries_[index].key = key;
-      entries_[index].value = value;
+      count_++;
+      ensureCapacity();
+      insert(key, value);
     }
 
     // TODO: Optimize
@@ -71,7 +69,7 @@ namespace lox {
     }
 
     void clear() {
-      Memory::deallocate(entries_);
+      Memory::deallocate(entries_, sizeof(Entry) * capacity_);
       count_ = 0;
       capacity_ = 0;
     }
@@ -96,7 +94,7 @@ namespace lox {
       return &entries_[index];
     }
 
-   private:
+    // Index of the entry holding `key`, or -1. It stays valid until the map grows.
     int findIndex(const K& key) const {
       if (capacity_ == 0) return -1;
 
@@ -111,6 +109,19 @@ namespace lox {
       }
     }
 
+   private:
+    // Stores a key known to be absent, without touching count_.
+    void insert(const K& key, const V& value) {
+      int index = static_cast<int>(key.hashCode() & 0x7fffffff) % capacity_;
+
+      while (!entries_[index].isEmpty()) {
+        index = (index + 1) % capacity_;
+      }
+
+      entries_[index].key = key;
+      entries_[index].value = value;
+    }
+
     void ensureCapacity() {
       if (count_ <= capacity_ * MAX_LOAD_PERCENT / 100) return;
 
@@ -130,9 +141,9 @@ namespace lox {
 
       if (oldEntries != nullptr) {
         for (int i = 0; i < oldCapacity; i++) {
-          if (!oldEntries[i].isEmpty()) put(oldEntries[i].key, oldEntries[i].value);
+          if (!oldEntries[i].isEmpty()) insert(oldEntries[i].key, oldEntries[i].value);
         }
-        Memory::deallocate(oldEntries);
+        Memory::deallocate(oldEntries, sizeof(Entry) * oldCapacity);
       }
     }
 
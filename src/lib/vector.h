@@ -54,7 +54,7 @@ namespace lox {
     }
 
     void clear() {
-      Reallocator::reallocate(items_, 0, 0);
+      Reallocator::reallocate(items_, sizeof(T) * capacity_, 0);
       count_ = 0;
       capacity_ = 0;
     }
@@ -81,6 +81,11 @@ namespace lox {
       return item;
     }
 
+    void truncate(int count) {
+      ASSERT_INDEX(count, count_ + 1);
+      count_ = count;
+    }
+
     int size() const {
       return count_;
     }
@@ -89,6 +94,20 @@ namespace lox {
       return count_ == 0;
     }
 
+    T* data() {
+      return items_;
+    }
+
+    const T* data() const {
+      return items_;
+    }
+
+    // Where data() is kept. It stays the same as the vector grows, so code that has to outlive a
+    // reallocation can read the items through it.
+    T* const* dataAddress() const {
+      return &items_;
+    }
+
     T& operator[](int index) {
       return const_cast<T&>(subscript(index));
     }
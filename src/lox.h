@@ -12,17 +12,27 @@ namespace lox {
 
   class Lox {
    public:
-    static InterpretResult runFile(const char* filePath, std::ostream& out = std::cout) {
+    // Prints the VM's collection statistics to `gcStats` after the script has run, if given.
+    static InterpretResult runFile(const char* filePath, std::ostream& out = std::cout,
+                                   const VMConfig& config = VMConfig(),
+                                   std::ostream* gcStats = nullptr) {
       char* buf = readFile(filePath);
       if (!buf) {
         std::cerr << "Failed to load file." << std::endl;
         exit(-1); // TODO: Fix handling
       }
 
-      VM vm(out);
+      VM vm(out, config);
       InterpretResult result = vm.interpret(buf);
       delete buf;
 
+      if (gcStats) {
+        const Memory& memory = vm.memory();
+        *gcStats << "gc: " << memory.gcCount() << " collections (" << memory.minorGCCount()
+                 << " minor), longest pause " << memory.maxGCPauseNanos() / 1000 << " us"
+                 << std::endl;
+      }
+
       return result;
     }
 
@@ -1,3 +1,5 @@
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 
 #include "lox.h"
@@ -5,12 +7,51 @@
 using namespace lox;
 
 int main(int argc, char const* argv[]) {
-  if (argc < 2) {
+  VMConfig config;
+  const char* path = nullptr;
+  bool gcStats = false;
+  for (int i = 1; i < argc; i++) {
+    if (std::strcmp(argv[i], "--register-tier") == 0) {
+      config.registerTier = true;
+    } else if (std::strcmp(argv[i], "--no-superinstructions") == 0) {
+      config.superinstructions = false;
+    } else if (std::strcmp(argv[i], "--no-inlining") == 0) {
+      config.inlining = false;
+    } else if (std::strcmp(argv[i], "--inline-budget") == 0 && i + 1 < argc) {
+      config.inlineBudget = std::atoi(argv[++i]);
+    } else if (std::strcmp(argv[i], "--jit") == 0) {
+      config.jit = true;
+    } else if (std::strcmp(argv[i], "--jit-threshold") == 0 && i + 1 < argc) {
+      config.jitThreshold = std::atoi(argv[++i]);
+    } else if (std::strcmp(argv[i], "--tracing") == 0) {
+      config.tracing = true;
+    } else if (std::strcmp(argv[i], "--trace-threshold") == 0 && i + 1 < argc) {
+      config.traceThreshold = std::atoi(argv[++i]);
+    } else if (std::strcmp(argv[i], "--gc-nursery") == 0 && i + 1 < argc) {
+      config.gcNurserySize = std::strtoul(argv[++i], nullptr, 10);
+    } else if (std::strcmp(argv[i], "--gc-incremental") == 0) {
+      config.gcIncremental = true;
+    } else if (std::strcmp(argv[i], "--gc-eager-sweep") == 0) {
+      config.gcLazySweep = false;
+    } else if (std::strcmp(argv[i], "--gc-slice-budget") == 0 && i + 1 < argc) {
+      config.gcSliceBudget = std::atoi(argv[++i]);
+    } else if (std::strcmp(argv[i], "--gc-mark-threads") == 0 && i + 1 < argc) {
+      config.gcMarkThreads = std::atoi(argv[++i]);
+    } else if (std::strcmp(argv[i], "--gc-stats") == 0) {
+      gcStats = true;
+    } else if (std::strcmp(argv[i], "--max-frames") == 0 && i + 1 < argc) {
+      config.maxFrames = std::atoi(argv[++i]);
+    } else {
+      path = argv[i];
+    }
+  }
+
+  if (!path) {
     std::cout << "File path is not given." << std::endl;
     exit(-1);
   }
 
-  InterpretResult result = Lox::runFile(argv[1]);
+  InterpretResult result = Lox::runFile(path, std::cout, config, gcStats ? &std::cerr : nullptr);
 
   if (result == INTERPRET_COMPILE_ERROR) exit(65);
   if (result == INTERPRET_RUNTIME_ERROR) exit(70);
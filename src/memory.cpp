@@ -1,13 +1,158 @@
 #include "memory.h"
 
+#include <chrono>
+#include <climits>
+
 #include "vm.h"
 
 namespace lox {
 
+  void Memory::initialize() {
+    makeCurrent();
+    rearm(true);
+  }
+
+  void Memory::rearm(bool major) {
+    const VMConfig& config = vm_->config();
+    if (major) {
+      size_t next = (size_t)(totalBytesAllocated_ * config.gcHeapGrowthFactor);
+      nextGC_ = next > config.gcMinHeapSize ? next : config.gcMinHeapSize;
+    }
+    size_t nursery = config.gcNurserySize;
+    bool fits = nursery > 0 && totalBytesAllocated_ + nursery < nextGC_;
+    nextMinorGC_ = fits ? totalBytesAllocated_ + nursery : nextGC_;
+  }
+
+  int Memory::sliceBudget() const {
+    // A slice that visits nothing would never finish marking or sweeping.
+    int budget = vm_->config().gcSliceBudget;
+    if (budget < 1) budget = 1;
+    // The allocation that runs a slice overshoots the bytes scheduled for it, by more the smaller
+    // the budget, and objects allocated while marking are traced too. The slice visits an object
+    // for every SLICE_BYTES_PER_OBJECT allocated, so that it still gains on allocation.
+    if (totalBytesAllocated_ > sliceStart_) {
+      size_t allocated = (totalBytesAllocated_ - sliceStart_) / SLICE_BYTES_PER_OBJECT;
+      if (allocated > (size_t)budget) budget = allocated < INT_MAX ? (int)allocated : INT_MAX;
+    }
+    return budget;
+  }
+
+  void Memory::scheduleSlice() {
+    int budget = vm_->config().gcSliceBudget;
+    sliceStart_ = totalBytesAllocated_;
+    nextMinorGC_ = totalBytesAllocated_ + (budget > 1 ? budget : 1) * SLICE_BYTES_PER_OBJECT;
+  }
+
+  void Memory::writeBarrier(Obj* owner, Obj* value) {
+    if (isMarking_) {
+      // Dijkstra's barrier: `owner` may already be traced, so `value` is marked for it.
+      vm_->gcMarkObject(value);
+    } else {
+      vm_->gcRemember(owner);
+    }
+  }
+
   void Memory::collectGarbage() {
+    auto start = std::chrono::steady_clock::now();
+
+    if (isSweeping_) {
+      sweepStep();
+    } else if (isMarking_) {
+      markSlice();
+    } else {
+      // Collections are minor until the heap reaches nextGC_, and always major without a nursery.
+      bool major = totalBytesAllocated_ > nextGC_ || vm_->config().gcNurserySize == 0;
+#ifdef DEBUG_STRESS_GC
+      // Collections happen on every allocation, so the heap hardly grows; make some of them major.
+      if (gcCount_ % 4 == 0) major = true;
+#endif
+      if (major && vm_->config().gcIncremental) {
+        beginMarking();
+      } else {
+        collect(major);
+      }
+    }
+
+    uint64_t pause = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+    if (pause > maxGCPauseNanos_) maxGCPauseNanos_ = pause;
+  }
+
+  void Memory::beginMarking() {
+#ifdef DEBUG_LOG_GC
+    printf("==> incremental gc begin\n");
+#endif
+    epoch_ = epoch_ == 1 ? 2 : 1;
+    vm_->gcClearMarks();
+    vm_->gcMarkRoots();
+    isMarking_ = true;
+    sliceStart_ = totalBytesAllocated_;
+    markSlice();
+  }
+
+  void Memory::markSlice() {
+    if (!vm_->gcBlackenObjects(sliceBudget())) {
+      scheduleSlice();
+      return;
+    }
+
 #ifdef DEBUG_LOG_GC
-    printf("==> gc begin\n");
+    size_t before = totalBytesAllocated_;
 #endif
+    // Stores into roots don't go through the write barrier, so the roots are marked again, and
+    // whatever only they reach now is traced within this slice.
+    vm_->gcMarkRoots();
+    vm_->gcBlackenObjects(INT_MAX);
+    vm_->gcRemoveWeakReferences();
+    isMarking_ = false;
+    gcCount_++;
+    beginSweeping();
+
+#ifdef DEBUG_LOG_GC
+    printf("<== incremental gc end: collected %lu bytes (from %lu to %lu), next at %lu\n",
+           (unsigned long)(before - totalBytesAllocated_), (unsigned long)before,
+           (unsigned long)totalBytesAllocated_, (unsigned long)nextGC_);
+#endif
+  }
+
+  void Memory::beginSweeping() {
+    vm_->gcBeginSweep();
+    if (vm_->config().gcLazySweep) {
+      isSweeping_ = true;
+      scheduleSlice();
+    } else {
+      vm_->gcSweepObjects(INT_MAX);
+      rearm(true);
+    }
+  }
+
+  void Memory::sweepStep() {
+    if (vm_->gcSweepObjects(sliceBudget())) {
+      isSweeping_ = false;
+      // Set from what is live now, garbage that was allocated during the sweep included.
+      rearm(true);
+    } else {
+      scheduleSlice();
+    }
+  }
+
+  void Memory::collect(bool major) {
+#ifdef DEBUG_LOG_GC
+    printf("==> %s gc begin\n", major ? "major" : "minor");
+    size_t before = totalBytesAllocated_;
+#endif
+
+    if (major) {
+#ifdef DEBUG_LOG_GC
+      printf("--> clear marks begin\n");
+#endif
+      epoch_ = epoch_ == 1 ? 2 : 1;
+      vm_->gcClearMarks();
+#ifdef DEBUG_LOG_GC
+      printf("<-- clear marks end\n");
+#endif
+    }
 
 #ifdef DEBUG_LOG_GC
     printf("--> mark roots begin\n");
@@ -17,32 +162,59 @@ namespace lox {
     printf("<-- mark roots end\n");
 #endif
 
+    if (!major) {
+#ifdef DEBUG_LOG_GC
+      printf("--> mark remembered objects begin\n");
+#endif
+      vm_->gcMarkRememberedObjects();
+#ifdef DEBUG_LOG_GC
+      printf("<-- mark remembered objects end\n");
+#endif
+    }
+
 #ifdef DEBUG_LOG_GC
     printf("--> blacken objects begin\n");
 #endif
-    vm_->gcBlackenObjects();
+    if (major) {
+      vm_->gcBlackenObjectsInParallel();
+    } else {
+      vm_->gcBlackenObjects(INT_MAX);
+    }
 #ifdef DEBUG_LOG_GC
     printf("<-- blacken objects end\n");
 #endif
 
+    if (major) {
 #ifdef DEBUG_LOG_GC
-    printf("--> remove weak references begin\n");
+      printf("--> remove weak references begin\n");
 #endif
-    vm_->gcRemoveWeakReferences();
+      vm_->gcRemoveWeakReferences();
 #ifdef DEBUG_LOG_GC
-    printf("<-- remove weak references end\n");
+      printf("<-- remove weak references end\n");
 #endif
+    }
 
 #ifdef DEBUG_LOG_GC
     printf("--> sweep begin\n");
 #endif
-    vm_->gcSweep();
+    // Major collections leave both generations to beginSweeping().
+    if (!major) vm_->gcSweepYoung();
 #ifdef DEBUG_LOG_GC
     printf("<-- sweep end\n");
 #endif
 
+    gcCount_++;
+    if (major) {
+      beginSweeping();
+    } else {
+      minorGCCount_++;
+      rearm(false);
+    }
+
 #ifdef DEBUG_LOG_GC
-    printf("<== gc end\n");
+    printf("<== gc end: collected %lu bytes (from %lu to %lu), next at %lu\n",
+           (unsigned long)(before - totalBytesAllocated_), (unsigned long)before,
+           (unsigned long)totalBytesAllocated_, (unsigned long)nextGC_);
 #endif
   }
 
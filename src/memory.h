@@ -1,10 +1,12 @@
 #pragma once
 
+#include <cstdint>
 #include <cstdlib>
 
 namespace lox {
 
   class VM;
+  class Obj;
 
   class Memory {
    public:
@@ -19,8 +21,26 @@ namespace lox {
       }
     };
 
-    static void initialize(VM* vm) {
-      vm_ = vm;
+    explicit Memory(VM* vm)
+      : vm_(vm) {}
+
+    ~Memory() {
+      if (current_ == this) current_ = nullptr;
+    }
+
+    // Makes this the current heap and arms the first collection. Called once `vm`'s config is set.
+    void initialize();
+
+    // Every VM has a heap of its own, which accounts for and collects the VM's allocations. The
+    // static allocation functions and write barriers act on the current heap of the thread, which
+    // a VM makes its own whenever it is entered (see VM::interpret), so that its objects are only
+    // allocated and mutated while it is current.
+    static Memory* current() {
+      return current_;
+    }
+
+    void makeCurrent() {
+      current_ = this;
     }
 
     // https://github.com/v8/v8/blob/9.7.37/src/zone/zone.h#L107
@@ -42,8 +62,9 @@ namespace lox {
       return reallocate(nullptr, 0, size);
     }
 
-    static void* deallocate(void* p) {
-      return reallocate(p, 0, 0);
+    // `size` must be what was allocated, so that totalBytesAllocated() stays exact.
+    static void* deallocate(void* p, size_t size) {
+      return reallocate(p, size, 0);
     }
 
     // TODO: Should we use operator new/delete instead of realloc/free?
@@ -51,28 +72,101 @@ namespace lox {
 #ifdef DEBUG_LOG_GC
       printf("reallocate %p %lu -> %lu\n", p, (unsigned long)oldSize, (unsigned long)newSize);
 #endif
-      totalBytesAllocated_ += newSize - oldSize;
+      Memory* heap = current_;
+      if (heap) {
+        heap->totalBytesAllocated_ += newSize - oldSize;
 
-      // TODO: GC cycle.
-      if (newSize > oldSize) {
+        if (newSize > oldSize) {
 #ifdef DEBUG_STRESS_GC
-        collectGarbage();
+          heap->collectGarbage();
+#else
+          if (heap->totalBytesAllocated_ > heap->nextMinorGC_) heap->collectGarbage();
 #endif
+        }
       }
 
       return DefaultReallocator::reallocate(p, oldSize, newSize);
     }
 
-    static size_t totalBytesAllocated() {
+    size_t totalBytesAllocated() const {
       return totalBytesAllocated_;
     }
 
+    // Allocated bytes beyond which the next collection is a major one. After each major collection
+    // it is set from the bytes still live (see VMConfig::gcHeapGrowthFactor).
+    size_t nextGC() const {
+      return nextGC_;
+    }
+
+    // Completed collections of either kind.
+    int gcCount() const {
+      return gcCount_;
+    }
+
+    // Collections of the young generation only.
+    int minorGCCount() const {
+      return minorGCCount_;
+    }
+
+    // Longest a single collection or slice of incremental marking took, in nanoseconds.
+    uint64_t maxGCPauseNanos() const {
+      return maxGCPauseNanos_;
+    }
+
+    // True between the slices of an incremental major collection. Objects allocated meanwhile are
+    // marked, since the roots they are stored in may have been traced already.
+    bool isMarking() const {
+      return isMarking_;
+    }
+
+    // An object of this heap is marked when its mark is the epoch. Major collections start by
+    // flipping the epoch between 1 and 2, which unmarks every object at once.
+    uint8_t epoch() const {
+      return epoch_;
+    }
+
+    // Called by Obj::gcWriteBarrier when the marked `owner` gets a reference to the unmarked
+    // `value`. Between collections `owner` is old and `value` young, so `owner` is added to the
+    // remembered set for minor collections; during incremental marking `value` is marked instead.
+    void writeBarrier(Obj* owner, Obj* value);
+
    private:
-    static void collectGarbage();
+    void collectGarbage();
+    void collect(bool major);
+    void beginMarking();
+    void markSlice();
+    void beginSweeping();
+    void sweepStep();
+    void rearm(bool major);
+    // Objects the slice of marking or step of sweeping that runs now visits: at least 1, and
+    // VMConfig::gcSliceBudget unless allocation got ahead of it.
+    int sliceBudget() const;
+    // Runs the next slice or step once gcSliceBudget objects' worth of bytes are allocated.
+    void scheduleSlice();
+
+    // Slices of incremental marking and steps of lazy sweeping come this many bytes apart per
+    // object they visit. Every object is bigger, so a slice traces more than was allocated since
+    // the previous one, including the new objects it has to trace, and marking catches up with
+    // allocation.
+    static constexpr size_t SLICE_BYTES_PER_OBJECT = 16;
 
    private:
-    inline static size_t totalBytesAllocated_ = 0;
-    inline static VM* vm_;
+    VM* vm_;
+    size_t totalBytesAllocated_ = 0;
+    size_t nextGC_ = 0;
+    // Allocated bytes beyond which garbage is collected: nextGC_, or sooner once the nursery is
+    // full.
+    size_t nextMinorGC_ = 0;
+    // Allocated bytes when the next slice or step was scheduled.
+    size_t sliceStart_ = 0;
+    int gcCount_ = 0;
+    int minorGCCount_ = 0;
+    uint64_t maxGCPauseNanos_ = 0;
+    bool isMarking_ = false;
+    bool isSweeping_ = false;
+    uint8_t epoch_ = 1;
+
+    inline static thread_local Memory* current_ = nullptr;
   };
 
 }; // namespace lox
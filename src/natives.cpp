@@ -0,0 +1,16 @@
+#include <ctime>
+
+#include "vm.h"
+
+namespace lox {
+
+  static bool clockNative(VM& vm, Value* args, int argCount, Value* result) {
+    *result = Number((double)clock() / CLOCKS_PER_SEC).asValue();
+    return true;
+  }
+
+  void VM::defineNatives() {
+    defineNative("clock", clockNative, 0);
+  }
+
+} // namespace lox
@@ -2,47 +2,118 @@
 
 namespace lox {
 
+// Every opcode in declaration order. Tables indexed by opcode (e.g. the threaded dispatch table in
+// VM::run) are generated from this list so that they can't get out of sync with the enum.
+#define OPCODES(V)    \
+  V(OP_CONSTANT)      \
+  V(OP_NIL)           \
+  V(OP_TRUE)          \
+  V(OP_FALSE)         \
+  V(OP_POP)           \
+  V(OP_GET_LOCAL)     \
+  V(OP_SET_LOCAL)     \
+  V(OP_GET_GLOBAL)    \
+  V(OP_DEFINE_GLOBAL) \
+  V(OP_SET_GLOBAL)    \
+  V(OP_GET_UPVALUE)   \
+  V(OP_SET_UPVALUE)   \
+  V(OP_GET_CAPTURED)  \
+  V(OP_GET_PROPERTY)  \
+  V(OP_SET_PROPERTY)  \
+  V(OP_GET_SUPER)     \
+  V(OP_EQUAL)         \
+  V(OP_GREATER)       \
+  V(OP_LESS)          \
+  V(OP_ADD)           \
+  V(OP_SUBTRACT)      \
+  V(OP_MULTIPLY)      \
+  V(OP_DIVIDE)        \
+  V(OP_NOT)           \
+  V(OP_NEGATE)        \
+  V(OP_PRINT)         \
+  V(OP_JUMP)          \
+  V(OP_JUMP_IF_FALSE) \
+  V(OP_LOOP)          \
+  V(OP_CALL)          \
+  V(OP_INVOKE)        \
+  V(OP_SUPER_INVOKE)  \
+  V(OP_TAIL_CALL)     \
+  V(OP_TAIL_INVOKE)   \
+  V(OP_CLOSURE)       \
+  V(OP_CLOSE_UPVALUE) \
+  V(OP_RETURN)        \
+  V(OP_CLASS)         \
+  V(OP_INHERIT)       \
+  V(OP_METHOD)        \
+  V(OP_END_CLASS)     \
+                      \
+  V(OP_OR)            \
+  V(OP_AND)           \
+                      \
+  V(OP_INLINE_GUARD)  \
+                      \
+  FIXED_ARITY_CALLS(V)  \
+  SUPERINSTRUCTIONS(V)  \
+  QUICKENED_OPCODES(V)
+
+// Forms of OP_CALL and OP_INVOKE for the most common argument counts, which is implied by the opcode
+// instead of read from an operand. Tail calls always use the generic forms.
+#define FIXED_ARITY_CALLS(V) \
+  V(OP_CALL_0)               \
+  V(OP_CALL_1)               \
+  V(OP_CALL_2)               \
+  V(OP_CALL_3)               \
+  V(OP_INVOKE_0)             \
+  V(OP_INVOKE_1)             \
+  V(OP_INVOKE_2)             \
+  V(OP_INVOKE_3)
+
+// Fused sequences emitted by the compiler's peephole pass (see Compiler::fuseSuperinstructions).
+#define SUPERINSTRUCTIONS(V)     \
+  V(OP_SET_LOCAL_POP)            \
+  V(OP_GET_LOCALS)               \
+  V(OP_GET_LOCAL_PROPERTY)       \
+  V(OP_ADD_LOCAL_CONSTANT)       \
+  V(OP_LESS_JUMP)                \
+  V(OP_LOCAL_CONSTANT_LESS_JUMP)
+
+// Specialized forms the interpreter rewrites instructions into at run time (quickening). The
+// compiler only emits the generic OP_ADD and OP_EQUAL; the *_GENERIC forms are where a site ends up
+// after seeing operands its specialization doesn't handle, and are never specialized again.
+#define QUICKENED_OPCODES(V) \
+  V(OP_ADD_NUM)              \
+  V(OP_ADD_STR)              \
+  V(OP_ADD_GENERIC)          \
+  V(OP_EQUAL_NUM)            \
+  V(OP_EQUAL_GENERIC)
+
   enum OpCode {
-    OP_CONSTANT,
-    OP_NIL,
-    OP_TRUE,
-    OP_FALSE,
-    OP_POP,
-    OP_GET_LOCAL,
-    OP_SET_LOCAL,
-    OP_GET_GLOBAL,
-    OP_DEFINE_GLOBAL,
-    OP_SET_GLOBAL,
-    OP_GET_UPVALUE,
-    OP_SET_UPVALUE,
-    OP_GET_PROPERTY,
-    OP_SET_PROPERTY,
-    OP_GET_SUPER,
-    OP_EQUAL,
-    OP_GREATER,
-    OP_LESS,
-    OP_ADD,
-    OP_SUBTRACT,
-    OP_MULTIPLY,
-    OP_DIVIDE,
-    OP_NOT,
-    OP_NEGATE,
-    OP_PRINT,
-    OP_JUMP,
-    OP_JUMP_IF_FALSE,
-    OP_LOOP,
-    OP_CALL,
-    OP_INVOKE,
-    OP_SUPER_INVOKE,
-    OP_CLOSURE,
-    OP_CLOSE_UPVALUE,
-    OP_RETURN,
-    OP_CLASS,
-    OP_INHERIT,
-    OP_METHOD,
-
-    OP_OR,
-    OP_AND,
+#define OPCODE_ENUM(op) op,
+    OPCODES(OPCODE_ENUM)
+#undef OPCODE_ENUM
   };
 
+  // How OP_CLOSURE fills each upvalue of the new closure. Every upvalue has a kind operand byte
+  // followed by an index byte.
+  constexpr int FIXED_ARITY_CALL_MAX = 3;
+
+  enum CaptureKind {
+    CAPTURE_UPVALUE,     // Copy upvalue `index` of the enclosing closure, whatever its kind.
+    CAPTURE_LOCAL,       // Capture local `index` of the enclosing frame by reference.
+    CAPTURE_LOCAL_VALUE, // Copy the value of local `index`, which is never reassigned.
+  };
+
+#define OPCODE_ONE(op) +1
+  constexpr int OPCODE_COUNT = 0 OPCODES(OPCODE_ONE);
+#undef OPCODE_ONE
+
+  inline const char* opcodeName(int op) {
+    static const char* names[] = {
+#define OPCODE_NAME(op) #op,
+      OPCODES(OPCODE_NAME)
+#undef OPCODE_NAME
+    };
+    return op >= 0 && op < OPCODE_COUNT ? names[op] : "<unknown>";
+  }
+
 }; // namespace lox
@@ -0,0 +1,128 @@
+#include "parallel_marker.h"
+
+#include "value/object.h"
+#include "vm.h"
+
+namespace lox {
+
+  ParallelMarker::ParallelMarker(VM& vm, int threadCount)
+    : vm_(vm)
+    , threadCount_(threadCount)
+    , workers_(new Worker[threadCount]) {
+    // The first worker is whichever thread calls mark().
+    for (int i = 1; i < threadCount_; i++) {
+      workers_[i].thread = std::thread([this, i] { serve(workers_[i]); });
+    }
+  }
+
+  ParallelMarker::~ParallelMarker() {
+    {
+      std::lock_guard<std::mutex> guard(jobLock_);
+      stopping_ = true;
+    }
+    jobReady_.notify_all();
+    for (int i = 1; i < threadCount_; i++) workers_[i].thread.join();
+    delete[] workers_;
+  }
+
+  void ParallelMarker::mark(Vector<Obj*, Memory::DefaultReallocator>& gray) {
+    for (int i = 0; i < gray.size(); i++) workers_[i % threadCount_].stack.push(gray[i]);
+    gray.truncate(0);
+    idle_ = 0;
+
+    {
+      std::lock_guard<std::mutex> guard(jobLock_);
+      finished_ = 0;
+      generation_++;
+    }
+    jobReady_.notify_all();
+
+    work(workers_[0]);
+
+    std::unique_lock<std::mutex> lock(jobLock_);
+    jobDone_.wait(lock, [this] { return finished_ == threadCount_ - 1; });
+  }
+
+  void ParallelMarker::push(Obj* obj) {
+    current_->stack.push(obj);
+  }
+
+  void ParallelMarker::serve(Worker& worker) {
+    int seen = 0;
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(jobLock_);
+        jobReady_.wait(lock, [&] { return stopping_ || generation_ != seen; });
+        if (stopping_) return;
+        seen = generation_;
+      }
+
+      work(worker);
+
+      {
+        std::lock_guard<std::mutex> guard(jobLock_);
+        finished_++;
+      }
+      jobDone_.notify_one();
+    }
+  }
+
+  void ParallelMarker::work(Worker& worker) {
+    current_ = &worker;
+    for (;;) {
+      while (worker.stack.size() > 0) {
+        Obj* obj = worker.stack.removeAt(worker.stack.size() - 1);
+        obj->gcBlacken(vm_);
+        if (worker.stack.size() >= SHARE_THRESHOLD && worker.dequeSize == 0) share(worker);
+      }
+      if (refill(worker)) continue;
+
+      // Out of work. Wait until the others are too, unless some of theirs can be stolen.
+      idle_++;
+      for (;;) {
+        if (idle_ == threadCount_) {
+          current_ = nullptr;
+          return;
+        }
+        bool stealable = false;
+        for (int i = 0; i < threadCount_; i++) stealable |= workers_[i].dequeSize > 0;
+        if (stealable) {
+          idle_--;
+          if (refill(worker)) break;
+          idle_++;
+        }
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  void ParallelMarker::share(Worker& worker) {
+    std::lock_guard<std::mutex> guard(worker.lock);
+    int half = worker.stack.size() / 2;
+    for (int i = 0; i < half; i++) {
+      worker.deque.push(worker.stack.removeAt(worker.stack.size() - 1));
+    }
+    worker.dequeSize = worker.deque.size();
+  }
+
+  bool ParallelMarker::refill(Worker& worker) {
+    // Own deque first, then the others'.
+    int self = &worker - workers_;
+    for (int i = 0; i < threadCount_; i++) {
+      Worker& victim = workers_[(self + i) % threadCount_];
+      if (victim.dequeSize == 0) continue;
+
+      std::lock_guard<std::mutex> guard(victim.lock);
+      int count = victim.deque.size();
+      if (count == 0) continue;
+      int take = victim.deque.size() - count / 2;
+      for (int j = 0; j < take; j++) {
+        worker.stack.push(victim.deque.removeAt(victim.deque.size() - 1));
+      }
+      victim.dequeSize = victim.deque.size();
+      return true;
+    }
+    return false;
+  }
+
+} // namespace lox
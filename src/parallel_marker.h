@@ -0,0 +1,66 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "lib/vector.h"
+#include "memory.h"
+
+namespace lox {
+
+  class VM;
+  class Obj;
+
+  // Traces the gray objects of a stop-the-world collection on several threads: the VM's own and
+  // gcMarkThreads - 1 workers that sleep between collections. Each thread drains a stack of its
+  // own, and when that gets long it moves half of it to its deque, from which threads that run out
+  // of work steal. VM::gcMarkObject sets mark bits atomically meanwhile, so an object that two
+  // threads reach is traced by one of them. Marking ends once every thread is out of work, which
+  // can only happen when all the deques are empty, since only their owners fill them.
+  class ParallelMarker {
+   public:
+    ParallelMarker(VM& vm, int threadCount);
+    ~ParallelMarker();
+
+    // Traces everything reachable from `gray`, which is left empty.
+    void mark(Vector<Obj*, Memory::DefaultReallocator>& gray);
+
+    // Called by VM::gcMarkObject, on the thread that marked `obj`, to have it traced.
+    static void push(Obj* obj);
+
+   private:
+    struct Worker {
+      Vector<Obj*, Memory::DefaultReallocator> stack;
+      std::mutex lock;
+      Vector<Obj*, Memory::DefaultReallocator> deque; // Guarded by lock.
+      std::atomic<int> dequeSize = 0;
+      std::thread thread;
+    };
+
+    void serve(Worker& worker);
+    void work(Worker& worker);
+    void share(Worker& worker);
+    bool refill(Worker& worker);
+
+   private:
+    // A thread shares half its stack once it holds this many objects and its deque is empty.
+    static constexpr int SHARE_THRESHOLD = 64;
+
+    VM& vm_;
+    int threadCount_;
+    Worker* workers_;
+    std::atomic<int> idle_ = 0;
+
+    std::mutex jobLock_;
+    std::condition_variable jobReady_;
+    std::condition_variable jobDone_;
+    int generation_ = 0; // Marks started; workers wait for it to change.
+    int finished_ = 0;   // Workers done with the current one.
+    bool stopping_ = false;
+
+    inline static thread_local Worker* current_ = nullptr;
+  };
+
+}; // namespace lox
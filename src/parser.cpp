@@ -20,14 +20,12 @@ namespace lox {
   Parser::~Parser() {
     for (int i = 0; i < astNodes_.size(); i++) {
       freeAstNode(astNodes_[i]);
-
-      // TODO: Recover allocated bytes here
     }
   }
 
   void Parser::freeAstNode(Ast* node) {
     node->~Ast(); // TODO: Calling destructor is lame
-    Memory::deallocate(node);
+    Memory::DefaultReallocator::reallocate(node, 0, 0);
   }
 
   bool Parser::parse() {
@@ -71,9 +71,11 @@ namespace lox {
 
     // https://stackoverflow.com/a/1111470
     // Templated code implementation should never be in a .cpp file
+    // Nodes live as long as the parser, whatever the GC does, so they aren't counted as heap that
+    // a collection might free.
     template <typename T, typename... Args>
     T* newAstNode(Args&&... args) {
-      T* node = Memory::allocate<T>();
+      T* node = static_cast<T*>(Memory::DefaultReallocator::reallocate(nullptr, 0, sizeof(T)));
       new (node) T(std::forward<Args>(args)...);
 
       astNodes_.push(node); // Save ast node to keep ownership
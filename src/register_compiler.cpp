@@ -0,0 +1,513 @@
+#include "register_compiler.h"
+
+#include "common.h"
+#include "debug.h"
+#include "parser.h"
+#include "value/value.h"
+#include "vm.h"
+
+namespace lox {
+
+  RegisterCompiler::RegisterCompiler(VM& vm, const char* source)
+    : lexer_(source)
+    , vm_(vm) {
+    vm_.setRegisterCompiler(this);
+    function_ = vm_.allocateObj<ObjFunction>(TYPE_SCRIPT, 0, nullptr);
+
+    addLocal(nullptr);
+    locals_[0].depth = 0;
+  }
+
+  RegisterCompiler::RegisterCompiler(VM& vm, RegisterCompiler* enclosing, const Function* fn)
+    : lexer_(nullptr)
+    , vm_(vm)
+    , enclosing_(enclosing) {
+    vm_.setRegisterCompiler(this);
+
+    ObjString* name = vm_.allocateObj<ObjString>(fn->name->start, fn->name->length);
+    vm_.pushRoot(name);
+    function_ = vm_.allocateObj<ObjFunction>(TYPE_FUNCTION, fn->params.size(), name);
+    vm_.popRoot();
+
+    addLocal(nullptr);
+    locals_[0].depth = 0;
+  }
+
+  RegisterCompiler::~RegisterCompiler() {
+    vm_.setRegisterCompiler(enclosing_);
+  }
+
+  void RegisterCompiler::gcBlacken(VM& vm) const {
+    vm.gcMarkObject(function_);
+  }
+
+  ObjFunction* RegisterCompiler::compile() {
+    Parser parser(lexer_);
+
+    // Syntax errors are already reported by the parser, so there is nothing to fall back for.
+    if (!parser.parse()) return nullptr;
+
+    const ParseResult& result = parser.result();
+    for (int i = 0; i < result.stmts.size() && !unsupported_; i++) {
+      compileStmt(result.stmts[i]);
+    }
+
+    endCompiler(result.eof);
+    return unsupported_ ? nullptr : function_;
+  }
+
+  void RegisterCompiler::endCompiler(SRC) {
+    emit(token, {ROP_RETURN_NIL});
+    function_->setRegisterCount(registerCount_);
+    function_->setStackSize(registerCount_);
+
+#ifdef DEBUG_PRINT_CODE
+    if (!unsupported_)
+      Disassembler::disassembleRegisterChunk(
+        currentChunk(), function_->name() ? function_->name()->value() : "<script>");
+#endif
+  }
+
+  void RegisterCompiler::unsupported() {
+    unsupported_ = true;
+  }
+
+  int RegisterCompiler::compileExpr(const Expr* expr, int dest) {
+    int enclosingDest = dest_;
+    dest_ = dest;
+    expr->accept(this);
+    dest_ = enclosingDest;
+    return result_;
+  }
+
+  void RegisterCompiler::compileStmt(const Stmt* stmt) {
+    stmt->accept(this);
+    // Temporaries never outlive the statement that computed them.
+    freeRegister_ = locals_.size();
+  }
+
+  void RegisterCompiler::compileOperands(const Binary* expr, int* left, int* right) {
+    *left = compileExpr(expr->left);
+    int writes = localWrites_;
+    *right = compileExpr(expr->right);
+
+    // The left operand may have been returned in a local's own register; if the right operand
+    // assigns to a local it may have overwritten it. That's rare enough to leave to the stack tier.
+    if (isLocalRegister(*left) && localWrites_ != writes) unsupported();
+  }
+
+  int RegisterCompiler::compileCondition(const Expr* condition) {
+    // Fuse `a < b` and `a > b` with the branch, they guard nearly every loop.
+    if (typeid(*condition) == typeid(Binary)) {
+      const Binary* binary = static_cast<const Binary*>(condition);
+      int left, right;
+      if (binary->op->type == TOKEN_LESS) {
+        if (const Literal* k = numberLiteral(binary->right)) {
+          left = compileExpr(binary->left);
+          return emitJump(binary->op, {ROP_JUMP_IF_NOT_LESS_K, left, numberConstant(k)});
+        }
+        compileOperands(binary, &left, &right);
+        return emitJump(binary->op, {ROP_JUMP_IF_NOT_LESS, left, right});
+      }
+      if (binary->op->type == TOKEN_GREATER) {
+        compileOperands(binary, &left, &right);
+        return emitJump(binary->op, {ROP_JUMP_IF_NOT_LESS, right, left});
+      }
+    }
+
+    int reg = compileExpr(condition);
+    return emitJump(condition->getStart(), {ROP_JUMP_IF_FALSE, reg});
+  }
+
+  int RegisterCompiler::allocRegister() {
+    if (freeRegister_ == REGISTERS_MAX) {
+      unsupported();
+      return REGISTERS_MAX - 1;
+    }
+    int reg = freeRegister_++;
+    if (freeRegister_ > registerCount_) registerCount_ = freeRegister_;
+    return reg;
+  }
+
+  int RegisterCompiler::destination() {
+    return dest_ >= 0 ? dest_ : allocRegister();
+  }
+
+  int RegisterCompiler::addLocal(Token* name) {
+    for (int i = locals_.size() - 1; i >= 0 && name; i--) {
+      if (locals_[i].depth != -1 && locals_[i].depth < scopeDepth_) break;
+      // Redeclaration is an error the stack compiler reports.
+      if (locals_[i].name && *locals_[i].name == *name) unsupported();
+    }
+
+    int reg = allocRegister();
+    ASSERT(unsupported_ || reg == locals_.size(), "Locals must be below every temporary.");
+    locals_.emplace(name, -1);
+    return reg;
+  }
+
+  int RegisterCompiler::resolveLocal(Token* name) {
+    for (int i = locals_.size() - 1; i >= 0; i--) {
+      if (locals_[i].name && *locals_[i].name == *name) {
+        // Reading a local in its own initializer is an error the stack compiler reports.
+        if (locals_[i].depth == -1) unsupported();
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  bool RegisterCompiler::isEnclosingLocal(Token* name) {
+    for (RegisterCompiler* compiler = enclosing_; compiler; compiler = compiler->enclosing_) {
+      if (compiler->resolveLocal(name) != -1) return true;
+    }
+    return false;
+  }
+
+  void RegisterCompiler::endScope() {
+    scopeDepth_--;
+    while (!locals_.isEmpty() && locals_[-1].depth > scopeDepth_) locals_.removeAt(-1);
+    freeRegister_ = locals_.size();
+  }
+
+  void RegisterCompiler::emit(SRC, std::initializer_list<int> bytes) {
+    for (int byte : bytes) currentChunk().write(byte, token->line);
+  }
+
+  int RegisterCompiler::emitJump(SRC, std::initializer_list<int> bytes) {
+    emit(token, bytes);
+    emit(token, {0xff, 0xff});
+    return currentChunk().count() - 2;
+  }
+
+  void RegisterCompiler::patchJump(SRC, int offset) {
+    int jump = currentChunk().count() - offset - 2;
+    if (jump > UINT16_MAX) unsupported();
+
+    currentChunk().rewrite(offset, (jump >> 8) & 0xff);
+    currentChunk().rewrite(offset + 1, jump & 0xff);
+  }
+
+  void RegisterCompiler::emitLoop(SRC, int loopStart) {
+    emit(token, {ROP_LOOP});
+
+    int backJumpDistance = currentChunk().count() - loopStart + 2;
+    if (backJumpDistance > UINT16_MAX) unsupported();
+
+    emit(token, {(backJumpDistance >> 8) & 0xff, backJumpDistance & 0xff});
+  }
+
+  int RegisterCompiler::makeConstant(SRC, Value value) {
+    vm_.pushRoot(value);
+    int constant = currentChunk().addConstant(value);
+    function_->gcWriteBarrier(value);
+    vm_.popRoot();
+
+    if (constant > UINT8_MAX) {
+      unsupported();
+      return 0;
+    }
+    return constant;
+  }
+
+  void RegisterCompiler::emitGlobal(SRC, RegisterOpCode op, int reg) {
+    int slot = vm_.globalSlot(vm_.allocateObj<ObjString>(token->start, token->length));
+    if (slot > UINT16_MAX) unsupported(); // The stack Compiler reports the error.
+    emit(token, {op, reg, (slot >> 8) & 0xff, slot & 0xff});
+  }
+
+  int RegisterCompiler::numberConstant(const Literal* literal) {
+    double n = std::strtod(literal->value->start, 0);
+    return makeConstant(literal->value, Number(n).asValue());
+  }
+
+  const Literal* RegisterCompiler::numberLiteral(const Expr* expr) {
+    if (typeid(*expr) != typeid(Literal)) return nullptr;
+
+    const Literal* literal = static_cast<const Literal*>(expr);
+    return literal->value->type == TOKEN_NUMBER ? literal : nullptr;
+  }
+
+  void RegisterCompiler::visit(const Assign* expr) {
+    int local = resolveLocal(expr->name);
+    if (local != -1) {
+      compileExpr(expr->value, local);
+      localWrites_++;
+      if (dest_ >= 0 && dest_ != local) {
+        emit(expr->name, {ROP_MOVE, dest_, local});
+        local = dest_;
+      }
+      result_ = local;
+    } else if (isEnclosingLocal(expr->name)) {
+      unsupported();
+    } else {
+      int reg = compileExpr(expr->value, dest_);
+      emitGlobal(expr->name, ROP_SET_GLOBAL, reg);
+      result_ = reg;
+    }
+  }
+
+  void RegisterCompiler::visit(const Binary* expr) {
+    int mark = freeRegister_;
+
+    TokenType op = expr->op->type;
+    const Literal* k = op == TOKEN_PLUS || op == TOKEN_MINUS ? numberLiteral(expr->right) : nullptr;
+    if (k) {
+      int left = compileExpr(expr->left);
+      freeRegister_ = mark;
+      result_ = destination();
+      emit(expr->op, {op == TOKEN_PLUS ? ROP_ADD_CONSTANT : ROP_SUBTRACT_CONSTANT, result_, left,
+                      numberConstant(k)});
+      return;
+    }
+
+    int left, right;
+    compileOperands(expr, &left, &right);
+    freeRegister_ = mark;
+    int a = destination();
+
+    switch (op) {
+      case TOKEN_BANG_EQUAL:
+        emit(expr->op, {ROP_EQUAL, a, left, right});
+        emit(expr->op, {ROP_NOT, a, a});
+        break;
+      case TOKEN_EQUAL_EQUAL: emit(expr->op, {ROP_EQUAL, a, left, right}); break;
+      case TOKEN_GREATER: emit(expr->op, {ROP_GREATER, a, left, right}); break;
+      case TOKEN_GREATER_EQUAL:
+        emit(expr->op, {ROP_LESS, a, left, right});
+        emit(expr->op, {ROP_NOT, a, a});
+        break;
+      case TOKEN_LESS: emit(expr->op, {ROP_LESS, a, left, right}); break;
+      case TOKEN_LESS_EQUAL:
+        emit(expr->op, {ROP_GREATER, a, left, right});
+        emit(expr->op, {ROP_NOT, a, a});
+        break;
+      case TOKEN_PLUS: emit(expr->op, {ROP_ADD, a, left, right}); break;
+      case TOKEN_MINUS: emit(expr->op, {ROP_SUBTRACT, a, left, right}); break;
+      case TOKEN_STAR: emit(expr->op, {ROP_MULTIPLY, a, left, right}); break;
+      case TOKEN_SLASH: emit(expr->op, {ROP_DIVIDE, a, left, right}); break;
+      default: UNREACHABLE();
+    }
+    result_ = a;
+  }
+
+  void RegisterCompiler::visit(const Call* expr) {
+    // The callee and arguments go to consecutive registers, which become the first registers of
+    // the callee's frame.
+    int base = allocRegister();
+    compileExpr(expr->callee, base);
+    for (int i = 0; i < expr->arguments.size(); i++) {
+      compileExpr(expr->arguments[i], allocRegister());
+    }
+    emit(expr->callee->getStart(), {ROP_CALL, base, expr->arguments.size()});
+    freeRegister_ = base + 1;
+
+    result_ = base;
+    if (dest_ >= 0 && dest_ != base) {
+      emit(expr->callee->getStart(), {ROP_MOVE, dest_, base});
+      result_ = dest_;
+      // The destination was allocated before `base`, so the next argument of an enclosing call
+      // goes right after it.
+      freeRegister_ = base;
+    }
+  }
+
+  void RegisterCompiler::visit(const Get* expr) {
+    unsupported();
+  }
+
+  void RegisterCompiler::visit(const Grouping* expr) {
+    result_ = compileExpr(expr->expression, dest_);
+  }
+
+  void RegisterCompiler::visit(const Literal* expr) {
+    Token* value = expr->value;
+    int a = destination();
+    switch (value->type) {
+      case TOKEN_NUMBER: emit(value, {ROP_LOAD_CONSTANT, a, numberConstant(expr)}); break;
+      case TOKEN_FALSE: emit(value, {ROP_LOAD_FALSE, a}); break;
+      case TOKEN_NIL: emit(value, {ROP_LOAD_NIL, a}); break;
+      case TOKEN_TRUE: emit(value, {ROP_LOAD_TRUE, a}); break;
+      case TOKEN_STRING: {
+        // Trim double quotes.
+        ObjString* s = vm_.allocateObj<ObjString>(value->start + 1, value->length - 2);
+        emit(value, {ROP_LOAD_CONSTANT, a, makeConstant(value, s->asValue())});
+        break;
+      }
+      default: UNREACHABLE();
+    }
+    result_ = a;
+  }
+
+  void RegisterCompiler::visit(const Logical* expr) {
+    // The left operand is written to the result register before the right one is evaluated, so a
+    // local can't be used as the result register: the right operand may read it.
+    int dest = dest_;
+    int a = dest >= 0 && !isLocalRegister(dest) ? dest : allocRegister();
+
+    compileExpr(expr->left, a);
+    int jump = emitJump(
+      expr->op, {expr->op->type == TOKEN_AND ? ROP_JUMP_IF_FALSE : ROP_JUMP_IF_TRUE, a});
+    compileExpr(expr->right, a);
+    patchJump(expr->op, jump);
+
+    result_ = a;
+    if (dest >= 0 && dest != a) {
+      emit(expr->op, {ROP_MOVE, dest, a});
+      result_ = dest;
+    }
+  }
+
+  void RegisterCompiler::visit(const Set* expr) {
+    unsupported();
+  }
+
+  void RegisterCompiler::visit(const Super* expr) {
+    unsupported();
+  }
+
+  void RegisterCompiler::visit(const This* expr) {
+    unsupported();
+  }
+
+  void RegisterCompiler::visit(const Unary* expr) {
+    int mark = freeRegister_;
+    int right = compileExpr(expr->right);
+    freeRegister_ = mark;
+    int a = destination();
+
+    switch (expr->op->type) {
+      case TOKEN_BANG: emit(expr->op, {ROP_NOT, a, right}); break;
+      case TOKEN_MINUS: emit(expr->op, {ROP_NEGATE, a, right}); break;
+      default: UNREACHABLE();
+    }
+    result_ = a;
+  }
+
+  void RegisterCompiler::visit(const Variable* expr) {
+    int local = resolveLocal(expr->name);
+    if (local != -1) {
+      result_ = local;
+      if (dest_ >= 0 && dest_ != local) {
+        emit(expr->name, {ROP_MOVE, dest_, local});
+        result_ = dest_;
+      }
+    } else if (isEnclosingLocal(expr->name)) {
+      unsupported();
+    } else {
+      result_ = destination();
+      emitGlobal(expr->name, ROP_GET_GLOBAL, result_);
+    }
+  }
+
+  void RegisterCompiler::visit(const Block* stmt) {
+    scopeDepth_++;
+    for (int i = 0; i < stmt->statements.size(); i++) compileStmt(stmt->statements[i]);
+    endScope();
+  }
+
+  void RegisterCompiler::visit(const Class* stmt) {
+    unsupported();
+  }
+
+  void RegisterCompiler::visit(const Expression* stmt) {
+    compileExpr(stmt->expression);
+  }
+
+  void RegisterCompiler::visit(const Function* stmt) {
+    if (scopeDepth_ == 0) {
+      int reg = allocRegister();
+      compileFunction(stmt, reg);
+      emitGlobal(stmt->name, ROP_DEFINE_GLOBAL, reg);
+    } else {
+      int local = addLocal(stmt->name);
+      locals_[local].depth = scopeDepth_;
+      compileFunction(stmt, local);
+    }
+  }
+
+  void RegisterCompiler::compileFunction(const Function* fn, int dest) {
+    RegisterCompiler fnCompiler(vm_, this, fn);
+    fnCompiler.scopeDepth_ = 1;
+
+    for (int i = 0; i < fn->params.size(); i++) {
+      int param = fnCompiler.addLocal(fn->params[i]);
+      fnCompiler.locals_[param].depth = 1;
+    }
+    for (int i = 0; i < fn->body.size() && !fnCompiler.unsupported_; i++) {
+      fnCompiler.compileStmt(fn->body[i]);
+    }
+    fnCompiler.endCompiler(fn->getStop());
+
+    if (fnCompiler.unsupported_) {
+      unsupported();
+      return;
+    }
+    emit(fn->getStart(),
+         {ROP_CLOSURE, dest, makeConstant(fn->getStart(), fnCompiler.function_->asValue())});
+  }
+
+  void RegisterCompiler::visit(const If* stmt) {
+    int thenJumpOffset = compileCondition(stmt->condition);
+    freeRegister_ = locals_.size();
+
+    compileStmt(stmt->thenBranch);
+    if (stmt->elseBranch) {
+      int elseJumpOffset = emitJump(stmt->getStart(), {ROP_JUMP});
+      patchJump(stmt->getStart(), thenJumpOffset);
+      compileStmt(stmt->elseBranch);
+      patchJump(stmt->getStart(), elseJumpOffset);
+    } else {
+      patchJump(stmt->getStart(), thenJumpOffset);
+    }
+  }
+
+  void RegisterCompiler::visit(const Print* stmt) {
+    int reg = compileExpr(stmt->expression);
+    emit(stmt->start, {ROP_PRINT, reg});
+  }
+
+  void RegisterCompiler::visit(const Return* stmt) {
+    // Returning from top-level code is an error the stack compiler reports.
+    if (function_->type() == TYPE_SCRIPT) unsupported();
+
+    if (stmt->value) {
+      int reg = compileExpr(stmt->value);
+      emit(stmt->value->getStart(), {ROP_RETURN, reg});
+    } else {
+      emit(stmt->getStart(), {ROP_RETURN_NIL});
+    }
+  }
+
+  void RegisterCompiler::visit(const Var* stmt) {
+    if (scopeDepth_ == 0) {
+      int reg = allocRegister();
+      if (stmt->initializer)
+        compileExpr(stmt->initializer, reg);
+      else
+        emit(stmt->name, {ROP_LOAD_NIL, reg});
+      emitGlobal(stmt->name, ROP_DEFINE_GLOBAL, reg);
+      return;
+    }
+
+    int local = addLocal(stmt->name);
+    if (stmt->initializer)
+      compileExpr(stmt->initializer, local);
+    else
+      emit(stmt->name, {ROP_LOAD_NIL, local});
+    locals_[local].depth = scopeDepth_;
+  }
+
+  void RegisterCompiler::visit(const While* stmt) {
+    int loopStart = currentChunk().count();
+
+    int exitJumpOffset = compileCondition(stmt->condition);
+    freeRegister_ = locals_.size();
+
+    compileStmt(stmt->body);
+    emitLoop(stmt->getStart(), loopStart);
+
+    patchJump(stmt->getStart(), exitJumpOffset);
+  }
+
+}; // namespace lox
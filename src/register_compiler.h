@@ -0,0 +1,132 @@
+#pragma once
+
+#include <initializer_list>
+
+#include "ast.h"
+#include "compiler.h"
+#include "lexer.h"
+#include "register_op_code.h"
+#include "value/object.h"
+
+namespace lox {
+
+  class VM;
+
+  struct RegisterLocal {
+    RegisterLocal() {}
+    RegisterLocal(Token* name, int depth)
+      : name(name)
+      , depth(depth) {}
+
+    Token* name = nullptr; // Null for register 0, which holds the callee.
+    int depth = -1;        // -1 while the initializer is being compiled.
+  };
+
+  // Compiles a script to three-address bytecode for VM::runRegisters. Locals live in fixed
+  // registers of the call frame (local i in register i) and temporaries are allocated above them,
+  // so operands are read in place instead of being pushed and popped around every operation.
+  //
+  // Only a subset of the language is handled: classes and closures that capture variables are not.
+  // If a script uses them, or fails to compile, compile() returns null and fallback() is set. The
+  // VM then compiles the script with the stack Compiler, which also reports any compile errors.
+  class RegisterCompiler
+    : public Expr::Visitor<void>
+    , public Stmt::Visitor<void> {
+    friend class VM;
+
+   public:
+    RegisterCompiler(VM& vm, const char* source);
+    ~RegisterCompiler();
+
+    ObjFunction* compile();
+
+    bool fallback() const {
+      return unsupported_;
+    }
+
+    void gcBlacken(VM& vm) const;
+
+   private:
+    RegisterCompiler(VM& vm, RegisterCompiler* enclosing, const Function* fn);
+
+    virtual void visit(const Assign* expr);
+    virtual void visit(const Binary* expr);
+    virtual void visit(const Call* expr);
+    virtual void visit(const Get* expr);
+    virtual void visit(const Grouping* expr);
+    virtual void visit(const Literal* expr);
+    virtual void visit(const Logical* expr);
+    virtual void visit(const Set* expr);
+    virtual void visit(const Super* expr);
+    virtual void visit(const This* expr);
+    virtual void visit(const Unary* expr);
+    virtual void visit(const Variable* expr);
+
+    virtual void visit(const Block* stmt);
+    virtual void visit(const Class* stmt);
+    virtual void visit(const Expression* stmt);
+    virtual void visit(const Function* stmt);
+    virtual void visit(const If* stmt);
+    virtual void visit(const Print* stmt);
+    virtual void visit(const Return* stmt);
+    virtual void visit(const Var* stmt);
+    virtual void visit(const While* stmt);
+
+    Chunk& currentChunk() const {
+      return function_->chunk();
+    }
+
+    // Compiles `expr` and returns the register holding its value. The value is written to `dest`
+    // when one is given; otherwise a local is returned in its own register without a copy.
+    int compileExpr(const Expr* expr, int dest = -1);
+    void compileStmt(const Stmt* stmt);
+    void compileOperands(const Binary* expr, int* left, int* right);
+    int compileCondition(const Expr* condition);
+    void compileFunction(const Function* fn, int dest);
+    void endCompiler(SRC);
+
+    int allocRegister();
+    int destination();
+    bool isLocalRegister(int reg) const {
+      return reg < locals_.size();
+    }
+
+    int addLocal(Token* name);
+    int resolveLocal(Token* name);
+    bool isEnclosingLocal(Token* name);
+    void endScope();
+
+    void emit(SRC, std::initializer_list<int> bytes);
+    int emitJump(SRC, std::initializer_list<int> bytes);
+    void patchJump(SRC, int offset);
+    void emitLoop(SRC, int loopStart);
+    // Emits a global access: `op` A slot, where the slot is a two-byte operand.
+    void emitGlobal(SRC, RegisterOpCode op, int reg);
+
+    int makeConstant(SRC, Value value);
+    int numberConstant(const Literal* literal);
+    const Literal* numberLiteral(const Expr* expr);
+
+    void unsupported();
+
+   private:
+    Lexer lexer_;
+    VM& vm_;
+    RegisterCompiler* enclosing_ = nullptr;
+
+    ObjFunction* function_ = nullptr;
+
+    static constexpr int REGISTERS_MAX = 256;
+    Vector<RegisterLocal> locals_;
+    int scopeDepth_ = 0;
+    int freeRegister_ = 0;   // First register above locals_ not holding a live temporary.
+    int registerCount_ = 0;  // High-water mark of freeRegister_.
+    int localWrites_ = 0;    // Number of assignments to locals compiled so far.
+
+    int dest_ = -1;   // Destination requested from the expression being visited.
+    int result_ = -1; // Register the visited expression left its value in.
+
+    bool unsupported_ = false;
+  };
+
+}; // namespace lox
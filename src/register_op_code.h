@@ -0,0 +1,91 @@
+#pragma once
+
+namespace lox {
+
+// Three-address instruction set of the register tier (see RegisterCompiler and VM::runRegisters).
+// Operands are single bytes: A, B and C name registers of the current frame and K a constant of the
+// chunk. Jump offsets and G, a global variable slot of the VM, are two bytes, as in the stack
+// instruction set.
+//
+//   ROP_MOVE                A B      R[A] = R[B]
+//   ROP_LOAD_CONSTANT       A K      R[A] = K
+//   ROP_LOAD_NIL            A
+//   ROP_LOAD_TRUE           A
+//   ROP_LOAD_FALSE          A
+//   ROP_GET_GLOBAL          A G      R[A] = globals[G]
+//   ROP_SET_GLOBAL          A G      globals[G] = R[A]
+//   ROP_DEFINE_GLOBAL       A G
+//   ROP_EQUAL               A B C    R[A] = R[B] == R[C]
+//   ROP_GREATER             A B C
+//   ROP_LESS                A B C
+//   ROP_ADD                 A B C    R[A] = R[B] + R[C]
+//   ROP_SUBTRACT            A B C
+//   ROP_MULTIPLY            A B C
+//   ROP_DIVIDE              A B C
+//   ROP_ADD_CONSTANT        A B K    R[A] = R[B] + K
+//   ROP_SUBTRACT_CONSTANT   A B K
+//   ROP_NOT                 A B
+//   ROP_NEGATE              A B
+//   ROP_PRINT               A
+//   ROP_JUMP                off
+//   ROP_JUMP_IF_FALSE       A off
+//   ROP_JUMP_IF_TRUE        A off
+//   ROP_JUMP_IF_NOT_LESS    B C off  jump unless R[B] < R[C]
+//   ROP_JUMP_IF_NOT_LESS_K  B K off  jump unless R[B] < K
+//   ROP_LOOP                off
+//   ROP_CALL                A argc   callee in R[A], arguments above it, result in R[A]
+//   ROP_CLOSURE             A K
+//   ROP_RETURN              A
+//   ROP_RETURN_NIL
+#define REGISTER_OPCODES(V) \
+  V(ROP_MOVE)               \
+  V(ROP_LOAD_CONSTANT)      \
+  V(ROP_LOAD_NIL)           \
+  V(ROP_LOAD_TRUE)          \
+  V(ROP_LOAD_FALSE)         \
+  V(ROP_GET_GLOBAL)         \
+  V(ROP_SET_GLOBAL)         \
+  V(ROP_DEFINE_GLOBAL)      \
+  V(ROP_EQUAL)              \
+  V(ROP_GREATER)            \
+  V(ROP_LESS)               \
+  V(ROP_ADD)                \
+  V(ROP_SUBTRACT)           \
+  V(ROP_MULTIPLY)           \
+  V(ROP_DIVIDE)             \
+  V(ROP_ADD_CONSTANT)       \
+  V(ROP_SUBTRACT_CONSTANT)  \
+  V(ROP_NOT)                \
+  V(ROP_NEGATE)             \
+  V(ROP_PRINT)              \
+  V(ROP_JUMP)               \
+  V(ROP_JUMP_IF_FALSE)      \
+  V(ROP_JUMP_IF_TRUE)       \
+  V(ROP_JUMP_IF_NOT_LESS)   \
+  V(ROP_JUMP_IF_NOT_LESS_K) \
+  V(ROP_LOOP)               \
+  V(ROP_CALL)               \
+  V(ROP_CLOSURE)            \
+  V(ROP_RETURN)             \
+  V(ROP_RETURN_NIL)
+
+  enum RegisterOpCode {
+#define OPCODE_ENUM(op) op,
+    REGISTER_OPCODES(OPCODE_ENUM)
+#undef OPCODE_ENUM
+  };
+
+#define OPCODE_ONE(op) +1
+  constexpr int REGISTER_OPCODE_COUNT = 0 REGISTER_OPCODES(OPCODE_ONE);
+#undef OPCODE_ONE
+
+  inline const char* registerOpcodeName(int op) {
+    static const char* names[] = {
+#define OPCODE_NAME(op) #op,
+      REGISTER_OPCODES(OPCODE_NAME)
+#undef OPCODE_NAME
+    };
+    return op >= 0 && op < REGISTER_OPCODE_COUNT ? names[op] : "<unknown>";
+  }
+
+}; // namespace lox
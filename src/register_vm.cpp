@@ -0,0 +1,352 @@
+#include <iostream>
+
+#include "chunk.h"
+#include "common.h"
+#include "debug.h"
+#include "register_op_code.h"
+#include "value/object.h"
+#include "value/value.h"
+#include "vm.h"
+
+namespace lox {
+
+  // Interpreter loop for code from the RegisterCompiler. A frame's registers are the value stack
+  // slots starting at its callee, so calls and GC root scanning work as in the stack tier;
+  // stackTop_ always sits just above the current frame's registers.
+  InterpretResult VM::runRegisters() {
+    CallFrame* frame;
+    const instruction* ip;
+    Value* slots;
+
+#define STORE_FRAME() (frame->ip = ip)
+
+    // Registers above the arguments may hold stale values from frames that have returned, and
+    // those may point to freed objects, so they're cleared before the GC can see them.
+#define LOAD_FRAME(argCount)                                            \
+  do {                                                                  \
+    frame = &frames_[frameCount_ - 1];                                  \
+    ip = frame->ip;                                                     \
+    slots = frame->slots;                                               \
+    stackTop_ = slots + frame->closure->fn()->registerCount();          \
+    for (Value* reg = slots + (argCount) + 1; reg < stackTop_; reg++) { \
+      *reg = Nil().asValue();                                           \
+    }                                                                   \
+  } while (false)
+
+#define RESTORE_FRAME()                                        \
+  do {                                                         \
+    frame = &frames_[frameCount_ - 1];                         \
+    ip = frame->ip;                                            \
+    slots = frame->slots;                                      \
+    stackTop_ = slots + frame->closure->fn()->registerCount(); \
+  } while (false)
+
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)(ip[-2] << 8 | ip[-1]))
+#define READ_CONSTANT() (frame->closure->fn()->chunk().getConstant(READ_BYTE()))
+#define R(index) (slots[index])
+
+#define RUNTIME_ERROR(...)          \
+  do {                              \
+    STORE_FRAME();                  \
+    runtimeError(__VA_ARGS__);      \
+    return INTERPRET_RUNTIME_ERROR; \
+  } while (false)
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_INSTRUCTION()                                                        \
+  do {                                                                             \
+    STORE_FRAME();                                                                 \
+    traceStack();                                                                  \
+    const Chunk& chunk = frame->closure->fn()->chunk();                            \
+    Disassembler::disassembleRegisterInstruction(chunk, (int)(ip - chunk.code())); \
+  } while (false)
+#else
+#define TRACE_INSTRUCTION() \
+  do {                      \
+  } while (false)
+#endif
+
+#ifdef PROFILE_OPCODES
+#define PROFILE_INSTRUCTION() profileInstruction(frame->closure->fn(), ip)
+#else
+#define PROFILE_INSTRUCTION() \
+  do {                        \
+  } while (false)
+#endif
+
+#ifdef COMPUTED_GOTO
+    static void* dispatchTable[] = {
+#define OPCODE_LABEL(op) &&L_##op,
+      REGISTER_OPCODES(OPCODE_LABEL)
+#undef OPCODE_LABEL
+    };
+
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(op) L_##op:
+#define DISPATCH()                    \
+  do {                                \
+    TRACE_INSTRUCTION();              \
+    PROFILE_INSTRUCTION();            \
+    goto* dispatchTable[READ_BYTE()]; \
+  } while (false)
+#else
+#define INTERPRET_LOOP   \
+  loop:                  \
+  TRACE_INSTRUCTION();   \
+  PROFILE_INSTRUCTION(); \
+  switch (READ_BYTE())
+#define CASE(op) case op:
+#define DISPATCH() goto loop
+#endif
+
+#define BINARY_OP(type, op)                            \
+  do {                                                 \
+    Value* a = &R(READ_BYTE());                        \
+    Value b = R(READ_BYTE());                          \
+    Value c = R(READ_BYTE());                          \
+    if (!b.isNumber() || !c.isNumber()) {              \
+      RUNTIME_ERROR("Operands must be numbers.");      \
+    }                                                  \
+    *a = type(b.asNumber() op c.asNumber()).asValue(); \
+  } while (false)
+
+// The result replaces the callee in the caller's registers, or on the stack of a caller on the
+// stack tier (see callAcrossTiers).
+#define RETURN(value)                    \
+  do {                                   \
+    Value result = (value);              \
+    frameCount_--;                       \
+    if (frameCount_ == baseFrame_) {     \
+      stackTop_ = slots;                 \
+      if (frameCount_ > 0) push(result); \
+      return INTERPRET_OK;               \
+    }                                    \
+    slots[0] = result;                   \
+    RESTORE_FRAME();                     \
+  } while (false)
+
+    // The script, or a function called from the stack tier with its arguments in place.
+    LOAD_FRAME(frame->closure->fn()->arity());
+
+    INTERPRET_LOOP {
+      CASE(ROP_MOVE) {
+        instruction a = READ_BYTE();
+        R(a) = R(READ_BYTE());
+        DISPATCH();
+      }
+      CASE(ROP_LOAD_CONSTANT) {
+        instruction a = READ_BYTE();
+        R(a) = READ_CONSTANT();
+        DISPATCH();
+      }
+      CASE(ROP_LOAD_NIL) R(READ_BYTE()) = Nil().asValue(); DISPATCH();
+      CASE(ROP_LOAD_TRUE) R(READ_BYTE()) = Bool(true).asValue(); DISPATCH();
+      CASE(ROP_LOAD_FALSE) R(READ_BYTE()) = Bool(false).asValue(); DISPATCH();
+
+      CASE(ROP_GET_GLOBAL) {
+        instruction a = READ_BYTE();
+        uint16_t slot = READ_SHORT();
+        if (globals_[slot].isUninitialized()) {
+          RUNTIME_ERROR("Undefined variable '%s'.", globalNames_[slot]->value());
+        }
+        R(a) = globals_[slot];
+        DISPATCH();
+      }
+      CASE(ROP_SET_GLOBAL) {
+        instruction a = READ_BYTE();
+        uint16_t slot = READ_SHORT();
+        if (globals_[slot].isUninitialized()) {
+          RUNTIME_ERROR("Undefined variable '%s'.", globalNames_[slot]->value());
+        }
+        globals_[slot] = R(a);
+        DISPATCH();
+      }
+      CASE(ROP_DEFINE_GLOBAL) {
+        instruction a = READ_BYTE();
+        globals_[READ_SHORT()] = R(a);
+        DISPATCH();
+      }
+
+      CASE(ROP_EQUAL) {
+        Value* a = &R(READ_BYTE());
+        Value b = R(READ_BYTE());
+        Value c = R(READ_BYTE());
+        *a = Bool(b == c).asValue();
+        DISPATCH();
+      }
+      CASE(ROP_GREATER) BINARY_OP(Bool, >); DISPATCH();
+      CASE(ROP_LESS) BINARY_OP(Bool, <); DISPATCH();
+
+      CASE(ROP_ADD) {
+        Value* a = &R(READ_BYTE());
+        Value b = R(READ_BYTE());
+        Value c = R(READ_BYTE());
+        if (b.isNumber() && c.isNumber()) {
+          *a = (b.asNumber() + c.asNumber()).asValue();
+        } else if (b.isString() && c.isString()) {
+          // Both operands stay reachable from their registers while the result is allocated.
+          STORE_FRAME();
+          *a = concatString(b.asString(), c.asString())->asValue();
+        } else {
+          RUNTIME_ERROR("Operands must be two numbers or two strings.");
+        }
+        DISPATCH();
+      }
+      CASE(ROP_SUBTRACT) BINARY_OP(Number, -); DISPATCH();
+      CASE(ROP_MULTIPLY) BINARY_OP(Number, *); DISPATCH();
+      CASE(ROP_DIVIDE) BINARY_OP(Number, /); DISPATCH();
+
+      CASE(ROP_ADD_CONSTANT) {
+        Value* a = &R(READ_BYTE());
+        Value b = R(READ_BYTE());
+        Value k = READ_CONSTANT();
+        if (!b.isNumber()) {
+          RUNTIME_ERROR("Operands must be two numbers or two strings.");
+        }
+        *a = (b.asNumber() + k.asNumber()).asValue();
+        DISPATCH();
+      }
+      CASE(ROP_SUBTRACT_CONSTANT) {
+        Value* a = &R(READ_BYTE());
+        Value b = R(READ_BYTE());
+        Value k = READ_CONSTANT();
+        if (!b.isNumber()) {
+          RUNTIME_ERROR("Operands must be numbers.");
+        }
+        *a = (b.asNumber() - k.asNumber()).asValue();
+        DISPATCH();
+      }
+
+      CASE(ROP_NOT) {
+        instruction a = READ_BYTE();
+        R(a) = Bool(R(READ_BYTE()).isFalsey()).asValue();
+        DISPATCH();
+      }
+      CASE(ROP_NEGATE) {
+        instruction a = READ_BYTE();
+        Value b = R(READ_BYTE());
+        if (!b.isNumber()) {
+          RUNTIME_ERROR("Operand must be a number.");
+        }
+        R(a) = (-b.asNumber()).asValue();
+        DISPATCH();
+      }
+
+      CASE(ROP_PRINT) {
+        out_ << R(READ_BYTE()) << std::endl;
+        DISPATCH();
+      }
+
+      CASE(ROP_JUMP) {
+        uint16_t offset = READ_SHORT();
+        ip += offset;
+        DISPATCH();
+      }
+      CASE(ROP_JUMP_IF_FALSE) {
+        Value condition = R(READ_BYTE());
+        uint16_t offset = READ_SHORT();
+        if (condition.isFalsey()) ip += offset;
+        DISPATCH();
+      }
+      CASE(ROP_JUMP_IF_TRUE) {
+        Value condition = R(READ_BYTE());
+        uint16_t offset = READ_SHORT();
+        if (!condition.isFalsey()) ip += offset;
+        DISPATCH();
+      }
+      CASE(ROP_JUMP_IF_NOT_LESS) {
+        Value b = R(READ_BYTE());
+        Value c = R(READ_BYTE());
+        uint16_t offset = READ_SHORT();
+        if (!b.isNumber() || !c.isNumber()) {
+          RUNTIME_ERROR("Operands must be numbers.");
+        }
+        if (!(b.asNumber() < c.asNumber())) ip += offset;
+        DISPATCH();
+      }
+      CASE(ROP_JUMP_IF_NOT_LESS_K) {
+        Value b = R(READ_BYTE());
+        Value k = READ_CONSTANT();
+        uint16_t offset = READ_SHORT();
+        if (!b.isNumber()) {
+          RUNTIME_ERROR("Operands must be numbers.");
+        }
+        if (!(b.asNumber() < k.asNumber())) ip += offset;
+        DISPATCH();
+      }
+      CASE(ROP_LOOP) {
+        uint16_t offset = READ_SHORT();
+        ip -= offset;
+        DISPATCH();
+      }
+
+      CASE(ROP_CALL) {
+        instruction base = READ_BYTE();
+        int argCount = READ_BYTE();
+        Value callee = R(base);
+        if (callee.isNative()) {
+          STORE_FRAME();
+          if (!callNative(callee.asNative(), &R(base + 1), argCount)) {
+            return INTERPRET_RUNTIME_ERROR;
+          }
+          RESTORE_FRAME();
+          DISPATCH();
+        }
+        if (!callee.isClosure()) {
+          RUNTIME_ERROR("Can only call functions and classes.");
+        }
+        ObjClosure* closure = callee.asClosure();
+        if (argCount != closure->fn()->arity()) {
+          RUNTIME_ERROR("Expected %d arguments but got %d.", closure->fn()->arity(), argCount);
+        }
+        if (frameCount_ == config_.maxFrames) {
+          RUNTIME_ERROR("Stack overflow.");
+        }
+
+        STORE_FRAME();
+        if (!closure->fn()->isRegisterCode()) {
+          // Defined by an earlier script on this VM that ran on the stack tier.
+          stackTop_ = &R(base) + argCount + 1;
+          if (!callAcrossTiers(closure, argCount)) return INTERPRET_RUNTIME_ERROR;
+          RESTORE_FRAME();
+          // Registers above the result held the callee's stack, which may since have moved.
+          for (Value* reg = &R(base) + 1; reg < stackTop_; reg++) *reg = Nil().asValue();
+          DISPATCH();
+        }
+        appendCallFrame(closure, &R(base));
+        LOAD_FRAME(argCount);
+        DISPATCH();
+      }
+      CASE(ROP_CLOSURE) {
+        instruction a = READ_BYTE();
+        ObjFunction* function = READ_CONSTANT().asFunction();
+        STORE_FRAME();
+        R(a) = allocateObj<ObjClosure>(function)->asValue();
+        DISPATCH();
+      }
+
+      CASE(ROP_RETURN) RETURN(R(READ_BYTE())); DISPATCH();
+      CASE(ROP_RETURN_NIL) RETURN(Nil().asValue()); DISPATCH();
+    }
+
+    UNREACHABLE();
+
+#undef RETURN
+#undef BINARY_OP
+#undef DISPATCH
+#undef CASE
+#undef INTERPRET_LOOP
+#undef PROFILE_INSTRUCTION
+#undef TRACE_INSTRUCTION
+#undef RUNTIME_ERROR
+#undef R
+#undef READ_CONSTANT
+#undef READ_SHORT
+#undef READ_BYTE
+#undef RESTORE_FRAME
+#undef LOAD_FRAME
+#undef STORE_FRAME
+  }
+
+} // namespace lox
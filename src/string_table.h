@@ -21,13 +21,19 @@ namespace lox {
       return nullptr;
     }
 
-    void removeUnmarkedStrings() {
+    // Forgets `s` if it is the interned string for its characters.
+    void remove(ObjString* s) {
+      ObjString* interned;
+      if (map_.get(s, &interned) && interned == s) map_.remove(s);
+    }
+
+    void removeUnmarkedStrings(uint8_t epoch) {
       // Interned strings
       for (int i = 0; i < map_.capacity(); ++i) {
         Map<StringKey, ObjString*>::Entry* e = map_.getEntry(i);
         if (e->isEmpty()) continue;
 
-        if (!e->value->isGCMarked()) map_.remove(e->key);
+        if (!e->value->isGCMarked(epoch)) map_.remove(e->key);
       }
     }
 
@@ -0,0 +1,820 @@
+#include "trace.h"
+
+#include <stddef.h>
+
+#include "common.h"
+#include "debug.h"
+#include "op_code.h"
+#include "value/object.h"
+#include "vm.h"
+#include "x64_assembler.h"
+
+namespace lox {
+
+  static Value numberOp(instruction op, Number a, Number b) {
+    switch (op) {
+      case OP_SUBTRACT: return (a - b).asValue();
+      case OP_MULTIPLY: return (a * b).asValue();
+      case OP_DIVIDE: return (a / b).asValue();
+      case OP_EQUAL:
+      case OP_EQUAL_NUM:
+      case OP_EQUAL_GENERIC: return Bool(a == b).asValue();
+      case OP_GREATER: return Bool(a > b).asValue();
+      case OP_LESS: return Bool(a < b).asValue();
+      default: return (a + b).asValue();
+    }
+  }
+
+  bool TraceRecorder::record() {
+    const Chunk& chunk = frame_->closure->fn()->chunk();
+    const instruction* code = chunk.code();
+    Value* slots = frame_->slots;
+    Value* base = sp_; // Every iteration leaves the stack as it found it.
+    Value* sp = sp_;
+    int header = frame_->ip - code;
+    int offset = header;
+    stackBase_ = base - slots;
+
+#define SHORT_OPERAND(at) ((uint16_t)(code[(at)] << 8 | code[(at) + 1]))
+#define CONSTANT_OPERAND(at) (chunk.getConstant(code[(at)]))
+#define STOP_UNLESS(condition) \
+  if (!(condition)) return stop(offset, sp, false)
+
+    while (steps_.size() < MAX_LENGTH) {
+      int next = Disassembler::nextOffset(chunk, offset);
+      bool jumped = false;
+      switch (code[offset]) {
+        case OP_CONSTANT: {
+          Value value = CONSTANT_OPERAND(offset + 1);
+          STOP_UNLESS(value.isNumber());
+          *sp++ = value;
+          break;
+        }
+        case OP_POP:
+          STOP_UNLESS(sp > base);
+          sp--;
+          break;
+        case OP_GET_LOCAL: {
+          Value value = slots[code[offset + 1]];
+          STOP_UNLESS(value.isNumber());
+          *sp++ = value;
+          break;
+        }
+        case OP_GET_LOCALS: {
+          Value first = slots[code[offset + 1]];
+          Value second = slots[code[offset + 2]];
+          STOP_UNLESS(first.isNumber() && second.isNumber());
+          *sp++ = first;
+          *sp++ = second;
+          break;
+        }
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_POP:
+          STOP_UNLESS(sp > base && sp[-1].isNumber());
+          slots[code[offset + 1]] = sp[-1];
+          if (code[offset] == OP_SET_LOCAL_POP) sp--;
+          break;
+        case OP_GET_GLOBAL: {
+          // A closure can only go on as the callee of an inlined call: whatever else uses it
+          // stops the recording.
+          Value value = vm_.globals_[SHORT_OPERAND(offset + 1)];
+          STOP_UNLESS(value.isNumber() || value.isClosure());
+          *sp++ = value;
+          break;
+        }
+        case OP_SET_GLOBAL: {
+          uint16_t slot = SHORT_OPERAND(offset + 1);
+          STOP_UNLESS(sp > base && sp[-1].isNumber() && !vm_.globals_[slot].isUninitialized());
+          vm_.globals_[slot] = sp[-1];
+          break;
+        }
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_GENERIC:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_EQUAL:
+        case OP_EQUAL_NUM:
+        case OP_EQUAL_GENERIC:
+        case OP_GREATER:
+        case OP_LESS:
+          STOP_UNLESS(sp - base >= 2 && sp[-1].isNumber() && sp[-2].isNumber());
+          sp[-2] = numberOp(code[offset], sp[-2].asNumber(), sp[-1].asNumber());
+          sp--;
+          break;
+        case OP_NEGATE:
+          STOP_UNLESS(sp > base && sp[-1].isNumber());
+          sp[-1] = (-sp[-1].asNumber()).asValue();
+          break;
+        case OP_ADD_LOCAL_CONSTANT: {
+          Value a = slots[code[offset + 1]];
+          Value b = CONSTANT_OPERAND(offset + 2);
+          STOP_UNLESS(a.isNumber() && b.isNumber());
+          *sp++ = (a.asNumber() + b.asNumber()).asValue();
+          break;
+        }
+        case OP_JUMP:
+          next += SHORT_OPERAND(offset + 1);
+          break;
+        case OP_JUMP_IF_FALSE:
+          // Only comparisons leave booleans in a trace.
+          STOP_UNLESS(sp > base && sp[-1].isBool());
+          jumped = sp[-1].isFalsey();
+          if (jumped) next += SHORT_OPERAND(offset + 1);
+          break;
+        case OP_LESS_JUMP:
+          STOP_UNLESS(sp - base >= 2 && sp[-1].isNumber() && sp[-2].isNumber());
+          jumped = !(sp[-2].asNumber() < sp[-1].asNumber());
+          sp -= 2;
+          if (jumped) next += SHORT_OPERAND(offset + 1);
+          break;
+        case OP_LOCAL_CONSTANT_LESS_JUMP: {
+          Value a = slots[code[offset + 1]];
+          Value b = CONSTANT_OPERAND(offset + 2);
+          STOP_UNLESS(a.isNumber() && b.isNumber());
+          jumped = !(a.asNumber() < b.asNumber());
+          if (jumped) next += SHORT_OPERAND(offset + 3);
+          break;
+        }
+        case OP_INLINE_GUARD: {
+          // Only a callee the guard has cached is traced, so that the trace can check it by
+          // identity.
+          int argCount = code[offset + 1];
+          const InlinedCall& call = chunk.inlinedCalls()[code[offset + 2]];
+          STOP_UNLESS(sp - base > argCount && call.closure &&
+                      sp[-1 - argCount] == call.closure->asValue());
+          break;
+        }
+        case OP_LOOP:
+          // An inner loop would be unrolled into the trace; it gets a trace of its own instead.
+          STOP_UNLESS(next - SHORT_OPERAND(offset + 1) == header && sp == base);
+          steps_.push({offset, false});
+          return stop(header, sp, true);
+        default:
+          return stop(offset, sp, false);
+      }
+      steps_.push({offset, jumped});
+      offset = next;
+    }
+    return stop(offset, sp, false);
+
+#undef STOP_UNLESS
+#undef CONSTANT_OPERAND
+#undef SHORT_OPERAND
+  }
+
+  bool TraceRecorder::stop(int offset, Value* sp, bool completed) {
+    frame_->ip = frame_->closure->fn()->chunk().code() + offset;
+    sp_ = sp;
+    return completed;
+  }
+
+#ifdef JIT_X64
+
+  // Compiles a recorded trace. Native register use:
+  //   RDI  CallFrame*
+  //   RSI  stack top at the loop header, which every iteration gets back to
+  //   R8   frame slots
+  //   R9   globals
+  //   R10  QNAN, to test for numbers
+  //   XMM2-XMM15  variables and intermediate results, as raw doubles
+  // RAX, RCX, RDX, XMM0 and XMM1 are scratch. A trace calls nothing, so it needs no frame and
+  // uses only caller-saved registers.
+  class TraceCompiler {
+   public:
+    TraceCompiler(VM& vm, ObjFunction* fn, const TraceRecorder& recorder)
+      : vm_(vm)
+      , chunk_(fn->chunk())
+      , steps_(recorder.steps())
+      , stackBase_(recorder.stackBase()) {}
+
+    bool compile(LoopTrace* trace);
+
+   private:
+    // What a variable is checked for when the trace is entered. Variables the trace reads before
+    // writing must be numbers; a global it only writes must be defined.
+    enum Guard { GUARD_NONE, GUARD_NUMBER, GUARD_DEFINED };
+
+    // A local or global the trace keeps in a register.
+    struct Variable {
+      bool global;
+      int slot;
+      Xmm reg;
+      Guard guard;
+      bool written; // Stored back when the trace exits.
+    };
+
+    // A stack value as the compiler tracks it: a number in `reg`, a constant, or the result of
+    // comparing `reg` to `other` with `op`, which isn't materialized until a jump tests it.
+    // Operands read from a variable share its register and aren't `temp`.
+    struct Operand {
+      enum Kind { NUMBER, CONSTANT, COMPARISON };
+
+      Kind kind;
+      Xmm reg;
+      bool temp;
+      Xmm other;
+      bool otherTemp;
+      instruction op;
+      Value constant;
+    };
+
+    // Where a guard leaves the trace: the instruction VM::run continues at and the stack it
+    // expects there, a slice of exitOperands_.
+    struct Exit {
+      int jumps[2] = {0, 0};
+      int jumpCount = 0;
+      int resume = 0;
+      int operandStart = 0;
+      int operandCount = 0;
+    };
+
+    // A global holding a closure, which the trace only passes to inlined call guards. It is
+    // checked to hold the same closure on entry and treated as a constant.
+    struct Callee {
+      int slot;
+      Value closure;
+    };
+
+    void collectVariables(const TraceStep& step);
+    void useVariable(bool global, int slot, bool read);
+    const Callee* callee(int slot) const;
+    Variable* variable(bool global, int slot);
+    // Operand that reads local `slot`, from its variable or, for locals declared in the loop body,
+    // from the stack.
+    Operand local(int slot);
+
+    void emitPrologue();
+    void emitStep(const TraceStep& step);
+    void emitExits();
+
+    void emitStore(Variable* var, bool pop);
+    void emitStackStore(int index, bool pop);
+    void emitArithmetic(void (Assembler::*op)(Xmm, Xmm));
+    void emitNegate();
+    void emitComparison(instruction op);
+    // Compares `left` and `right` with `op` and leaves the trace for `resume` if the result is
+    // `exitWhen`.
+    void emitGuard(instruction op, Operand left, Operand right, bool exitWhen, int resume);
+    void emitLoadConstant(Xmm dst, Value value);
+    // Register holding `operand`, loading a constant into `scratch`.
+    Xmm emitLoad(const Operand& operand, Xmm scratch);
+    // Copies stack operands that share `reg` before the variable it belongs to changes.
+    void protect(Xmm reg);
+
+    Xmm allocate();
+    void release(Xmm reg, bool temp);
+    void release(const Operand& operand);
+
+    Operand number(Xmm reg, bool temp) const {
+      return {Operand::NUMBER, reg, temp, XMM0, false, 0, Value()};
+    }
+
+    Operand constant(Value value) const {
+      return {Operand::CONSTANT, XMM0, false, XMM0, false, 0, value};
+    }
+
+    void push(const Operand& operand) {
+      stack_.push(operand);
+    }
+
+    Operand pop() {
+      if (stack_.isEmpty()) {
+        failed_ = true;
+        return constant(Value());
+      }
+      Operand operand = stack_[-1];
+      stack_.truncate(stack_.size() - 1);
+      return operand;
+    }
+
+    Value constantOperand(int offset) const {
+      return chunk_.getConstant(chunk_.getCode(offset));
+    }
+
+    uint16_t shortOperand(int offset) const {
+      return (uint16_t)(chunk_.getCode(offset) << 8 | chunk_.getCode(offset + 1));
+    }
+
+   private:
+    VM& vm_;
+    Chunk& chunk_;
+    const Vector<TraceStep, Memory::DefaultReallocator>& steps_;
+    int stackBase_;
+    Assembler as_;
+    bool failed_ = false;
+    int loop_ = 0;           // Native offset of the first instruction of an iteration.
+    uint16_t freeRegs_ = 0xfffc; // XMM2-XMM15.
+
+    Vector<Variable, Memory::DefaultReallocator> variables_;
+    Vector<Callee, Memory::DefaultReallocator> callees_;
+    Vector<Operand, Memory::DefaultReallocator> stack_;
+    Vector<Exit, Memory::DefaultReallocator> exits_;
+    Vector<Operand, Memory::DefaultReallocator> exitOperands_;
+    Vector<int, Memory::DefaultReallocator> entryExits_; // Guards on entry, before any state changes.
+  };
+
+  bool TraceCompiler::compile(LoopTrace* trace) {
+    for (int i = 0; i < steps_.size(); i++) collectVariables(steps_[i]);
+    for (int i = 0; i < callees_.size(); i++) {
+      if (variable(true, callees_[i].slot)) failed_ = true;
+    }
+    if (failed_) return false;
+
+    emitPrologue();
+    for (int i = 0; i < steps_.size() && !failed_; i++) emitStep(steps_[i]);
+    if (failed_) return false;
+    emitExits();
+
+    // Guards on entry leave the trace with nothing changed, before the loop header.
+    int entryExit = as_.offset();
+    for (int i = 0; i < entryExits_.size(); i++) as_.patch(entryExits_[i], entryExit);
+    as_.movImm(RCX, (uint64_t)(chunk_.code() + trace->header));
+    as_.store(RDI, offsetof(CallFrame, ip), RCX);
+    as_.mov(RAX, RSI);
+    as_.ret();
+
+    size_t size = as_.offset();
+    void* memory = as_.install();
+    if (!memory) return false;
+    trace->fn = reinterpret_cast<TraceFn>(memory);
+    trace->memory = memory;
+    trace->size = size;
+    return true;
+  }
+
+  void TraceCompiler::collectVariables(const TraceStep& step) {
+    int offset = step.offset;
+    switch (chunk_.getCode(offset)) {
+      case OP_GET_LOCAL:
+      case OP_ADD_LOCAL_CONSTANT:
+      case OP_LOCAL_CONSTANT_LESS_JUMP:
+        useVariable(false, chunk_.getCode(offset + 1), true);
+        break;
+      case OP_GET_LOCALS:
+        useVariable(false, chunk_.getCode(offset + 1), true);
+        useVariable(false, chunk_.getCode(offset + 2), true);
+        break;
+      case OP_SET_LOCAL:
+      case OP_SET_LOCAL_POP:
+        useVariable(false, chunk_.getCode(offset + 1), false);
+        break;
+      case OP_GET_GLOBAL: {
+        int slot = shortOperand(offset + 1);
+        Value value = vm_.globals_[slot];
+        if (!value.isClosure()) {
+          useVariable(true, slot, true);
+        } else if (!callee(slot)) {
+          callees_.push({slot, value});
+        }
+        break;
+      }
+      case OP_SET_GLOBAL:
+        useVariable(true, shortOperand(offset + 1), false);
+        break;
+      default:
+        break;
+    }
+  }
+
+  const TraceCompiler::Callee* TraceCompiler::callee(int slot) const {
+    for (int i = 0; i < callees_.size(); i++) {
+      if (callees_[i].slot == slot) return &callees_[i];
+    }
+    return nullptr;
+  }
+
+  void TraceCompiler::useVariable(bool global, int slot, bool read) {
+    if (!global && slot >= stackBase_) return;
+    if (variable(global, slot)) return;
+    Guard guard = read ? GUARD_NUMBER : global ? GUARD_DEFINED : GUARD_NONE;
+    variables_.push({global, slot, allocate(), guard, false});
+  }
+
+  TraceCompiler::Variable* TraceCompiler::variable(bool global, int slot) {
+    for (int i = 0; i < variables_.size(); i++) {
+      Variable& var = variables_[i];
+      if (var.global == global && var.slot == slot) return &var;
+    }
+    return nullptr;
+  }
+
+  TraceCompiler::Operand TraceCompiler::local(int slot) {
+    if (slot < stackBase_) return number(variable(false, slot)->reg, false);
+    int index = slot - stackBase_;
+    if (index >= stack_.size() || stack_[index].kind == Operand::COMPARISON) {
+      failed_ = true;
+      return constant(Value());
+    }
+    Operand operand = stack_[index];
+    operand.temp = false; // The stack slot keeps the register.
+    return operand;
+  }
+
+  void TraceCompiler::emitPrologue() {
+    as_.load(R8, RDI, offsetof(CallFrame, slots));
+    as_.movImm(RAX, (uint64_t)vm_.globals_.dataAddress());
+    as_.load(R9, RAX, 0);
+    as_.movImm(R10, QNAN);
+
+    // Every variable is loaded, guarded or not, so that exits can store them all back unchanged.
+    for (int i = 0; i < variables_.size(); i++) {
+      const Variable& var = variables_[i];
+      as_.load(RAX, var.global ? R9 : R8, var.slot * sizeof(Value));
+      if (var.guard == GUARD_NUMBER) {
+        as_.mov(RDX, RAX);
+        as_.and_(RDX, R10);
+        as_.cmp(RDX, R10);
+        entryExits_.push(as_.jcc(COND_E));
+      } else if (var.guard == GUARD_DEFINED) {
+        as_.movImm(RCX, UNINITIALIZED);
+        as_.cmp(RAX, RCX);
+        entryExits_.push(as_.jcc(COND_E));
+      }
+      as_.movq(var.reg, RAX);
+    }
+    for (int i = 0; i < callees_.size(); i++) {
+      as_.load(RAX, R9, callees_[i].slot * sizeof(Value));
+      as_.movImm(RCX, callees_[i].closure.ptr());
+      as_.cmp(RAX, RCX);
+      entryExits_.push(as_.jcc(COND_NE));
+    }
+    loop_ = as_.offset();
+  }
+
+  void TraceCompiler::emitStep(const TraceStep& step) {
+    int offset = step.offset;
+    instruction op = chunk_.getCode(offset);
+    switch (op) {
+      case OP_CONSTANT:
+        push(constant(constantOperand(offset + 1)));
+        break;
+      case OP_POP:
+        release(pop());
+        break;
+      case OP_GET_LOCAL:
+        push(local(chunk_.getCode(offset + 1)));
+        break;
+      case OP_GET_LOCALS:
+        push(local(chunk_.getCode(offset + 1)));
+        push(local(chunk_.getCode(offset + 2)));
+        break;
+      case OP_SET_LOCAL:
+      case OP_SET_LOCAL_POP: {
+        int slot = chunk_.getCode(offset + 1);
+        if (slot < stackBase_) {
+          emitStore(variable(false, slot), op == OP_SET_LOCAL_POP);
+        } else {
+          emitStackStore(slot - stackBase_, op == OP_SET_LOCAL_POP);
+        }
+        break;
+      }
+      case OP_GET_GLOBAL: {
+        int slot = shortOperand(offset + 1);
+        const Callee* closure = callee(slot);
+        push(closure ? constant(closure->closure) : number(variable(true, slot)->reg, false));
+        break;
+      }
+      case OP_SET_GLOBAL:
+        emitStore(variable(true, shortOperand(offset + 1)), false);
+        break;
+      case OP_ADD:
+      case OP_ADD_NUM:
+      case OP_ADD_GENERIC:
+        emitArithmetic(&Assembler::addsd);
+        break;
+      case OP_SUBTRACT:
+        emitArithmetic(&Assembler::subsd);
+        break;
+      case OP_MULTIPLY:
+        emitArithmetic(&Assembler::mulsd);
+        break;
+      case OP_DIVIDE:
+        emitArithmetic(&Assembler::divsd);
+        break;
+      case OP_NEGATE:
+        emitNegate();
+        break;
+      case OP_ADD_LOCAL_CONSTANT:
+        push(local(chunk_.getCode(offset + 1)));
+        push(constant(constantOperand(offset + 2)));
+        emitArithmetic(&Assembler::addsd);
+        break;
+      case OP_EQUAL:
+      case OP_EQUAL_NUM:
+      case OP_EQUAL_GENERIC:
+        emitComparison(OP_EQUAL);
+        break;
+      case OP_GREATER:
+      case OP_LESS:
+        emitComparison(op);
+        break;
+      case OP_JUMP:
+        break;
+      case OP_JUMP_IF_FALSE: {
+        Operand comparison = pop();
+        if (comparison.kind != Operand::COMPARISON) {
+          failed_ = true;
+          return;
+        }
+        // Leaving the trace, the condition is still on the stack for the jump's POP, and it is the
+        // opposite of what was recorded: true if the jump was taken.
+        int resume = step.jumped ? offset + 3 : offset + 3 + shortOperand(offset + 1);
+        push(constant(Bool(step.jumped).asValue()));
+        emitGuard(comparison.op, number(comparison.reg, comparison.temp),
+                  number(comparison.other, comparison.otherTemp), step.jumped, resume);
+        release(comparison);
+        stack_[-1] = constant(Bool(!step.jumped).asValue());
+        break;
+      }
+      case OP_LESS_JUMP: {
+        Operand right = pop();
+        Operand left = pop();
+        int resume = step.jumped ? offset + 3 : offset + 3 + shortOperand(offset + 1);
+        emitGuard(OP_LESS, left, right, step.jumped, resume);
+        release(left);
+        release(right);
+        break;
+      }
+      case OP_LOCAL_CONSTANT_LESS_JUMP: {
+        Operand left = local(chunk_.getCode(offset + 1));
+        Operand right = constant(constantOperand(offset + 2));
+        int resume = step.jumped ? offset + 5 : offset + 5 + shortOperand(offset + 3);
+        emitGuard(OP_LESS, left, right, step.jumped, resume);
+        break;
+      }
+      case OP_INLINE_GUARD: {
+        // The recording saw the guard pass, and the callee is a constant checked on entry. The
+        // cached closure is kept alive, so no other object can have its address.
+        int index = stack_.size() - 1 - chunk_.getCode(offset + 1);
+        const InlinedCall& call = chunk_.inlinedCall(chunk_.getCode(offset + 2));
+        if (index < 0 || stack_[index].kind != Operand::CONSTANT || !call.closure ||
+            stack_[index].constant.ptr() != call.closure->asValue().ptr()) {
+          failed_ = true;
+        }
+        break;
+      }
+      case OP_LOOP:
+        if (!stack_.isEmpty()) {
+          failed_ = true;
+          return;
+        }
+        as_.patch(as_.jmp(), loop_);
+        break;
+      default:
+        failed_ = true;
+        break;
+    }
+  }
+
+  void TraceCompiler::emitExits() {
+    for (int i = 0; i < exits_.size(); i++) {
+      const Exit& exit = exits_[i];
+      for (int j = 0; j < exit.jumpCount; j++) as_.patch(exit.jumps[j], as_.offset());
+
+      for (int j = 0; j < exit.operandCount; j++) {
+        const Operand& operand = exitOperands_[exit.operandStart + j];
+        if (operand.kind == Operand::NUMBER) {
+          as_.movq(RAX, operand.reg);
+        } else {
+          as_.movImm(RAX, operand.constant.ptr());
+        }
+        as_.store(RSI, j * sizeof(Value), RAX);
+      }
+      for (int j = 0; j < variables_.size(); j++) {
+        const Variable& var = variables_[j];
+        if (!var.written) continue;
+        as_.movq(RAX, var.reg);
+        as_.store(var.global ? R9 : R8, var.slot * sizeof(Value), RAX);
+      }
+
+      as_.movImm(RCX, (uint64_t)(chunk_.code() + exit.resume));
+      as_.store(RDI, offsetof(CallFrame, ip), RCX);
+      as_.mov(RAX, RSI);
+      if (exit.operandCount > 0) as_.addImm(RAX, exit.operandCount * sizeof(Value));
+      as_.ret();
+    }
+  }
+
+  void TraceCompiler::emitStore(Variable* var, bool pop) {
+    if (stack_.isEmpty() || stack_[-1].kind == Operand::COMPARISON) {
+      failed_ = true;
+      return;
+    }
+    protect(var->reg);
+    Operand value = this->pop();
+    if (value.kind == Operand::NUMBER) {
+      if (value.reg != var->reg) as_.movapd(var->reg, value.reg);
+    } else {
+      emitLoadConstant(var->reg, value.constant);
+    }
+    var->written = true;
+    release(value);
+    if (!pop) push(number(var->reg, false));
+  }
+
+  void TraceCompiler::emitStackStore(int index, bool pop) {
+    // The slot must be below the value stored, which the compiler guarantees for locals.
+    if (index >= stack_.size() - 1 || stack_[-1].kind == Operand::COMPARISON ||
+        stack_[index].kind == Operand::COMPARISON) {
+      failed_ = true;
+      return;
+    }
+    Operand target = stack_[index];
+    Xmm reg;
+    if (target.kind == Operand::NUMBER && target.temp) {
+      // Operands read from the slot share its register.
+      for (int i = index + 1; i < stack_.size(); i++) {
+        Operand& operand = stack_[i];
+        if (operand.kind == Operand::NUMBER && !operand.temp && operand.reg == target.reg) {
+          operand.reg = allocate();
+          operand.temp = true;
+          as_.movapd(operand.reg, target.reg);
+        }
+      }
+      reg = target.reg;
+    } else {
+      reg = allocate();
+    }
+    if (failed_) return;
+
+    Operand value = this->pop();
+    if (value.kind == Operand::NUMBER) {
+      if (value.reg != reg) as_.movapd(reg, value.reg);
+    } else {
+      emitLoadConstant(reg, value.constant);
+    }
+    release(value);
+    stack_[index] = number(reg, true);
+    if (!pop) push(number(reg, false));
+  }
+
+  void TraceCompiler::emitArithmetic(void (Assembler::*op)(Xmm, Xmm)) {
+    Operand right = pop();
+    Operand left = pop();
+    if (left.kind == Operand::COMPARISON || right.kind == Operand::COMPARISON) failed_ = true;
+    if (failed_) return;
+
+    Xmm result = left.reg;
+    if (!(left.kind == Operand::NUMBER && left.temp)) {
+      result = allocate();
+      if (failed_) return;
+      if (left.kind == Operand::NUMBER) {
+        as_.movapd(result, left.reg);
+      } else {
+        emitLoadConstant(result, left.constant);
+      }
+    }
+    (as_.*op)(result, emitLoad(right, XMM0));
+    release(right);
+    push(number(result, true));
+  }
+
+  void TraceCompiler::emitNegate() {
+    Operand operand = pop();
+    if (operand.kind == Operand::COMPARISON) failed_ = true;
+    if (failed_) return;
+
+    Xmm result = operand.reg;
+    if (!(operand.kind == Operand::NUMBER && operand.temp)) {
+      result = allocate();
+      if (failed_) return;
+      if (operand.kind == Operand::NUMBER) {
+        as_.movapd(result, operand.reg);
+      } else {
+        emitLoadConstant(result, operand.constant);
+      }
+    }
+    emitLoadConstant(XMM0, Value(SIGN_BIT));
+    as_.xorpd(result, XMM0);
+    push(number(result, true));
+  }
+
+  void TraceCompiler::emitComparison(instruction op) {
+    Operand right = pop();
+    Operand left = pop();
+    if (left.kind == Operand::COMPARISON || right.kind == Operand::COMPARISON) failed_ = true;
+    if (failed_) return;
+
+    // Both sides go into registers, as the comparison is only emitted by the jump that tests it.
+    Operand* sides[] = {&left, &right};
+    for (Operand* side : sides) {
+      if (side->kind != Operand::CONSTANT) continue;
+      Xmm reg = allocate();
+      if (failed_) return;
+      emitLoadConstant(reg, side->constant);
+      *side = number(reg, true);
+    }
+    push({Operand::COMPARISON, left.reg, left.temp, right.reg, right.temp, op, Value()});
+  }
+
+  void TraceCompiler::emitGuard(instruction op, Operand left, Operand right, bool exitWhen,
+                                int resume) {
+    Exit exit;
+    exit.resume = resume;
+    exit.operandStart = exitOperands_.size();
+    exit.operandCount = stack_.size();
+    for (int i = 0; i < stack_.size(); i++) {
+      if (stack_[i].kind == Operand::COMPARISON) failed_ = true;
+      exitOperands_.push(stack_[i]);
+    }
+    if (failed_) return;
+
+    Xmm a = emitLoad(left, XMM0);
+    Xmm b = emitLoad(right, XMM1);
+    if (op == OP_EQUAL) {
+      // Equal and ordered: ZF set and PF clear.
+      as_.ucomisd(a, b);
+      if (exitWhen) {
+        int unordered = as_.jcc(COND_P);
+        exit.jumps[exit.jumpCount++] = as_.jcc(COND_E);
+        as_.patch(unordered, as_.offset());
+      } else {
+        exit.jumps[exit.jumpCount++] = as_.jcc(COND_P);
+        exit.jumps[exit.jumpCount++] = as_.jcc(COND_NE);
+      }
+    } else {
+      // a < b is b > a; "above" is false for NaN, as the comparison must be.
+      if (op == OP_LESS) {
+        as_.ucomisd(b, a);
+      } else {
+        as_.ucomisd(a, b);
+      }
+      exit.jumps[exit.jumpCount++] = as_.jcc(exitWhen ? COND_A : COND_BE);
+    }
+    exits_.push(exit);
+  }
+
+  void TraceCompiler::emitLoadConstant(Xmm dst, Value value) {
+    as_.movImm(RAX, value.ptr());
+    as_.movq(dst, RAX);
+  }
+
+  Xmm TraceCompiler::emitLoad(const Operand& operand, Xmm scratch) {
+    if (operand.kind == Operand::NUMBER) return operand.reg;
+    emitLoadConstant(scratch, operand.constant);
+    return scratch;
+  }
+
+  void TraceCompiler::protect(Xmm reg) {
+    for (int i = 0; i < stack_.size(); i++) {
+      Operand& operand = stack_[i];
+      if (operand.kind == Operand::CONSTANT) continue;
+      if (operand.reg == reg && !operand.temp) {
+        operand.reg = allocate();
+        operand.temp = true;
+        as_.movapd(operand.reg, reg);
+      }
+      if (operand.kind == Operand::COMPARISON && operand.other == reg && !operand.otherTemp) {
+        operand.other = allocate();
+        operand.otherTemp = true;
+        as_.movapd(operand.other, reg);
+      }
+    }
+  }
+
+  Xmm TraceCompiler::allocate() {
+    for (int reg = XMM2; reg <= XMM15; reg++) {
+      if (freeRegs_ & (1 << reg)) {
+        freeRegs_ &= ~(1 << reg);
+        return (Xmm)reg;
+      }
+    }
+    failed_ = true;
+    return XMM0;
+  }
+
+  void TraceCompiler::release(Xmm reg, bool temp) {
+    if (temp) freeRegs_ |= 1 << reg;
+  }
+
+  void TraceCompiler::release(const Operand& operand) {
+    if (operand.kind == Operand::CONSTANT) return;
+    release(operand.reg, operand.temp);
+    if (operand.kind == Operand::COMPARISON) release(operand.other, operand.otherTemp);
+  }
+
+  bool Tracer::compile(VM& vm, ObjFunction* fn, LoopTrace* trace, const TraceRecorder& recorder) {
+    TraceCompiler compiler(vm, fn, recorder);
+    return compiler.compile(trace);
+  }
+
+  void Tracer::release(LoopTrace* trace) {
+    if (trace->memory) Assembler::uninstall(trace->memory, trace->size);
+    delete trace;
+  }
+
+#else
+
+  bool Tracer::compile(VM& vm, ObjFunction* fn, LoopTrace* trace, const TraceRecorder& recorder) {
+    return false;
+  }
+
+  void Tracer::release(LoopTrace* trace) {
+    delete trace;
+  }
+
+#endif
+
+} // namespace lox
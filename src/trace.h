@@ -0,0 +1,100 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "chunk.h"
+#include "lib/vector.h"
+#include "memory.h"
+#include "value/value.h"
+
+namespace lox {
+
+  class VM;
+  class ObjFunction;
+  struct CallFrame;
+
+  // Native code of a loop trace, entered at the loop header with the frame and its stack top. It
+  // runs iterations until a guard fails, then stores what the interpreter expects at the
+  // instruction the guard protects, sets the frame's ip to it and returns the new stack top.
+  typedef Value* (*TraceFn)(CallFrame* frame, Value* sp);
+
+  // A loop of a function, identified by its header: the code offset its OP_LOOP jumps back to.
+  struct LoopTrace {
+    int header = 0;
+    int hotness = 0; // Back edges since the last recording.
+    int aborts = 0;  // Recordings that didn't end in a trace.
+    TraceFn fn = nullptr;
+    void* memory = nullptr; // Executable mapping that holds the code.
+    size_t size = 0;
+  };
+
+  // One instruction of a recorded trace.
+  struct TraceStep {
+    int offset;
+    bool jumped; // Direction a conditional jump took when it was recorded.
+  };
+
+  // Records one iteration of a hot loop by executing it, starting at the header the frame's ip
+  // points to. Only instructions on numbers, locals, globals and control flow within the loop are
+  // recorded, and only when their operands are numbers, or for the guard of an inlined call, the
+  // closure it expects; anything else stops the recording before it executes, so VM::run can
+  // carry on from there with the frame's ip and stack top as left by record().
+  class TraceRecorder {
+   public:
+    // Longest trace recorded, in instructions.
+    static constexpr int MAX_LENGTH = 512;
+
+    TraceRecorder(VM& vm, CallFrame* frame, Value* sp)
+      : vm_(vm)
+      , frame_(frame)
+      , sp_(sp) {}
+
+    // Returns true if the iteration got back to the header.
+    bool record();
+
+    Value* sp() const {
+      return sp_;
+    }
+
+    // Stack slots of the frame in use at the loop header. Locals above them are declared in the
+    // loop body and live on the stack the trace works on.
+    int stackBase() const {
+      return stackBase_;
+    }
+
+    const Vector<TraceStep, Memory::DefaultReallocator>& steps() const {
+      return steps_;
+    }
+
+   private:
+    bool stop(int offset, Value* sp, bool completed);
+
+   private:
+    VM& vm_;
+    CallFrame* frame_;
+    Value* sp_;
+    int stackBase_ = 0;
+    Vector<TraceStep, Memory::DefaultReallocator> steps_;
+  };
+
+  // Tracing compiler for hot loops. VM::run counts the back edges of every loop; once a loop is hot
+  // a TraceRecorder records the path one iteration takes, and the trace is compiled to x86-64 code
+  // specialized for what was recorded. Locals and globals the loop uses are loaded into SSE
+  // registers when the trace is entered, after guards that they hold numbers, and stay unboxed
+  // there across iterations, as do intermediate results. Each conditional jump becomes a guard
+  // that the direction is the recorded one. When a guard fails the trace boxes its registers back
+  // into the slots and the stack and leaves the rest to VM::run.
+  //
+  // On other architectures nothing is compiled.
+  class Tracer {
+   public:
+    // Recordings of a loop that may fail to produce a trace before the loop is no longer counted.
+    static constexpr int MAX_ABORTS = 3;
+
+    // Compiles what `recorder` recorded into `trace`. Returns false if it can't be compiled.
+    static bool compile(VM& vm, ObjFunction* fn, LoopTrace* trace, const TraceRecorder& recorder);
+
+    static void release(LoopTrace* trace);
+  };
+
+}; // namespace lox
@@ -10,7 +10,9 @@ namespace lox {
    public:
     enum Type { METHOD_CLOSURE, };
 
-    Method() {} // TODO: For Map
+    Method() { // TODO: For Map
+      as_.closure = nullptr;
+    }
 
     Method(ObjClosure* closure)
       : type_(METHOD_CLOSURE) {
@@ -21,6 +23,11 @@ namespace lox {
       return as_.closure;
     }
 
+    // Whether this is a default constructed Method, e.g. an unused dispatch table entry.
+    bool isEmpty() const {
+      return as_.closure == nullptr;
+    }
+
     void trace(std::ostream& os) const;
 
    private:
@@ -1,30 +1,107 @@
 #include "object.h"
 
+#include <algorithm>
+
+#include "../jit.h"
+#include "../trace.h"
 #include "../vm.h"
 
 namespace lox {
 
-#define OBJ_TYPE_APIS(subtype)                    \
-  bool Obj::is##subtype() const {                 \
-    return typeid(*this) == typeid(Obj##subtype); \
-  }                                               \
-                                                  \
-  Obj##subtype* Obj::as##subtype() {              \
-    return static_cast<Obj##subtype*>(this);      \
+  Shape::~Shape() {
+    for (int i = 0; i < transitions_.size(); i++) delete transitions_[i];
+  }
+
+  int Shape::findSlot(ObjString* name) {
+    if (slotCount_ <= LINEAR_SEARCH_MAX) {
+      for (Shape* shape = this; shape->name_; shape = shape->parent_) {
+        if (shape->name_ == name) return shape->slotCount_ - 1;
+      }
+      return -1;
+    }
+
+    if (slots_.size() == 0) {
+      for (Shape* shape = this; shape->name_; shape = shape->parent_) {
+        slots_.put(shape->name_, shape->slotCount_ - 1);
+      }
+    }
+    int slot;
+    return slots_.get(name, &slot) ? slot : -1;
+  }
+
+  Shape* Shape::transition(ObjString* name) {
+    for (int i = 0; i < transitions_.size(); i++) {
+      if (transitions_[i]->name_ == name) return transitions_[i];
+    }
+
+    Shape* shape = new Shape(klass_, this, name);
+    transitions_.push(shape);
+    klass_->gcWriteBarrier(name); // The class marks the names of its shapes.
+    return shape;
+  }
+
+  void Shape::gcBlacken(VM& vm) const {
+    vm.gcMarkObject(name_);
+    for (int i = 0; i < transitions_.size(); i++) transitions_[i]->gcBlacken(vm);
   }
 
-  OBJ_TYPE_APIS(String)
-  OBJ_TYPE_APIS(Function)
-  OBJ_TYPE_APIS(Closure)
-  OBJ_TYPE_APIS(Class)
-  OBJ_TYPE_APIS(Instance)
-  OBJ_TYPE_APIS(BoundMethod)
+  void ObjInstance::addField(Shape* shape, Value value) {
+    ASSERT(shape->slotCount() == shape_->slotCount() + 1, "Shape must add one field.");
 
-#undef OBJ_TYPE_APIS
+    int slot = shape_->slotCount();
+    if (slot == fieldCapacity_) {
+      int capacity = fieldCapacity_ < MIN_FIELD_CAPACITY ? MIN_FIELD_CAPACITY : fieldCapacity_ * 2;
+      Value* fields = Memory::allocate<Value>(capacity);
+      std::copy(fields_, fields_ + slot, fields);
+      if (fields_ != inlineFields_) Memory::reallocate(fields_, sizeof(Value) * fieldCapacity_, 0);
+      fields_ = fields;
+      fieldCapacity_ = capacity;
+    }
+    if (slot < MAX_FIELD_COUNT_HINT && slot + 1 > klass_->fieldCountHint_) {
+      klass_->fieldCountHint_ = slot + 1;
+    }
+    // The slot is written before the instance moves to the new shape, so the GC never sees an
+    // uninitialized field.
+    fields_[slot] = value;
+    shape_ = shape;
+    gcWriteBarrier(value);
+  }
+
+  ObjFunction::~ObjFunction() {
+    if (jitCode_) Jit::release(jitCode_);
+    for (int i = 0; i < loopTraces_.size(); i++) Tracer::release(loopTraces_[i]);
+  }
+
+  LoopTrace* ObjFunction::loopTrace(int header) {
+    for (int i = 0; i < loopTraces_.size(); i++) {
+      if (loopTraces_[i]->header == header) return loopTraces_[i];
+    }
+    LoopTrace* trace = new LoopTrace();
+    trace->header = header;
+    loopTraces_.push(trace);
+    return trace;
+  }
 
   void ObjFunction::gcBlacken(VM& vm) const {
     vm.gcMarkObject(name_);
     for (int i = 0; i < chunk_.constants().size(); i++) vm.gcMarkValue(chunk_.getConstant(i));
+    // Cached shapes must not be freed and their addresses reused while a cache can match them.
+    const Vector<PropertyCache>& caches = chunk_.propertyCaches();
+    for (int i = 0; i < caches.size(); i++) {
+      if (caches[i].shape) vm.gcMarkObject(caches[i].shape->klass());
+    }
+    const Vector<InvokeCache>& invokeCaches = chunk_.invokeCaches();
+    for (int i = 0; i < invokeCaches.size(); i++) {
+      for (int j = 0; j < invokeCaches[i].count(); j++) {
+        vm.gcMarkObject(invokeCaches[i].klass(j));
+        vm.gcMarkObject(invokeCaches[i].method(j));
+      }
+    }
+    const Vector<InlinedCall>& inlinedCalls = chunk_.inlinedCalls();
+    for (int i = 0; i < inlinedCalls.size(); i++) {
+      vm.gcMarkObject(inlinedCalls[i].fn);
+      if (inlinedCalls[i].closure) vm.gcMarkObject(inlinedCalls[i].closure);
+    }
   }
 
   void ObjUpvalue::gcBlacken(VM& vm) const {
@@ -33,7 +110,7 @@ namespace lox {
 
   void ObjClosure::gcBlacken(VM& vm) const {
     vm.gcMarkObject(fn_);
-    for (int i = 0; i < fn_->upvalueCount(); i++) vm.gcMarkObject(upvalues_[i]);
+    for (int i = 0; i < fn_->upvalueCount(); i++) vm.gcMarkValue(upvalues_[i]);
   }
 
   void ObjClass::gcBlacken(VM& vm) const {
@@ -45,17 +122,13 @@ namespace lox {
       vm.gcMarkObject(e->key.value());
       vm.gcMarkObject(e->value.asClosure()); // TODO: Fix according to other method type
     }
+    vm.gcMarkObject(superclass_); // Inherited methods
+    rootShape_->gcBlacken(vm);    // Field names
   }
 
   void ObjInstance::gcBlacken(VM& vm) const {
     vm.gcMarkObject(klass_);
-    for (int i = 0; i < fields_.capacity(); ++i) {
-      Map<StringKey, Value>::Entry* e = fields_.getEntry(i);
-      if (e->isEmpty()) continue;
-
-      vm.gcMarkObject(e->key.value());
-      vm.gcMarkValue(e->value);
-    }
+    for (int i = 0; i < shape_->slotCount(); i++) vm.gcMarkValue(fields_[i]);
   }
 
   void ObjBoundMethod::gcBlacken(VM& vm) const {
@@ -63,4 +136,8 @@ namespace lox {
     vm.gcMarkObject(method_.asClosure()); // TODO: Fix according to other method type
   }
 
+  void ObjNative::gcBlacken(VM& vm) const {
+    vm.gcMarkObject(name_);
+  }
+
 } // namespace lox
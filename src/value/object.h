@@ -12,33 +12,76 @@
 
 namespace lox {
 
+  struct JitCode;
+  struct LoopTrace;
+
+  // Concrete class of an object, so type checks on the hot paths compare a field instead of calling
+  // typeid.
+  enum class ObjType : uint8_t {
+    String,
+    Function,
+    Upvalue,
+    Closure,
+    Class,
+    Instance,
+    BoundMethod,
+    Native,
+  };
+
   class Obj {
     friend class VM;
+    friend class ParallelMarker;
 
    public:
+    explicit Obj(ObjType type)
+      : type_(type) {}
+
     virtual ~Obj() {}
 
     void* operator new(size_t s) {
       return Memory::allocate(s);
     }
 
+    void operator delete(void* p, size_t size) {
+      Memory::deallocate(p, size);
+    }
+
     Value asValue() const {
       return (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(this));
     }
 
     virtual void trace(std::ostream& os) const = 0;
 
+    // Bytes allocated for the object itself, which is what freeing it gives back.
+    virtual size_t allocationSize() const = 0;
+
     virtual bool eq(Obj* other) const {
       // Default identity logic.
       return this == other;
     }
 
-    bool isGCMarked() const {
-      return isGCMarked_;
+    // Whether the object is marked in a heap whose epoch is `epoch` (see Memory::epoch).
+    bool isGCMarked(uint8_t epoch) const {
+      return gcMark_ == epoch;
+    }
+
+    // Write barrier, called after `value` is stored in this object. It only does something when a
+    // marked object gets a reference to an unmarked one (see Memory::writeBarrier).
+    void gcWriteBarrier(Value value) {
+      if (value.isObj()) gcWriteBarrier(value.asObj());
+    }
+    void gcWriteBarrier(Obj* value) {
+      if (isGCRemembered_ || !value) return;
+      Memory* heap = Memory::current();
+      if (heap && isGCMarked(heap->epoch()) && !value->isGCMarked(heap->epoch())) {
+        heap->writeBarrier(this, value);
+      }
     }
 
-#define OBJ_TYPE_APIS(subtype) \
-  bool is##subtype() const;    \
+#define OBJ_TYPE_APIS(subtype)        \
+  bool is##subtype() const {          \
+    return type_ == ObjType::subtype; \
+  }                                   \
   Obj##subtype* as##subtype();
 
     OBJ_TYPE_APIS(String)
@@ -47,6 +90,7 @@ namespace lox {
     OBJ_TYPE_APIS(Class)
     OBJ_TYPE_APIS(Instance)
     OBJ_TYPE_APIS(BoundMethod)
+    OBJ_TYPE_APIS(Native)
 
 #undef OBJ_TYPE_APIS
 
@@ -56,7 +100,9 @@ namespace lox {
     }
 
    private:
-    bool isGCMarked_ = false;
+    ObjType type_;
+    uint8_t gcMark_ = 0;
+    bool isGCRemembered_ = false;
     Obj* next_ = nullptr;
   };
 
@@ -73,6 +119,10 @@ namespace lox {
       os << value_;
     }
 
+    virtual size_t allocationSize() const {
+      return sizeof(ObjString) + sizeof(char) * length_;
+    }
+
     virtual bool eq(Obj* other) const {
       if (!other->isString()) return false;
 
@@ -96,6 +146,12 @@ namespace lox {
       return value_;
     }
 
+    // Index of the string's entry in class dispatch tables when it names a method, or -1. Strings
+    // are interned, so each method name gets a single selector (see VM::methodSelector).
+    int selector() const {
+      return selector_;
+    }
+
     // https://en.wikipedia.org/wiki/Fowler%E2%80%93Noll%E2%80%93Vo_hash_function#FNV_hash_parameters
     static uint32_t calcHash(const char* chars, int length) {
       uint32_t hash = 2166136261u;
@@ -151,7 +207,8 @@ namespace lox {
     }
 
     ObjString(const char* src, int length)
-      : hash_(calcHash(src, length))
+      : Obj(ObjType::String)
+      , hash_(calcHash(src, length))
       , length_(length) {
       // Set value (TODO: Comparison with strncpy)
       std::memcpy(value_, src, length_);
@@ -165,6 +222,7 @@ namespace lox {
    public:
     uint32_t hash_;
     int length_;
+    int selector_ = -1;
     char value_[FLEXIBLE_ARRAY];
   };
 
@@ -179,8 +237,11 @@ namespace lox {
 
   class ObjFunction : public Obj {
     friend class VM;
+    friend class Jit;
 
    public:
+    ~ObjFunction();
+
     virtual void trace(std::ostream& os) const {
       if (name_)
         os << "<fn " << *name_ << ">";
@@ -188,6 +249,10 @@ namespace lox {
         os << "<script>";
     }
 
+    virtual size_t allocationSize() const {
+      return sizeof(ObjFunction);
+    }
+
     int getAndIncrementUpvalue() {
       return upvalueCount_++;
     }
@@ -200,6 +265,13 @@ namespace lox {
       return arity_;
     }
 
+    // Argument count the stack interpreter accepts without going through VM::call: the arity for
+    // stack bytecode and -1 for register code, so a single comparison rules out both a wrong
+    // argument count and code the stack tier can't run.
+    int stackCallArity() const {
+      return registerCount_ > 0 ? -1 : arity_;
+    }
+
     int upvalueCount() const {
       return upvalueCount_;
     }
@@ -212,13 +284,55 @@ namespace lox {
       return name_;
     }
 
+    // Number of frame registers used by code from the RegisterCompiler; 0 for stack bytecode.
+    int registerCount() const {
+      return registerCount_;
+    }
+
+    void setRegisterCount(int registerCount) {
+      registerCount_ = registerCount;
+    }
+
+    bool isRegisterCode() const {
+      return registerCount_ > 0;
+    }
+
+    // Number of value stack slots a call frame of the function may use, counting from its callee
+    // slot. The VM grows the stack by this much before entering the function.
+    int stackSize() const {
+      return stackSize_;
+    }
+
+    void setStackSize(int stackSize) {
+      stackSize_ = stackSize;
+    }
+
+    // Whether a closure captures one of the function's locals by reference. Only then do its
+    // returns have upvalues to close.
+    bool hasCapturedLocals() const {
+      return hasCapturedLocals_;
+    }
+
+    void setHasCapturedLocals() {
+      hasCapturedLocals_ = true;
+    }
+
+    // Native code from the Jit, or null while the function is interpreted.
+    JitCode* jitCode() const {
+      return jitCode_;
+    }
+
+    // The Tracer's record of the loop whose header is at code offset `header`, added on first use.
+    LoopTrace* loopTrace(int header);
+
    private:
     static ObjFunction* allocate(FunctionType type, int arity, ObjString* name) {
       return new ObjFunction(type, arity, name);
     }
 
     ObjFunction(FunctionType type, int arity, ObjString* name)
-      : type_(type)
+      : Obj(ObjType::Function)
+      , type_(type)
       , arity_(arity)
       , name_(name) {}
 
@@ -228,8 +342,16 @@ namespace lox {
     FunctionType type_;
     int arity_;
     int upvalueCount_ = 0;
+    int registerCount_ = 0;
+    int stackSize_ = 0;
+    bool hasCapturedLocals_ = false;
     Chunk chunk_;
     ObjString* name_; // Name can be null for script instance, otherwise it is function's name;
+
+    JitCode* jitCode_ = nullptr;
+    int hotness_ = 0;        // Calls, returns into and loop iterations counted for the Jit.
+    bool jitFailed_ = false; // The Jit can't compile the function, so it's no longer counted.
+    Vector<LoopTrace*, Memory::DefaultReallocator> loopTraces_;
   };
 
   class ObjUpvalue : public Obj {
@@ -240,21 +362,28 @@ namespace lox {
       os << "upvalue"; // TODO
     }
 
+    virtual size_t allocationSize() const {
+      return sizeof(ObjUpvalue);
+    }
+
     void doClose() {
       closed_ = *location_;
       location_ = &closed_;
+      gcWriteBarrier(closed_);
     }
 
     Value* location() const {
       return location_;
     }
 
-    Value closed() const {
-      return closed_;
+    void set(Value value) {
+      *location_ = value;
+      // While open the value lives on the stack, which is a root.
+      if (location_ == &closed_) gcWriteBarrier(value);
     }
 
-    ObjUpvalue* next() const {
-      return next_;
+    Value closed() const {
+      return closed_;
     }
 
    private:
@@ -263,14 +392,14 @@ namespace lox {
     }
 
     ObjUpvalue(Value* location)
-      : location_(location) {}
+      : Obj(ObjType::Upvalue)
+      , location_(location) {}
 
     void gcBlacken(VM& vm) const;
 
    private:
     Value* location_;
     Value closed_ = Nil().asValue();
-    ObjUpvalue* next_ = nullptr;
   };
 
   class ObjClosure : public Obj {
@@ -281,67 +410,190 @@ namespace lox {
       os << *fn_;
     }
 
+    virtual size_t allocationSize() const {
+      return sizeof(ObjClosure) + sizeof(Value) * upvalueCount_;
+    }
+
     ObjFunction* fn() const {
       return fn_;
     }
 
-    ObjUpvalue** upvalues() {
+    // An upvalue is either an ObjUpvalue, for a variable captured by reference, or the value of a
+    // variable that is never reassigned (see CaptureKind).
+    Value* upvalues() {
       return upvalues_;
     }
 
+    ObjUpvalue* upvalue(int index) const {
+      return static_cast<ObjUpvalue*>(upvalues_[index].asObj());
+    }
+
+    void setUpvalue(int index, Value value) {
+      upvalues_[index] = value;
+      gcWriteBarrier(value);
+    }
+
    private:
     static ObjClosure* allocate(ObjFunction* fn) {
-      void* mem = Memory::allocate(sizeof(ObjClosure) + sizeof(ObjUpvalue) * fn->upvalueCount());
+      void* mem = Memory::allocate(sizeof(ObjClosure) + sizeof(Value) * fn->upvalueCount());
       return ::new (mem) ObjClosure(fn);
     }
 
     ObjClosure(ObjFunction* fn)
-      : fn_(fn) {
-      for (int i = 0; i < fn->upvalueCount(); i++) upvalues_[i] = nullptr;
+      : Obj(ObjType::Closure)
+      , fn_(fn)
+      , upvalueCount_(fn->upvalueCount()) {
+      for (int i = 0; i < fn->upvalueCount(); i++) upvalues_[i] = Nil().asValue();
     }
 
     void gcBlacken(VM& vm) const;
 
    private:
     ObjFunction* fn_;
-    ObjUpvalue* upvalues_[FLEXIBLE_ARRAY];
+    // Kept apart from fn_, which may be freed first when both are garbage.
+    int upvalueCount_;
+    Value upvalues_[FLEXIBLE_ARRAY];
+  };
+
+  // Layout of an instance's fields: the slot of ObjInstance's field array each field lives in.
+  // Shapes form a transition tree rooted at their class. Adding a field moves an instance to the
+  // child shape for that name, so instances whose fields were added in the same order share a shape
+  // and the VM's inline caches can key on it.
+  class Shape {
+   public:
+    Shape(ObjClass* klass)
+      : Shape(klass, nullptr, nullptr) {}
+
+    ~Shape();
+
+    void* operator new(size_t s) {
+      return Memory::allocate(s);
+    }
+
+    void operator delete(void* p, size_t size) {
+      Memory::deallocate(p, size);
+    }
+
+    ObjClass* klass() const {
+      return klass_;
+    }
+
+    // Number of fields, which are in slots [0, slotCount).
+    int slotCount() const {
+      return slotCount_;
+    }
+
+    // Returns the slot of the field `name`, or -1.
+    int findSlot(ObjString* name);
+
+    // Returns the shape reached by adding the field `name`, which must not be present yet.
+    Shape* transition(ObjString* name);
+
+    void gcBlacken(VM& vm) const;
+
+   private:
+    Shape(ObjClass* klass, Shape* parent, ObjString* name)
+      : klass_(klass)
+      , parent_(parent)
+      , name_(name)
+      , slotCount_(parent ? parent->slotCount_ + 1 : 0) {}
+
+    // Shapes with more fields than this index them in slots_ instead of searching their ancestors.
+    static constexpr int LINEAR_SEARCH_MAX = 8;
+
+    ObjClass* klass_;
+    Shape* parent_;
+    ObjString* name_; // Field added by this shape, in slot slotCount_ - 1; null for the root.
+    int slotCount_;
+    Vector<Shape*> transitions_;
+    Map<StringKey, int> slots_; // Built on first lookup.
   };
 
   typedef Map<StringKey, Method> MethodTable;
 
   class ObjClass : public Obj {
     friend class VM;
+    friend class ObjInstance; // Updates fieldCountHint_.
 
    public:
     virtual void trace(std::ostream& os) const {
       os << *name_;
     }
 
+    virtual size_t allocationSize() const {
+      return sizeof(ObjClass);
+    }
+
     ObjString* name() const {
       return name_;
     }
 
+    // Methods defined in the class body. Inherited ones are only in the dispatch table.
     MethodTable& methods() {
       return methods_;
     }
 
+    ObjClass* superclass() const {
+      return superclass_;
+    }
+
+    // Looks `name` up in the dispatch table, which holds both the class's own and its inherited
+    // methods once VM::finalizeClass has built it.
+    bool findMethod(ObjString* name, Method* method) const {
+      int selector = name->selector();
+      if (selector < 0 || selector >= vtableSize_) return false;
+      *method = vtable_[selector];
+      return !method->isEmpty();
+    }
+
+    // Shape of the class's instances before any field is set.
+    Shape* rootShape() const {
+      return rootShape_;
+    }
+
+    // The `init` method, or null. Kept in sync with methods() by VM::methodsChanged.
+    ObjClosure* initializer() const {
+      return initializer_;
+    }
+
+    // Most fields an instance has been seen with, so new instances can be allocated with room for
+    // them.
+    int fieldCountHint() const {
+      return fieldCountHint_;
+    }
+
    private:
     static ObjClass* allocate(ObjString* name) {
       return new ObjClass(name);
     }
 
     ObjClass(ObjString* name)
-      : name_(name) {}
+      : Obj(ObjType::Class)
+      , name_(name)
+      , rootShape_(new Shape(this)) {}
+
+    ~ObjClass() {
+      delete rootShape_;
+      if (ownsVtable_) Memory::reallocate(vtable_, sizeof(Method) * vtableSize_, 0);
+    }
 
     void gcBlacken(VM& vm) const;
 
    private:
     ObjString* name_;
     MethodTable methods_;
+    ObjClass* superclass_ = nullptr;
+    // Methods indexed by selector. A class that defines no methods of its own shares the table of
+    // its superclass, which it keeps alive.
+    Method* vtable_ = nullptr;
+    int vtableSize_ = 0;
+    bool ownsVtable_ = false;
+    Shape* rootShape_;
+    ObjClosure* initializer_ = nullptr;
+    int fieldCountHint_ = 0;
+    bool isInvokeCached_ = false; // Whether an invoke cache has held one of its methods.
   };
 
-  typedef Map<StringKey, Value> FieldTable;
-
   class ObjInstance : public Obj {
     friend class VM;
 
@@ -350,27 +602,82 @@ namespace lox {
       os << *klass_->name() << " instance";
     }
 
+    virtual size_t allocationSize() const {
+      return sizeof(ObjInstance) + sizeof(Value) * inlineCapacity_;
+    }
+
     ObjClass* klass() const {
       return klass_;
     }
 
-    FieldTable& fields() {
-      return fields_;
+    Shape* shape() const {
+      return shape_;
+    }
+
+    bool getField(ObjString* name, Value* value) const {
+      int slot = shape_->findSlot(name);
+      if (slot == -1) return false;
+
+      *value = fields_[slot];
+      return true;
+    }
+
+    void setField(ObjString* name, Value value) {
+      int slot = shape_->findSlot(name);
+      if (slot != -1) {
+        setField(slot, value);
+      } else {
+        addField(shape_->transition(name), value);
+      }
+    }
+
+    // Slot access for callers that have already checked the instance's shape.
+    Value field(int slot) const {
+      return fields_[slot];
+    }
+
+    void setField(int slot, Value value) {
+      fields_[slot] = value;
+      gcWriteBarrier(value);
     }
 
+    // Moves to `shape`, a transition of the current shape, storing `value` in the new slot.
+    void addField(Shape* shape, Value value);
+
    private:
+    // The fields the class's instances are expected to get are allocated along with the instance.
+    // Fields beyond them move to a separate array.
     static ObjInstance* allocate(ObjClass* klass) {
-      return new ObjInstance(klass);
+      int capacity = klass->fieldCountHint();
+      void* mem = Memory::allocate(sizeof(ObjInstance) + sizeof(Value) * capacity);
+      return ::new (mem) ObjInstance(klass, capacity);
     }
 
-    ObjInstance(ObjClass* klass)
-      : klass_(klass) {}
+    ObjInstance(ObjClass* klass, int capacity)
+      : Obj(ObjType::Instance)
+      , klass_(klass)
+      , shape_(klass->rootShape())
+      , fields_(inlineFields_)
+      , fieldCapacity_(capacity)
+      , inlineCapacity_(capacity) {}
+
+    ~ObjInstance() {
+      if (fields_ != inlineFields_) Memory::reallocate(fields_, sizeof(Value) * fieldCapacity_, 0);
+    }
 
     void gcBlacken(VM& vm) const;
 
    private:
+    static constexpr int MIN_FIELD_CAPACITY = 4;
+    // Limits the inline fields of new instances, in case a few instances get many fields.
+    static constexpr int MAX_FIELD_COUNT_HINT = 32;
+
     ObjClass* klass_;
-    FieldTable fields_;
+    Shape* shape_;
+    Value* fields_;
+    int fieldCapacity_;
+    int inlineCapacity_;
+    Value inlineFields_[FLEXIBLE_ARRAY];
   };
 
   class ObjBoundMethod : public Obj {
@@ -381,6 +688,10 @@ namespace lox {
       method_.trace(os);
     }
 
+    virtual size_t allocationSize() const {
+      return sizeof(ObjBoundMethod);
+    }
+
     Value receiver() const {
       return receiver_;
     }
@@ -395,7 +706,8 @@ namespace lox {
     }
 
     ObjBoundMethod(Value receiver, Method method)
-      : receiver_(receiver)
+      : Obj(ObjType::BoundMethod)
+      , receiver_(receiver)
       , method_(method) {}
 
     void gcBlacken(VM& vm) const;
@@ -405,4 +717,78 @@ namespace lox {
     Method method_;
   };
 
+  class VM;
+
+  // A function implemented in C++. It is called directly on the caller's stack window: `args`
+  // points at the argCount arguments, which stay on the stack (and so reachable by the GC) during
+  // the call, and no call frame is pushed. It returns false after reporting a runtime error with
+  // VM::runtimeError; otherwise it stores its return value in `result`.
+  typedef bool (*NativeFn)(VM& vm, Value* args, int argCount, Value* result);
+
+  class ObjNative : public Obj {
+    friend class VM;
+
+   public:
+    virtual void trace(std::ostream& os) const {
+      os << "<native fn>";
+    }
+
+    virtual size_t allocationSize() const {
+      return sizeof(ObjNative);
+    }
+
+    NativeFn fn() const {
+      return fn_;
+    }
+
+    int arity() const {
+      return arity_;
+    }
+
+    ObjString* name() const {
+      return name_;
+    }
+
+   private:
+    static ObjNative* allocate(ObjString* name, NativeFn fn, int arity) {
+      return new ObjNative(name, fn, arity);
+    }
+
+    ObjNative(ObjString* name, NativeFn fn, int arity)
+      : Obj(ObjType::Native)
+      , name_(name)
+      , fn_(fn)
+      , arity_(arity) {}
+
+    void gcBlacken(VM& vm) const;
+
+   private:
+    ObjString* name_;
+    NativeFn fn_;
+    int arity_;
+  };
+
+#define OBJ_TYPE_APIS(subtype)                    \
+  inline Obj##subtype* Obj::as##subtype() {       \
+    return static_cast<Obj##subtype*>(this);      \
+  }                                               \
+                                                  \
+  inline bool Value::is##subtype() const {        \
+    return isObj() && asObj()->is##subtype();     \
+  }                                               \
+                                                  \
+  inline Obj##subtype* Value::as##subtype() const { \
+    return asObj()->as##subtype();                \
+  }
+
+  OBJ_TYPE_APIS(String)
+  OBJ_TYPE_APIS(Function)
+  OBJ_TYPE_APIS(Closure)
+  OBJ_TYPE_APIS(Class)
+  OBJ_TYPE_APIS(Instance)
+  OBJ_TYPE_APIS(BoundMethod)
+  OBJ_TYPE_APIS(Native)
+
+#undef OBJ_TYPE_APIS
+
 } // namespace lox
@@ -32,6 +32,7 @@ namespace lox {
   class ObjClass;
   class ObjInstance;
   class ObjBoundMethod;
+  class ObjNative;
 
   // TODO: The whole Value abstraction could be better desined.
   class Value {
@@ -50,9 +51,15 @@ namespace lox {
 
     bool isNil() const;
 
+    // The default Value. Never produced by a Lox expression; marks undefined global slots.
+    bool isUninitialized() const {
+      return ptr_ == UNINITIALIZED;
+    }
+
     bool isObj() const;
     Obj* asObj() const;
 
+    // Defined inline in object.h, next to the object types.
 #define OBJ_TYPE_APIS(subtype) \
   bool is##subtype() const;    \
   Obj##subtype* as##subtype() const;
@@ -63,6 +70,7 @@ namespace lox {
     OBJ_TYPE_APIS(Class)
     OBJ_TYPE_APIS(Instance)
     OBJ_TYPE_APIS(BoundMethod)
+    OBJ_TYPE_APIS(Native)
 
 #undef OBJ_TYPE_APIS
 
@@ -200,4 +208,38 @@ namespace lox {
       os << "nil";
     }
   };
+
+  // Tag checks are inline: the interpreter loops run them on nearly every instruction.
+  inline bool Value::isNumber() const {
+    return (ptr_ & QNAN) != QNAN;
+  }
+
+  inline Number Value::asNumber() const {
+    return Number(*this);
+  }
+
+  inline bool Value::isBool() const {
+    return ptr_ == TRUE_VAL || ptr_ == FALSE_VAL;
+  }
+
+  inline Bool Value::asBool() const {
+    return Bool(*this);
+  }
+
+  inline bool Value::isNil() const {
+    return ptr_ == NIL_VAL;
+  }
+
+  inline bool Value::isObj() const {
+    return (ptr_ & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT);
+  }
+
+  inline Obj* Value::asObj() const {
+    return ((Obj*)(uintptr_t)((ptr_) & ~(SIGN_BIT | QNAN)));
+  }
+
+  // TODO: operator?
+  inline bool Value::isFalsey() const {
+    return isNil() || (isBool() && !asBool().value());
+  }
 } // namespace lox
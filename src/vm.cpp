@@ -2,35 +2,60 @@
 
 #include <stdarg.h>
 
+#include <algorithm>
+#include <atomic>
+#include <climits>
 #include <iostream>
 
 #include "chunk.h"
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
+#include "trace.h"
 #include "memory.h"
 #include "op_code.h"
+#include "parallel_marker.h"
 #include "value/object.h"
 #include "value/value.h"
 
 namespace lox {
 
-  VM::VM(std::ostream& out)
-    : out_(out) {
-    Memory::initialize(this);
+  VM::VM(std::ostream& out, const VMConfig& config)
+    : memory_(this)
+    , out_(out)
+    , config_(config) {
+    memory_.initialize();
+    growFrames();
+    growStack(INITIAL_STACK);
     initString_ = allocateObj<ObjString>("init", 4);
+    defineNatives();
   }
 
   VM::~VM() {
+    // The members freed after this go to the heap as well, which goes away last.
+    memory_.makeCurrent();
+    delete gcMarker_;
     freeObjects();
+    Memory::DefaultReallocator::reallocate(frames_, sizeof(CallFrame) * frameCapacity_, 0);
+    Memory::DefaultReallocator::reallocate(stack_, sizeof(Value) * (stackEnd_ - stack_), 0);
+    Memory::DefaultReallocator::reallocate(openUpvalues_,
+                                           sizeof(ObjUpvalue*) * (stackEnd_ - stack_), 0);
   }
 
   ObjFunction* VM::compileSource(const char* source) {
+    if (config_.registerTier) {
+      RegisterCompiler compiler(*this, source);
+      ObjFunction* function = compiler.compile();
+      if (function || !compiler.fallback()) return function;
+    }
+
     Compiler compiler(*this, nullptr, source);
     return compiler.compile();
   }
 
   InterpretResult VM::interpret(const char* source) {
+    memory_.makeCurrent();
     ObjFunction* function = compileSource(source);
     if (!function) return INTERPRET_COMPILE_ERROR;
 
@@ -38,17 +63,50 @@ namespace lox {
     ObjClosure* closure = allocateObj<ObjClosure>(function);
     popRoot();
 
+    int frameCount = frameCount_;
     push(closure->asValue());
-    callValue(closure->asValue(), 0);
-    return run();
+    appendCallFrame(closure, stackTop_ - 1);
+    int base = stackTop_ - 1 - stack_; // The stack may move while the script runs.
+    InterpretResult result = function->isRegisterCode() ? runRegisters() : run();
+    if (result == INTERPRET_RUNTIME_ERROR) {
+      // Drop the frames the error left, which may span both tiers, so later scripts start clean.
+      closeUpvalues(stack_ + base, stackTop_);
+      stackTop_ = stack_ + base;
+      frameCount_ = frameCount;
+    }
+    return result;
+  }
+
+  int VM::globalSlot(ObjString* name) {
+    int slot;
+    if (globalSlots_.get(name, &slot)) return slot;
+
+    pushRoot(name);
+    slot = globals_.size();
+    globals_.push(Value()); // Undefined until OP_DEFINE_GLOBAL runs.
+    globalNames_.push(name);
+    globalSlots_.put(name, slot);
+    popRoot();
+    return slot;
+  }
+
+  void VM::defineNative(const char* name, NativeFn fn, int arity) {
+    ObjString* string = allocateObj<ObjString>(name, (int)strlen(name));
+    pushRoot(string);
+    Value native = allocateObj<ObjNative>(string, fn, arity)->asValue();
+    pushRoot(native);
+    globals_[globalSlot(string)] = native;
+    popRoot();
+    popRoot();
   }
 
   void VM::freeObjects() {
-    Obj* obj = objects_;
-    while (obj) {
-      Obj* next = obj->next_;
-      freeObject(obj);
-      obj = next;
+    for (Obj* obj : {objects_, youngObjects_, unswept_, unsweptYoung_}) {
+      while (obj) {
+        Obj* next = obj->next_;
+        freeObject(obj);
+        obj = next;
+      }
     }
   }
 
@@ -56,13 +114,16 @@ namespace lox {
 #ifdef DEBUG_LOG_GC
     std::cout << "free " << *obj << " @ " << obj << std::endl;
 #endif
+    size_t size = obj->allocationSize();
     obj->~Obj(); // TODO: Calling destructor is lame
-    Memory::deallocate(obj);
+    Memory::deallocate(obj, size);
   }
 
   void VM::appendObj(Obj* obj) {
-    obj->next_ = objects_;
-    objects_ = obj;
+    obj->next_ = youngObjects_;
+    youngObjects_ = obj;
+    // Traced later in the cycle, for what its constructor stored in it.
+    if (memory_.isMarking()) gcMarkObject(obj);
   }
 
   ObjString* VM::findOrAllocateString(const char* src, int length) {
@@ -79,310 +140,702 @@ namespace lox {
     return obj;
   }
 
-  void VM::appendCallFrame(ObjClosure* closure, int stackStart) {
-    frames_[frameCount_++] = CallFrame(closure, stackStart);
+  void VM::appendCallFrame(ObjClosure* closure, Value* slots) {
+    if (frameCount_ == frameCapacity_) growFrames();
+
+    int needed = slots - stack_ + closure->fn()->stackSize() + FRAME_STACK_RESERVE;
+    if (needed > stackEnd_ - stack_) {
+      int offset = slots - stack_;
+      growStack(needed);
+      slots = stack_ + offset;
+    }
+    frames_[frameCount_++] = CallFrame(closure, slots);
+  }
+
+  void VM::growFrames() {
+    int capacity = frameCapacity_ == 0 ? INITIAL_FRAMES : frameCapacity_ * 2;
+    // Frames hold no pointers into themselves, so they can be moved as they are.
+    frames_ = static_cast<CallFrame*>(Memory::DefaultReallocator::reallocate(
+      frames_, sizeof(CallFrame) * frameCapacity_, sizeof(CallFrame) * capacity));
+    frameCapacity_ = capacity;
+  }
+
+  void VM::growStack(int capacity) {
+    int oldCapacity = stackEnd_ - stack_;
+    int newCapacity = oldCapacity == 0 ? INITIAL_STACK : oldCapacity;
+    while (newCapacity < capacity) newCapacity *= 2;
+    if (newCapacity == oldCapacity) return;
+
+    // The stack isn't managed by the GC, so it uses the bare allocator.
+    Value* oldStack = stack_;
+    Value* newStack = static_cast<Value*>(
+      Memory::DefaultReallocator::reallocate(nullptr, 0, sizeof(Value) * newCapacity));
+    std::copy(oldStack, stackTop_, newStack);
+    openUpvalues_ = static_cast<ObjUpvalue**>(Memory::DefaultReallocator::reallocate(
+      openUpvalues_, sizeof(ObjUpvalue*) * oldCapacity, sizeof(ObjUpvalue*) * newCapacity));
+    std::fill(openUpvalues_ + oldCapacity, openUpvalues_ + newCapacity, nullptr);
+
+    for (int i = 0; i < frameCount_; i++) {
+      frames_[i].slots = newStack + (frames_[i].slots - oldStack);
+    }
+    if (openUpvalueCount_ > 0) {
+      for (int i = 0; i < stackTop_ - oldStack; i++) {
+        if (openUpvalues_[i]) openUpvalues_[i]->location_ = newStack + i;
+      }
+    }
+    stackTop_ = newStack + (stackTop_ - oldStack);
+    stack_ = newStack;
+    stackEnd_ = newStack + newCapacity;
+
+    Memory::DefaultReallocator::reallocate(oldStack, sizeof(Value) * oldCapacity, 0);
   }
 
   InterpretResult VM::run() {
-    instruction inst;
-    while (true) {
+    // The hot interpreter state lives in locals so the compiler can keep it in registers. It is
+    // written back to the current CallFrame and stackTop_ (STORE_FRAME) before anything that may
+    // inspect it: calls, returns, allocations (GC safepoints) and runtime errors.
+    CallFrame* frame;
+    const instruction* ip;
+    Value* slots;
+    Value* sp;
+
+#define STORE_FRAME() \
+  do {                \
+    frame->ip = ip;   \
+    stackTop_ = sp;   \
+  } while (false)
+
+#define LOAD_FRAME()                   \
+  do {                                 \
+    frame = &frames_[frameCount_ - 1]; \
+    ip = frame->ip;                    \
+    slots = frame->slots;              \
+    sp = stackTop_;                    \
+  } while (false)
+
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)(ip[-2] << 8 | ip[-1]))
+#define READ_CONSTANT() (frame->closure->fn()->chunk().getConstant(READ_BYTE()))
+#define READ_STRING() (READ_CONSTANT().asString())
+
+#define PUSH(value) (*sp++ = (value))
+#define POP() (*--sp)
+#define DROP() (--sp)
+#define PEEK(offset) (sp[-1 - (offset)])
+
+// Replaces the opcode of the instruction being executed; `length` is its operand count plus one.
+#define REWRITE_OPCODE(length, op)                                                          \
+  do {                                                                                      \
+    Chunk& chunk = frame->closure->fn()->chunk();                                           \
+    chunk.rewrite((int)(ip - (length) - chunk.code()), (op));                               \
+  } while (false)
+
+#define RUNTIME_ERROR(...)          \
+  do {                              \
+    STORE_FRAME();                  \
+    runtimeError(__VA_ARGS__);      \
+    return INTERPRET_RUNTIME_ERROR; \
+  } while (false)
+
+// Runs one of the instruction helpers shared with the Jit (see VM::getGlobal).
+#define RUN_HELPER(call)                    \
+  do {                                      \
+    frame->ip = ip;                         \
+    sp = (call);                            \
+    if (!sp) return INTERPRET_RUNTIME_ERROR; \
+  } while (false)
+
 #ifdef DEBUG_TRACE_EXECUTION
-      traceStack();
-      Disassembler::disassembleInstruction(currentChunk(), currentFrame().ip);
+#define TRACE_INSTRUCTION()                                                \
+  do {                                                                     \
+    STORE_FRAME();                                                         \
+    traceStack();                                                          \
+    const Chunk& chunk = frame->closure->fn()->chunk();                    \
+    Disassembler::disassembleInstruction(chunk, (int)(ip - chunk.code())); \
+  } while (false)
+#else
+#define TRACE_INSTRUCTION() \
+  do {                      \
+  } while (false)
 #endif
 
-#define BINARY_OP(op)                                 \
-  do {                                                \
-    if (!peek(0).isNumber() || !peek(1).isNumber()) { \
-      runtimeError("Operands must be numbers.");      \
-      return INTERPRET_RUNTIME_ERROR;                 \
-    }                                                 \
-    Number b = pop().asNumber();                      \
-    Number a = pop().asNumber();                      \
-    push((op).asValue());                             \
+#ifdef PROFILE_OPCODES
+#define PROFILE_INSTRUCTION() profileInstruction(frame->closure->fn(), ip)
+#define PROFILE_CACHE(stats, hit) ((hit) ? (stats).hits++ : (stats).misses++)
+#else
+#define PROFILE_INSTRUCTION() \
+  do {                        \
   } while (false)
+#define PROFILE_CACHE(stats, hit) \
+  do {                            \
+  } while (false)
+#endif
 
-      switch (inst = readByte()) {
-        case OP_POP: pop(); break;
+#ifdef COMPUTED_GOTO
+    // Direct threading: every handler jumps straight to the next handler through this table, so
+    // each opcode gets its own (and better predicted) indirect branch.
+    static void* dispatchTable[] = {
+#define OPCODE_LABEL(op) &&L_##op,
+      OPCODES(OPCODE_LABEL)
+#undef OPCODE_LABEL
+    };
+
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(op) L_##op:
+#define DISPATCH()                    \
+  do {                                \
+    TRACE_INSTRUCTION();              \
+    PROFILE_INSTRUCTION();            \
+    goto* dispatchTable[READ_BYTE()]; \
+  } while (false)
+#else
+#define INTERPRET_LOOP   \
+  loop:                  \
+  TRACE_INSTRUCTION();   \
+  PROFILE_INSTRUCTION(); \
+  switch (READ_BYTE())
+#define CASE(op) case op:
+#define DISPATCH() goto loop
+#endif
 
-        case OP_GET_LOCAL: {
-          instruction slot = readByte();
-          push(load(currentStackStart() + slot));
-          break;
-        }
-        case OP_SET_LOCAL: {
-          instruction slot = readByte();
-          store(currentStackStart() + slot, peek(0));
-          break;
-        }
+// Enters `closure`, already known to accept `argCount` arguments, without leaving the loop. When
+// the frame or value stack has to grow, or the call overflows, `slowCall` makes the call instead.
+#define ENTER_CLOSURE(closure, argCount, slowCall)                                      \
+  do {                                                                                  \
+    Value* calleeSlot = sp - (argCount) - 1;                                            \
+    if (frameCount_ < frameCapacity_ && frameCount_ < config_.maxFrames &&              \
+        calleeSlot + (closure)->fn()->stackSize() + FRAME_STACK_RESERVE <= stackEnd_) { \
+      frame->ip = ip;                                                                   \
+      frame = &frames_[frameCount_++];                                                  \
+      *frame = CallFrame((closure), calleeSlot);                                        \
+      ip = frame->ip;                                                                   \
+      slots = calleeSlot;                                                               \
+    } else {                                                                            \
+      STORE_FRAME();                                                                    \
+      if (!(slowCall)) return INTERPRET_RUNTIME_ERROR;                                  \
+      LOAD_FRAME();                                                                     \
+    }                                                                                   \
+  } while (false)
 
-        case OP_GET_GLOBAL: {
-          ObjString* name = readString();
-          Value value;
-          if (!globals_.get(name, &value)) {
-            runtimeError("Undefined variable '%s'.", name->value());
-            return INTERPRET_RUNTIME_ERROR;
-          }
-          push(value);
-          break;
-        }
-        case OP_SET_GLOBAL: {
-          ObjString* name = readString();
-          if (!globals_.containsKey(name)) {
-            runtimeError("Undefined variable '%s'.", name->value());
-            return INTERPRET_RUNTIME_ERROR;
-          }
-          globals_.put(name, peek(0));
-          break;
-        }
+// Continues in native code if the Jit has compiled the current function, which happens once the
+// function gets hot. Native code may call and return through any number of frames before it hands
+// back to this loop, so the frame is reloaded afterwards. Used wherever execution enters or resumes
+// a frame, and on loop back edges.
+#define ENTER_JIT()                                                               \
+  do {                                                                            \
+    if (config_.jit) {                                                            \
+      const void* entry = jitEntry(frame->closure->fn(), ip);                     \
+      if (entry) {                                                                \
+        JitContext context = {this, frame};                                       \
+        Value* top = frame->closure->fn()->jitCode()->fn(&context, sp, entry);    \
+        if (!top) return INTERPRET_RUNTIME_ERROR;                                 \
+        stackTop_ = top;                                                          \
+        LOAD_FRAME();                                                             \
+      }                                                                           \
+    }                                                                             \
+  } while (false)
 
-        case OP_GET_UPVALUE: {
-          instruction slot = readByte();
-          push(*currentFrame().closure->upvalues()[slot]->location());
-          break;
-        }
-        case OP_SET_UPVALUE: {
-          instruction slot = readByte();
-          *currentFrame().closure->upvalues()[slot]->location() = peek(0);
-          break;
-        }
+// Runs the trace of the loop whose header `ip` is at, or records one once the loop is hot. Either
+// can run any number of iterations, so execution continues wherever they stopped.
+#define ENTER_TRACE()                    \
+  do {                                   \
+    if (config_.tracing) {               \
+      frame->ip = ip;                    \
+      Value* top = traceLoop(frame, sp); \
+      if (top) {                         \
+        sp = top;                        \
+        ip = frame->ip;                  \
+      }                                  \
+    }                                    \
+  } while (false)
 
-        case OP_GET_PROPERTY: {
-          if (!peek(0).isInstance()) {
-            runtimeError("Only instances have properties.");
-            return INTERPRET_RUNTIME_ERROR;
-          }
-          ObjInstance* instance = peek(0).asInstance();
-          ObjString* name = readString();
-
-          // If it was the field, push
-          Value value;
-          if (instance->fields().get(name, &value)) {
-            pop(); // Instance
-            push(value);
-            break;
-          }
-          // Otherwise try to find method
-          Method method;
-          if (instance->klass()->methods().get(name, &method)) {
-            createBoundMethod(method);
-            break;
-          }
-
-          runtimeError("Undefined property '%s'.", name->value());
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        case OP_SET_PROPERTY: {
-          if (!peek(0).isInstance()) {
-            runtimeError("Only instances have fields.");
-            return INTERPRET_RUNTIME_ERROR;
-          }
-          ObjInstance* instance = peek(0).asInstance();
-          instance->fields().put(readString(), peek(1));
-
-          pop(); // Instance
-          // Leave assigned value on the stack
-          break;
-        }
+// Closures of the right arity are entered directly; every other callee goes through callValue.
+#define CALL_VALUE(argCount)                                                              \
+  do {                                                                                    \
+    Value callee = PEEK(argCount);                                                        \
+    if (callee.isClosure() && callee.asClosure()->fn()->stackCallArity() == (argCount)) { \
+      ObjClosure* closure = callee.asClosure();                                           \
+      ENTER_CLOSURE(closure, argCount, call(closure, argCount));                          \
+    } else {                                                                              \
+      STORE_FRAME();                                                                      \
+      if (!callValue(callee, argCount)) return INTERPRET_RUNTIME_ERROR;                   \
+      LOAD_FRAME();                                                                       \
+    }                                                                                     \
+    ENTER_JIT();                                                                          \
+  } while (false)
 
-        case OP_GET_SUPER: {
-          ObjString* name = readString();
-          ObjClass* superclass = pop().asClass();
+// Methods in the invoke cache were already called from this site (see invokeFromClass), so their
+// arity is known to match.
+#define INVOKE(constant, argCount)                                                                \
+  do {                                                                                            \
+    instruction name = (constant);                                                                \
+    InvokeCache& cache = frame->closure->fn()->chunk().invokeCache(name);                         \
+    Value receiver = PEEK(argCount);                                                              \
+    ObjClosure* method = nullptr;                                                                 \
+    if (receiver.isInstance()) method = cache.find(receiver.asInstance()->shape(), methodEpoch_); \
+    PROFILE_CACHE(invokeCacheStats_, method != nullptr);                                          \
+    if (method) {                                                                                 \
+      ENTER_CLOSURE(method, argCount, call(method, argCount));                                    \
+    } else {                                                                                      \
+      STORE_FRAME();                                                                              \
+      ObjString* methodName = frame->closure->fn()->chunk().getConstant(name).asString();         \
+      if (!invoke(methodName, argCount, cache)) return INTERPRET_RUNTIME_ERROR;                   \
+      LOAD_FRAME();                                                                               \
+    }                                                                                             \
+    ENTER_JIT();                                                                                  \
+  } while (false)
 
-          Method method;
-          if (superclass->methods().get(name, &method)) {
-            createBoundMethod(method);
-            break;
-          }
-          runtimeError("Undefined property '%s'.", name->value());
-          return INTERPRET_RUNTIME_ERROR;
-        }
+    LOAD_FRAME();
 
-        case OP_DEFINE_GLOBAL: {
-          ObjString* name = readString();
-          globals_.put(name, peek(0));
-          pop();
-          break;
-        }
+    INTERPRET_LOOP {
+      CASE(OP_POP) DROP(); DISPATCH();
 
-        case OP_CONSTANT: push(readConstant()); break;
-        case OP_NIL: push(Nil().asValue()); break;
-        case OP_TRUE: push(Bool(true).asValue()); break;
-        case OP_FALSE: push(Bool(false).asValue()); break;
+      CASE(OP_GET_LOCAL) {
+        instruction slot = READ_BYTE();
+        PUSH(slots[slot]);
+        DISPATCH();
+      }
+      CASE(OP_SET_LOCAL) {
+        instruction slot = READ_BYTE();
+        slots[slot] = PEEK(0);
+        DISPATCH();
+      }
+      CASE(OP_SET_LOCAL_POP) {
+        instruction slot = READ_BYTE();
+        slots[slot] = POP();
+        DISPATCH();
+      }
+      CASE(OP_GET_LOCALS) {
+        instruction first = READ_BYTE();
+        instruction second = READ_BYTE();
+        PUSH(slots[first]);
+        PUSH(slots[second]);
+        DISPATCH();
+      }
 
-        case OP_EQUAL: {
-          Value b = pop();
-          Value a = pop();
-          push(Bool(a == b).asValue());
-          break;
-        }
+      CASE(OP_GET_GLOBAL) {
+        uint16_t slot = READ_SHORT();
+        RUN_HELPER(getGlobal(sp, slot));
+        DISPATCH();
+      }
+      CASE(OP_SET_GLOBAL) {
+        uint16_t slot = READ_SHORT();
+        RUN_HELPER(setGlobal(sp, slot));
+        DISPATCH();
+      }
 
-        case OP_NOT: push(Bool(pop().isFalsey()).asValue()); break;
-        case OP_NEGATE: {
-          if (!peek(0).isNumber()) {
-            runtimeError("Operand must be a number.");
-            return INTERPRET_RUNTIME_ERROR;
-          }
-          push((-pop().asNumber()).asValue());
-          break;
-        }
+      CASE(OP_GET_UPVALUE) {
+        instruction slot = READ_BYTE();
+        RUN_HELPER(getUpvalue(frame->closure, sp, slot));
+        DISPATCH();
+      }
+      CASE(OP_SET_UPVALUE) {
+        instruction slot = READ_BYTE();
+        RUN_HELPER(setUpvalue(frame->closure, sp, slot));
+        DISPATCH();
+      }
+      CASE(OP_GET_CAPTURED) {
+        instruction slot = READ_BYTE();
+        RUN_HELPER(getCaptured(frame->closure, sp, slot));
+        DISPATCH();
+      }
 
-        case OP_ADD: {
-          if (peek(0).isString() && peek(1).isString()) {
-            ObjString* b = pop().asString();
-            ObjString* a = pop().asString();
-            push(concatString(a, b)->asValue());
-          } else if (peek(0).isNumber() && peek(1).isNumber()) {
-            Number b = pop().asNumber();
-            Number a = pop().asNumber();
-            push((a + b).asValue());
-          } else {
-            runtimeError("Operands must be two numbers or two strings.");
-            return INTERPRET_RUNTIME_ERROR;
-          }
-          break;
+      CASE(OP_GET_LOCAL_PROPERTY) {
+        PUSH(slots[READ_BYTE()]);
+        goto getProperty;
+      }
+      CASE(OP_GET_PROPERTY)
+      getProperty : {
+        instruction constant = READ_BYTE();
+        // Cache hits stay in the loop; getProperty() does everything else.
+        PropertyCache& cache = frame->closure->fn()->chunk().propertyCache(constant);
+        if (PEEK(0).isInstance() && PEEK(0).asInstance()->shape() == cache.shape) {
+          PROFILE_CACHE(propertyCacheStats_, true);
+          PEEK(0) = PEEK(0).asInstance()->field(cache.slot); // Replace instance
+          DISPATCH();
         }
-        case OP_SUBTRACT: BINARY_OP(a - b); break;
-        case OP_MULTIPLY: BINARY_OP(a * b); break;
-        case OP_DIVIDE: BINARY_OP(a / b); break;
-        case OP_GREATER: BINARY_OP(Bool(a > b)); break;
-        case OP_LESS: BINARY_OP(Bool(a < b)); break;
-
-        case OP_PRINT: {
-          out_ << pop() << std::endl;
-          break;
+        PROFILE_CACHE(propertyCacheStats_, false);
+        RUN_HELPER(getProperty(frame, sp, constant));
+        DISPATCH();
+      }
+      CASE(OP_SET_PROPERTY) {
+        instruction constant = READ_BYTE();
+        PropertyCache& cache = frame->closure->fn()->chunk().propertyCache(constant);
+        bool hit = PEEK(0).isInstance() && PEEK(0).asInstance()->shape() == cache.shape;
+        PROFILE_CACHE(propertyCacheStats_, hit);
+        // Hits that add a field allocate, which setProperty() handles.
+        if (hit && !cache.transition) {
+          PEEK(0).asInstance()->setField(cache.slot, PEEK(1));
+          DROP(); // Instance
+          DISPATCH();
         }
+        RUN_HELPER(setProperty(frame, sp, constant));
+        DISPATCH();
+      }
 
-        case OP_JUMP: {
-          uint16_t offset = readShort();
-          currentFrame().ip += offset;
-          break;
-        }
-        case OP_JUMP_IF_FALSE: {
-          uint16_t offset = readShort();
-          if (peek(0).isFalsey()) currentFrame().ip += offset;
-          break;
-        }
-        case OP_LOOP: {
-          uint16_t offset = readShort();
-          currentFrame().ip -= offset;
-          break;
-        }
-        case OP_AND: {
-          uint16_t offset = readShort();
-          if (peek(0).isFalsey()) {
-            currentFrame().ip += offset;
-          } else {
-            pop();
-          }
-          break;
+      CASE(OP_GET_SUPER) {
+        ObjString* name = READ_STRING();
+        ObjClass* superclass = POP().asClass();
+
+        Method method;
+        if (superclass->findMethod(name, &method)) {
+          STORE_FRAME();
+          createBoundMethod(method);
+          DISPATCH();
         }
-        case OP_OR: {
-          uint16_t offset = readShort();
-          if (peek(0).isFalsey()) {
-            pop();
-          } else {
-            currentFrame().ip += offset;
-          }
-          break;
+        RUNTIME_ERROR("Undefined property '%s'.", name->value());
+      }
+
+      CASE(OP_DEFINE_GLOBAL) {
+        uint16_t slot = READ_SHORT();
+        sp = defineGlobal(sp, slot);
+        DISPATCH();
+      }
+
+      CASE(OP_CONSTANT) PUSH(READ_CONSTANT()); DISPATCH();
+      CASE(OP_NIL) PUSH(Nil().asValue()); DISPATCH();
+      CASE(OP_TRUE) PUSH(Bool(true).asValue()); DISPATCH();
+      CASE(OP_FALSE) PUSH(Bool(false).asValue()); DISPATCH();
+
+      CASE(OP_EQUAL) {
+        // Quickening: specialize on the operands seen by the first execution.
+        REWRITE_OPCODE(1, PEEK(0).isNumber() && PEEK(1).isNumber() ? OP_EQUAL_NUM : OP_EQUAL_GENERIC);
+        goto equal;
+      }
+      CASE(OP_EQUAL_NUM) {
+        if (!PEEK(0).isNumber() || !PEEK(1).isNumber()) {
+          REWRITE_OPCODE(1, OP_EQUAL_GENERIC);
+          goto equal;
         }
+        Number b = POP().asNumber();
+        Number a = POP().asNumber();
+        PUSH(Bool(a == b).asValue());
+        DISPATCH();
+      }
+      CASE(OP_EQUAL_GENERIC)
+      equal : {
+        sp = equal(sp);
+        DISPATCH();
+      }
+
+      CASE(OP_NOT) PEEK(0) = Bool(PEEK(0).isFalsey()).asValue(); DISPATCH();
+      CASE(OP_NEGATE) RUN_HELPER(negate(sp)); DISPATCH();
 
-        case OP_CALL: {
-          int argCount = readByte();
-          Value callee = peek(argCount);
-          if (!callValue(callee, argCount)) {
-            return INTERPRET_RUNTIME_ERROR;
-          }
-          break;
+      CASE(OP_ADD_LOCAL_CONSTANT) {
+        Value a = slots[READ_BYTE()];
+        Value b = READ_CONSTANT();
+        if (a.isNumber() && b.isNumber()) {
+          PUSH((a.asNumber() + b.asNumber()).asValue());
+          DISPATCH();
         }
-        case OP_INVOKE: {
-          ObjString* name = readString();
-          int argCount = readByte();
-          if (!invoke(name, argCount)) {
-            return INTERPRET_RUNTIME_ERROR;
-          }
-          break;
+        PUSH(a);
+        PUSH(b);
+        goto add;
+      }
+      CASE(OP_ADD) {
+        // Quickening: specialize on the operands seen by the first execution.
+        if (PEEK(0).isNumber() && PEEK(1).isNumber()) {
+          REWRITE_OPCODE(1, OP_ADD_NUM);
+        } else if (PEEK(0).isString() && PEEK(1).isString()) {
+          REWRITE_OPCODE(1, OP_ADD_STR);
+        } else {
+          REWRITE_OPCODE(1, OP_ADD_GENERIC);
+        }
+        goto add;
+      }
+      CASE(OP_ADD_NUM) {
+        if (!PEEK(0).isNumber() || !PEEK(1).isNumber()) {
+          REWRITE_OPCODE(1, OP_ADD_GENERIC);
+          goto add;
         }
-        case OP_SUPER_INVOKE: {
-          ObjString* name = readString();
-          int argCount = readByte();
-
-          ObjClass* superclass = pop().asClass();
-          if (!invokeFromClass(superclass, name, argCount)) {
-            return INTERPRET_RUNTIME_ERROR;
-          }
-          break;
+        Number b = POP().asNumber();
+        Number a = POP().asNumber();
+        PUSH((a + b).asValue());
+        DISPATCH();
+      }
+      CASE(OP_ADD_STR) {
+        if (!PEEK(0).isString() || !PEEK(1).isString()) {
+          REWRITE_OPCODE(1, OP_ADD_GENERIC);
+          goto add;
         }
+        RUN_HELPER(addValues(sp));
+        DISPATCH();
+      }
+      CASE(OP_ADD_GENERIC)
+      add : {
+        RUN_HELPER(addValues(sp));
+        DISPATCH();
+      }
+      CASE(OP_SUBTRACT) RUN_HELPER(numberOp(sp, OP_SUBTRACT)); DISPATCH();
+      CASE(OP_MULTIPLY) RUN_HELPER(numberOp(sp, OP_MULTIPLY)); DISPATCH();
+      CASE(OP_DIVIDE) RUN_HELPER(numberOp(sp, OP_DIVIDE)); DISPATCH();
+      CASE(OP_GREATER) RUN_HELPER(numberOp(sp, OP_GREATER)); DISPATCH();
+      CASE(OP_LESS) RUN_HELPER(numberOp(sp, OP_LESS)); DISPATCH();
+
+      CASE(OP_PRINT) {
+        out_ << POP() << std::endl;
+        DISPATCH();
+      }
 
-        case OP_CLOSURE: {
-          ObjClosure* closure = allocateObj<ObjClosure>(readConstant().asFunction());
-          push(closure->asValue());
-
-          for (int i = 0; i < closure->fn()->upvalueCount(); i++) {
-            instruction isLocal = readByte();
-            instruction index = readByte();
-            if (isLocal == 1) {
-              // Make an new upvalue to close over the parent's local variable.
-              // TODO: Directly accesing stack here
-              closure->upvalues()[i] = captureUpvalue(&stack_[currentStackStart() + index]);
-            } else {
-              // Grab an upvalue from the enclosing function, which we are executing at the moment.
-              closure->upvalues()[i] = currentFrame().closure->upvalues()[index];
-            }
-          }
-          break;
+      CASE(OP_JUMP) {
+        uint16_t offset = READ_SHORT();
+        ip += offset;
+        DISPATCH();
+      }
+      CASE(OP_JUMP_IF_FALSE) {
+        uint16_t offset = READ_SHORT();
+        if (PEEK(0).isFalsey()) ip += offset;
+        DISPATCH();
+      }
+      CASE(OP_LESS_JUMP) {
+        uint16_t offset = READ_SHORT();
+        if (!PEEK(0).isNumber() || !PEEK(1).isNumber()) RUN_HELPER(notNumbers(sp));
+        Number b = POP().asNumber();
+        Number a = POP().asNumber();
+        if (!(a < b)) ip += offset;
+        DISPATCH();
+      }
+      CASE(OP_LOCAL_CONSTANT_LESS_JUMP) {
+        Value a = slots[READ_BYTE()];
+        Value b = READ_CONSTANT();
+        uint16_t offset = READ_SHORT();
+        if (!a.isNumber() || !b.isNumber()) RUN_HELPER(notNumbers(sp));
+        if (!(a.asNumber() < b.asNumber())) ip += offset;
+        DISPATCH();
+      }
+      CASE(OP_INLINE_GUARD) {
+        Value callee = PEEK(READ_BYTE());
+        instruction index = READ_BYTE();
+        uint16_t offset = READ_SHORT();
+        // Most guards see the closure they cached the first time.
+        ObjClosure* cached = frame->closure->fn()->chunk().inlinedCall(index).closure;
+        if (callee.isObj() && callee.asObj() == cached) DISPATCH();
+        if (!isInlinedCallee(frame->closure->fn(), index, callee)) ip += offset;
+        DISPATCH();
+      }
+      CASE(OP_LOOP) {
+        uint16_t offset = READ_SHORT();
+        ip -= offset;
+        ENTER_TRACE();
+        ENTER_JIT();
+        DISPATCH();
+      }
+      CASE(OP_AND) {
+        uint16_t offset = READ_SHORT();
+        if (PEEK(0).isFalsey()) {
+          ip += offset;
+        } else {
+          DROP();
         }
-        case OP_CLOSE_UPVALUE: {
-          closeUpvalues(&stack_[stackTop_ - 1]);
-          pop();
-          break;
+        DISPATCH();
+      }
+      CASE(OP_OR) {
+        uint16_t offset = READ_SHORT();
+        if (PEEK(0).isFalsey()) {
+          DROP();
+        } else {
+          ip += offset;
         }
+        DISPATCH();
+      }
 
-        case OP_CLASS: {
-          push(allocateObj<ObjClass>(readString())->asValue());
-          break;
+      CASE(OP_CALL) {
+        int argCount = READ_BYTE();
+        CALL_VALUE(argCount);
+        DISPATCH();
+      }
+      CASE(OP_CALL_0) CALL_VALUE(0); DISPATCH();
+      CASE(OP_CALL_1) CALL_VALUE(1); DISPATCH();
+      CASE(OP_CALL_2) CALL_VALUE(2); DISPATCH();
+      CASE(OP_CALL_3) CALL_VALUE(3); DISPATCH();
+      CASE(OP_INVOKE) {
+        instruction constant = READ_BYTE();
+        int argCount = READ_BYTE();
+        INVOKE(constant, argCount);
+        DISPATCH();
+      }
+      CASE(OP_INVOKE_0) INVOKE(READ_BYTE(), 0); DISPATCH();
+      CASE(OP_INVOKE_1) INVOKE(READ_BYTE(), 1); DISPATCH();
+      CASE(OP_INVOKE_2) INVOKE(READ_BYTE(), 2); DISPATCH();
+      CASE(OP_INVOKE_3) INVOKE(READ_BYTE(), 3); DISPATCH();
+      CASE(OP_TAIL_CALL) {
+        int argCount = READ_BYTE();
+        Value callee = PEEK(argCount);
+        STORE_FRAME();
+        if (callee.isClosure() ? !tailCall(callee.asClosure(), argCount)
+                               : !callValue(callee, argCount)) {
+          return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_INHERIT: {
-          if (!peek(1).isClass()) {
-            runtimeError("Superclass must be a class.");
-            return INTERPRET_RUNTIME_ERROR;
-          }
-          ObjClass* superclass = peek(1).asClass();
-          ObjClass* subclass = peek(0).asClass();
-
-          subclass->methods().putAll(superclass->methods());
-          pop(); // Subclass.
-          break;
+        LOAD_FRAME();
+        ENTER_JIT();
+        DISPATCH();
+      }
+      CASE(OP_TAIL_INVOKE) {
+        instruction constant = READ_BYTE();
+        int argCount = READ_BYTE();
+        Chunk& chunk = frame->closure->fn()->chunk();
+        InvokeCache& cache = chunk.invokeCache(constant);
+
+        Value receiver = PEEK(argCount);
+        ObjClosure* method = nullptr;
+        if (receiver.isInstance()) method = cache.find(receiver.asInstance()->shape(), methodEpoch_);
+        PROFILE_CACHE(invokeCacheStats_, method != nullptr);
+
+        // A cache miss runs as a normal invoke; the site's next execution is a tail call.
+        STORE_FRAME();
+        if (method ? !tailCall(method, argCount)
+                   : !invoke(chunk.getConstant(constant).asString(), argCount, cache)) {
+          return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_METHOD: {
-          defineMethod(readString());
-          break;
+        LOAD_FRAME();
+        ENTER_JIT();
+        DISPATCH();
+      }
+      CASE(OP_SUPER_INVOKE) {
+        instruction constant = READ_BYTE();
+        int argCount = READ_BYTE();
+        Chunk& chunk = frame->closure->fn()->chunk();
+        InvokeCache& cache = chunk.invokeCache(constant);
+
+        ObjClass* superclass = POP().asClass();
+        ObjClosure* method = cache.find(superclass, methodEpoch_);
+        PROFILE_CACHE(invokeCacheStats_, method != nullptr);
+
+        STORE_FRAME();
+        if (method ? !call(method, argCount)
+                   : !invokeFromClass(superclass, chunk.getConstant(constant).asString(), argCount,
+                                      cache, superclass)) {
+          return INTERPRET_RUNTIME_ERROR;
         }
+        LOAD_FRAME();
+        ENTER_JIT();
+        DISPATCH();
+      }
 
-        case OP_RETURN: {
-          // Save data for subsequent processes.
-          Value result = pop();
-          int frameStackStart = currentStackStart();
+      CASE(OP_CLOSURE) {
+        ObjFunction* fn = READ_CONSTANT().asFunction();
+        RUN_HELPER(makeClosure(frame, sp, fn, ip));
+        ip += 2 * fn->upvalueCount();
+        DISPATCH();
+      }
+      CASE(OP_CLOSE_UPVALUE) {
+        sp = closeUpvalue(sp);
+        DISPATCH();
+      }
 
-          closeUpvalues(&stack_[frameStackStart]);
+      CASE(OP_CLASS) {
+        ObjString* name = READ_STRING();
+        STORE_FRAME();
+        PUSH(allocateObj<ObjClass>(name)->asValue());
+        DISPATCH();
+      }
+      CASE(OP_INHERIT) {
+        if (!PEEK(1).isClass()) {
+          RUNTIME_ERROR("Superclass must be a class.");
+        }
+        ObjClass* superclass = PEEK(1).asClass();
+        ObjClass* subclass = PEEK(0).asClass();
 
-          frameCount_--;
-          if (frameCount_ == 0) {
-            // Top-level done. Pop global script out and finish.
-            pop();
-            return INTERPRET_OK;
-          }
+        subclass->superclass_ = superclass;
+        subclass->gcWriteBarrier(superclass);
+        DROP(); // Subclass.
+        DISPATCH();
+      }
+      CASE(OP_METHOD) {
+        ObjString* name = READ_STRING();
+        STORE_FRAME();
+        defineMethod(name);
+        sp = stackTop_;
+        DISPATCH();
+      }
+      CASE(OP_END_CLASS) {
+        STORE_FRAME();
+        finalizeClass(PEEK(0).asClass());
+        DROP();
+        DISPATCH();
+      }
 
-          // Truncate stack of the frame.
-          stackTop_ = frameStackStart;
-          push(result);
-          break;
+      CASE(OP_RETURN) {
+        Value result = POP();
+        if (frame->closure->fn()->hasCapturedLocals()) closeUpvalues(slots, sp);
+
+        frameCount_--;
+        if (frameCount_ == baseFrame_) {
+          // Top-level done: pop global script out and finish. Or back to a caller on the register
+          // tier (see callAcrossTiers), which gets the result in place of the callee.
+          stackTop_ = slots;
+          if (frameCount_ > 0) push(result);
+          return INTERPRET_OK;
         }
+
+        // Truncate stack of the frame.
+        stackTop_ = slots;
+        push(result);
+        LOAD_FRAME();
+        ENTER_JIT();
+        DISPATCH();
       }
     }
+
+    UNREACHABLE();
+
+#undef INVOKE
+#undef CALL_VALUE
+#undef ENTER_TRACE
+#undef ENTER_JIT
+#undef ENTER_CLOSURE
+#undef DISPATCH
+#undef CASE
+#undef INTERPRET_LOOP
+#undef PROFILE_CACHE
+#undef PROFILE_INSTRUCTION
+#undef TRACE_INSTRUCTION
+#undef RUN_HELPER
+#undef RUNTIME_ERROR
+#undef REWRITE_OPCODE
+#undef PEEK
+#undef DROP
+#undef POP
+#undef PUSH
+#undef READ_STRING
+#undef READ_CONSTANT
+#undef READ_SHORT
+#undef READ_BYTE
+#undef LOAD_FRAME
+#undef STORE_FRAME
+  }
+
+  const void* VM::jitEntry(ObjFunction* fn, const instruction* ip) {
+    if (!fn->jitCode_) {
+      if (fn->jitFailed_ || ++fn->hotness_ < config_.jitThreshold) return nullptr;
+      if (!Jit::compile(*this, fn)) {
+        fn->jitFailed_ = true;
+        return nullptr;
+      }
+      jitCompiledFunctions_++;
+    }
+    return fn->jitCode_->entries[ip - fn->chunk().code()];
+  }
+
+  Value* VM::traceLoop(CallFrame* frame, Value* sp) {
+    ObjFunction* fn = frame->closure->fn();
+    LoopTrace* trace = fn->loopTrace(frame->ip - fn->chunk().code());
+    if (trace->fn) return trace->fn(frame, sp);
+    if (trace->aborts >= Tracer::MAX_ABORTS || ++trace->hotness < config_.traceThreshold) {
+      return nullptr;
+    }
+
+    trace->hotness = 0;
+    TraceRecorder recorder(*this, frame, sp);
+    if (recorder.record() && Tracer::compile(*this, fn, trace, recorder)) {
+      compiledTraces_++;
+    } else {
+      trace->aborts++;
+    }
+    return recorder.sp();
   }
 
-  bool VM::invoke(ObjString* name, int argCount) {
+  bool VM::invoke(ObjString* name, int argCount, InvokeCache& cache) {
     Value receiver = peek(argCount);
     if (!receiver.isInstance()) {
       runtimeError("Only instances have methods.");
@@ -391,21 +844,152 @@ namespace lox {
     ObjInstance* instance = receiver.asInstance();
 
     Value value;
-    if (instance->fields().get(name, &value)) {
-      store(stackTop_ - argCount - 1, value);
+    if (instance->getField(name, &value)) {
+      stackTop_[-argCount - 1] = value;
       return callValue(value, argCount);
     }
 
-    return invokeFromClass(instance->klass(), name, argCount);
+    return invokeFromClass(instance->klass(), name, argCount, cache, instance->shape());
   }
 
-  bool VM::invokeFromClass(ObjClass* klass, ObjString* name, int argCount) {
+  bool VM::invokeFromClass(ObjClass* klass, ObjString* name, int argCount, InvokeCache& cache,
+                           const void* key) {
     Method method;
-    if (!klass->methods().get(name, &method)) {
+    if (!klass->findMethod(name, &method)) {
       runtimeError("Undefined property '%s'.", name->value());
       return false;
     }
-    return call(method.asClosure(), argCount);
+    ObjFunction* caller = frames_[frameCount_ - 1].closure->fn(); // Whose chunk has the cache.
+    if (!call(method.asClosure(), argCount)) return false;
+    // Only methods called with the right number of arguments are cached, so a hit can skip the
+    // arity check.
+    cache.add(key, klass, method.asClosure());
+    caller->gcWriteBarrier(klass);
+    caller->gcWriteBarrier(method.asClosure());
+    klass->isInvokeCached_ = true;
+    return true;
+  }
+
+  void VM::methodsChanged(ObjClass* klass) {
+    Method init;
+    klass->initializer_ = klass->findMethod(initString_, &init) ? init.asClosure() : nullptr;
+
+    // Classes get their methods before any call can reach them, so in practice this never
+    // invalidates anything.
+    if (klass->isInvokeCached_) methodEpoch_++;
+  }
+
+  Value* VM::addValues(Value* sp) {
+    if (sp[-1].isString() && sp[-2].isString()) {
+      // Operands stay on the stack as GC roots while the result is allocated.
+      stackTop_ = sp;
+      ObjString* result = concatString(sp[-2].asString(), sp[-1].asString());
+      sp[-2] = result->asValue();
+      return sp - 1;
+    }
+    if (sp[-1].isNumber() && sp[-2].isNumber()) {
+      sp[-2] = (sp[-2].asNumber() + sp[-1].asNumber()).asValue();
+      return sp - 1;
+    }
+    return operandError(sp, "Operands must be two numbers or two strings.");
+  }
+
+  Value* VM::getProperty(CallFrame* frame, Value* sp, int constant) {
+    if (!sp[-1].isInstance()) return operandError(sp, "Only instances have properties.");
+    ObjInstance* instance = sp[-1].asInstance();
+    ObjFunction* fn = frame->closure->fn();
+    ObjString* name = fn->chunk().getConstant(constant).asString();
+
+    PropertyCache& cache = fn->chunk().propertyCache(constant);
+    if (instance->shape() == cache.shape) {
+      sp[-1] = instance->field(cache.slot); // Replace instance
+      return sp;
+    }
+    int slot = instance->shape()->findSlot(name);
+    if (slot != -1) {
+      cache = {instance->shape(), nullptr, slot};
+      fn->gcWriteBarrier(instance->shape()->klass());
+      sp[-1] = instance->field(slot);
+      return sp;
+    }
+    // Otherwise try to find method
+    Method method;
+    if (instance->klass()->findMethod(name, &method)) {
+      stackTop_ = sp;
+      createBoundMethod(method);
+      return stackTop_;
+    }
+    stackTop_ = sp;
+    runtimeError("Undefined property '%s'.", name->value());
+    return nullptr;
+  }
+
+  Value* VM::setProperty(CallFrame* frame, Value* sp, int constant) {
+    if (!sp[-1].isInstance()) return operandError(sp, "Only instances have fields.");
+    ObjInstance* instance = sp[-1].asInstance();
+    ObjFunction* fn = frame->closure->fn();
+    ObjString* name = fn->chunk().getConstant(constant).asString();
+
+    // Adding a field may grow the instance's fields, which allocates.
+    stackTop_ = sp;
+    PropertyCache& cache = fn->chunk().propertyCache(constant);
+    if (instance->shape() == cache.shape) {
+      if (cache.transition) {
+        instance->addField(cache.transition, sp[-2]);
+      } else {
+        instance->setField(cache.slot, sp[-2]);
+      }
+    } else {
+      Shape* shape = instance->shape();
+      int slot = shape->findSlot(name);
+      if (slot != -1) {
+        cache = {shape, nullptr, slot};
+        fn->gcWriteBarrier(shape->klass());
+        instance->setField(slot, sp[-2]);
+      } else {
+        Shape* transition = shape->transition(name);
+        instance->addField(transition, sp[-2]);
+        cache = {shape, transition, shape->slotCount()};
+        fn->gcWriteBarrier(shape->klass());
+      }
+    }
+    // Leave assigned value on the stack
+    return sp - 1;
+  }
+
+  Value* VM::makeClosure(CallFrame* frame, Value* sp, ObjFunction* fn,
+                         const instruction* captures) {
+    stackTop_ = sp;
+    ObjClosure* closure = allocateObj<ObjClosure>(fn);
+    *sp++ = closure->asValue();
+    stackTop_ = sp; // Keep the new closure reachable while upvalues are allocated.
+
+    for (int i = 0; i < fn->upvalueCount(); i++) {
+      instruction kind = *captures++;
+      instruction index = *captures++;
+      if (kind == CAPTURE_LOCAL_VALUE) {
+        closure->setUpvalue(i, frame->slots[index]);
+      } else if (kind == CAPTURE_LOCAL) {
+        // Make an new upvalue to close over the parent's local variable.
+        closure->setUpvalue(i, captureUpvalue(frame->slots + index)->asValue());
+      } else {
+        // Grab an upvalue from the enclosing function, which we are executing at the moment.
+        closure->setUpvalue(i, frame->closure->upvalues()[index]);
+      }
+    }
+    return sp;
+  }
+
+  Value* VM::undefinedVariable(Value* sp, int slot) {
+    stackTop_ = sp;
+    runtimeError("Undefined variable '%s'.", globalNames_[slot]->value());
+    return nullptr;
+  }
+
+  Value* VM::operandError(Value* sp, const char* message) {
+    stackTop_ = sp;
+    runtimeError("%s", message);
+    return nullptr;
   }
 
   void VM::createBoundMethod(Method method) {
@@ -414,40 +998,66 @@ namespace lox {
     push(boundMethod->asValue());
   }
 
-  void VM::defineMethod(ObjString* name) {
-    peek(1).asClass()->methods().put(name, Method(peek(0).asClosure()));
-    pop(); // Pop ObjClosure on top pf the stack
+  int VM::methodSelector(ObjString* name) {
+    if (name->selector_ == -1) name->selector_ = selectorCount_++;
+    return name->selector_;
   }
 
-  ObjUpvalue* VM::captureUpvalue(Value* local) {
-    ObjUpvalue* prevUpvalue = nullptr;
-    ObjUpvalue* upvalue = openUpvalues_;
+  void VM::finalizeClass(ObjClass* klass) {
+    ObjClass* superclass = klass->superclass_;
+    MethodTable& methods = klass->methods();
+    if (superclass && methods.size() == 0) {
+      klass->vtable_ = superclass->vtable_;
+      klass->vtableSize_ = superclass->vtableSize_;
+    } else {
+      int size = superclass ? superclass->vtableSize_ : 0;
+      for (int i = 0; i < methods.capacity(); i++) {
+        MethodTable::Entry* e = methods.getEntry(i);
+        if (!e->isEmpty()) size = std::max(size, methodSelector(e->key.value()) + 1);
+      }
 
-    // Walk towards the bottom of the stack until we find a previously existing
-    // upvalue or pass where it should be.
-    while (upvalue != nullptr && upvalue->location() > local) {
-      prevUpvalue = upvalue;
-      upvalue = upvalue->next();
+      Method* vtable = Memory::allocate<Method>(size);
+      for (int i = 0; i < size; i++) {
+        new (&vtable[i]) Method(superclass && i < superclass->vtableSize_ ? superclass->vtable_[i]
+                                                                          : Method());
+      }
+      for (int i = 0; i < methods.capacity(); i++) {
+        MethodTable::Entry* e = methods.getEntry(i);
+        if (!e->isEmpty()) vtable[e->key.value()->selector()] = e->value;
+      }
+      klass->vtable_ = vtable;
+      klass->vtableSize_ = size;
+      klass->ownsVtable_ = true;
     }
+    methodsChanged(klass);
+  }
 
-    // Found an existing upvalue for this local.
-    if (upvalue != nullptr && upvalue->location() == local) return upvalue;
+  void VM::defineMethod(ObjString* name) {
+    ObjClass* klass = peek(1).asClass();
+    klass->methods().put(name, Method(peek(0).asClosure()));
+    klass->gcWriteBarrier(name);
+    klass->gcWriteBarrier(peek(0));
+    pop(); // Pop ObjClosure on top pf the stack
+  }
 
-    // Make a new one, link it.
-    ObjUpvalue* createdUpvalue = allocateObj<ObjUpvalue>(local);
-    if (prevUpvalue == nullptr) {
-      openUpvalues_ = createdUpvalue;
-    } else {
-      prevUpvalue->next_ = createdUpvalue;
-    }
-    return createdUpvalue;
+  ObjUpvalue* VM::captureUpvalue(Value* local) {
+    int slot = local - stack_;
+    if (openUpvalues_[slot]) return openUpvalues_[slot];
+
+    ObjUpvalue* upvalue = allocateObj<ObjUpvalue>(local);
+    openUpvalues_[slot] = upvalue;
+    openUpvalueCount_++;
+    return upvalue;
   }
 
-  void VM::closeUpvalues(Value* last) {
-    while (openUpvalues_ != nullptr && openUpvalues_->location() >= last) {
-      ObjUpvalue* upvalue = openUpvalues_;
-      upvalue->doClose();
-      openUpvalues_ = upvalue->next();
+  void VM::closeUpvalues(Value* first, Value* end) {
+    if (openUpvalueCount_ == 0) return;
+
+    for (int slot = first - stack_; slot < end - stack_; slot++) {
+      if (!openUpvalues_[slot]) continue;
+      openUpvalues_[slot]->doClose();
+      openUpvalues_[slot] = nullptr;
+      openUpvalueCount_--;
     }
   }
 
@@ -455,10 +1065,10 @@ namespace lox {
     if (callee.isClosure()) {
       return call(callee.asClosure(), argCount);
     } else if (callee.isClass()) {
-      store(stackTop_ - argCount - 1, allocateObj<ObjInstance>(callee.asClass())->asValue());
-      Method init;
-      if (callee.asClass()->methods().get(initString_, &init)) {
-        return call(init.asClosure(), argCount);
+      ObjClass* klass = callee.asClass();
+      stackTop_[-argCount - 1] = allocateObj<ObjInstance>(klass)->asValue();
+      if (klass->initializer()) {
+        return call(klass->initializer(), argCount);
       } else if (argCount != 0) {
         runtimeError("Expected 0 arguments but got %d.", argCount);
         return false;
@@ -466,8 +1076,12 @@ namespace lox {
       return true;
     } else if (callee.isBoundMethod()) {
       ObjBoundMethod* boundMethod = callee.asBoundMethod();
-      store(stackTop_ - argCount - 1, boundMethod->receiver());
+      stackTop_[-argCount - 1] = boundMethod->receiver();
       return call(boundMethod->method().asClosure(), argCount); // TODO
+    } else if (callee.isNative()) {
+      if (!callNative(callee.asNative(), stackTop_ - argCount, argCount)) return false;
+      stackTop_ -= argCount;
+      return true;
     }
     runtimeError("Can only call functions and classes.");
     return false;
@@ -478,21 +1092,83 @@ namespace lox {
       runtimeError("Expected %d arguments but got %d.", closure->fn()->arity(), argCount);
       return false;
     }
-    if (frameCount_ == FRAMES_MAX) {
+    if (frameCount_ == config_.maxFrames) {
       runtimeError("Stack overflow.");
       return false;
     }
+    // Defined by an earlier script on this VM that ran on the register tier.
+    if (closure->fn()->isRegisterCode()) return callAcrossTiers(closure, argCount);
 
     appendCallFrame(closure, stackTop_ - argCount - 1);
     return true;
   }
 
+  bool VM::callAcrossTiers(ObjClosure* closure, int argCount) {
+    appendCallFrame(closure, stackTop_ - argCount - 1);
+    int baseFrame = baseFrame_;
+    baseFrame_ = frameCount_ - 1;
+    InterpretResult result = closure->fn()->isRegisterCode() ? runRegisters() : run();
+    baseFrame_ = baseFrame;
+    return result == INTERPRET_OK;
+  }
+
+  bool VM::callNative(ObjNative* native, Value* args, int argCount) {
+    if (argCount != native->arity()) {
+      runtimeError("Expected %d arguments but got %d.", native->arity(), argCount);
+      return false;
+    }
+
+    // The native may push roots and so move the stack.
+    int callee = args - 1 - stack_;
+    Value result;
+    if (!native->fn()(*this, args, argCount, &result)) return false;
+    stack_[callee] = result;
+    return true;
+  }
+
+  bool VM::tailCall(ObjClosure* closure, int argCount) {
+    if (closure->fn()->isRegisterCode() || argCount != closure->fn()->arity()) {
+      return call(closure, argCount);
+    }
+
+    // The callee and arguments move down over the current frame's slots.
+    Value* slots = frames_[frameCount_ - 1].slots;
+    if (frames_[frameCount_ - 1].closure->fn()->hasCapturedLocals()) {
+      closeUpvalues(slots, stackTop_);
+    }
+    std::copy(stackTop_ - argCount - 1, stackTop_, slots);
+    stackTop_ = slots + argCount + 1;
+
+    frameCount_--;
+    appendCallFrame(closure, slots);
+    return true;
+  }
+
   void VM::traceStack() {
     std::cout << "          ";
-    for (int i = 0; i < stackTop_; i++) std::cout << "[ " << stack_[i] << " ]";
+    for (Value* slot = stack_; slot < stackTop_; slot++) std::cout << "[ " << *slot << " ]";
     std::cout << std::endl;
   }
 
+#ifdef PROFILE_OPCODES
+  void VM::profileInstruction(ObjFunction* fn, const instruction* ip) {
+    std::vector<long>& counts = opcodeProfile_[fn];
+    if (counts.empty()) counts.resize(fn->chunk().count());
+    counts[ip - fn->chunk().code()]++;
+  }
+#endif
+
+  bool VM::isInlinedCallee(ObjFunction* caller, int index, Value callee) {
+    InlinedCall& call = caller->chunk().inlinedCall(index);
+    if (callee.isObj() && callee.asObj() == call.closure) return true;
+    if (!callee.isClosure() || callee.asClosure()->fn() != call.fn) return false;
+    if (!call.closure) {
+      call.closure = callee.asClosure();
+      caller->gcWriteBarrier(call.closure);
+    }
+    return true;
+  }
+
   void VM::runtimeError(const char* format, ...) const {
     va_list args;
     va_start(args, format);
@@ -503,8 +1179,16 @@ namespace lox {
     // print stacktrace
     for (int i = frameCount_ - 1; i >= 0; i--) {
       const CallFrame& frame = frames_[i];
-      int line = frame.closure->fn()->chunk().getLine(frame.ip - 1);
-      std::cerr << "[line " << line << "] in " << *frame.closure << std::endl;
+      const Chunk& chunk = frame.closure->fn()->chunk();
+      int offset = frame.ip - chunk.code() - 1;
+      // Calls inlined into the frame's function show as frames of their own, innermost first.
+      const Vector<InlinedCall>& inlined = chunk.inlinedCalls();
+      for (int j = inlined.size() - 1; j >= 0; j--) {
+        if (offset < inlined[j].start || offset >= inlined[j].end) continue;
+        std::cerr << "[line " << chunk.getLine(offset) << "] in " << *inlined[j].fn << std::endl;
+        offset = inlined[j].guard;
+      }
+      std::cerr << "[line " << chunk.getLine(offset) << "] in " << *frame.closure << std::endl;
     }
   }
 
@@ -519,16 +1203,22 @@ namespace lox {
     chars[length] = '\0';
 
     ObjString* result = allocateObj<ObjString>(chars, length);
-    Memory::reallocate(chars, sizeof(char) * length, 0); // TODO: Not decrease allocated bytes?
+    Memory::deallocate(chars, sizeof(char) * (length + 1));
     popRoot();
     popRoot();
     return result;
   }
 
+  void VM::gcClearMarks() {
+    // Everything is traced, so there is nothing to remember.
+    for (int i = 0; i < gcRememberedSet_.size(); i++) gcRememberedSet_[i]->isGCRemembered_ = false;
+    gcRememberedSet_.truncate(0);
+  }
+
   void VM::gcMarkRoots() {
     // VM stack
-    for (int i = 0; i < stackTop_; i++) {
-      gcMarkValue(stack_[i]);
+    for (Value* slot = stack_; slot < stackTop_; slot++) {
+      gcMarkValue(*slot);
     }
 
     // Functions in callframes
@@ -537,21 +1227,20 @@ namespace lox {
     }
 
     // Open upvalues.
-    for (ObjUpvalue* upvalue = openUpvalues_; upvalue != nullptr; upvalue = upvalue->next()) {
-      gcMarkObject(upvalue);
+    if (openUpvalueCount_ > 0) {
+      for (int i = 0; i < stackTop_ - stack_; i++) gcMarkObject(openUpvalues_[i]);
     }
 
-    // Global variables
-    // TODO: Lame Map blackening codes
-    for (int i = 0; i < globals_.capacity(); ++i) {
-      Map<StringKey, Value>::Entry* e = globals_.getEntry(i);
-      if (e->isEmpty()) continue;
-
-      gcMarkObject(e->key.value());
-      gcMarkValue(e->value);
-    }
+    // Global variables. globalSlots_ shares its keys with globalNames_.
+    for (int i = 0; i < globals_.size(); i++) gcMarkValue(globals_[i]);
+    for (int i = 0; i < globalNames_.size(); i++) gcMarkObject(globalNames_[i]);
 
     // Compiler
+    RegisterCompiler* registerCompiler = registerCompiler_;
+    while (registerCompiler) {
+      registerCompiler->gcBlacken(*this);
+      registerCompiler = registerCompiler->enclosing_;
+    }
     Compiler* compiler = compiler_;
     while (compiler) {
       compiler->gcBlacken(*this);
@@ -559,42 +1248,98 @@ namespace lox {
     }
 
     gcMarkObject(initString_);
+
+#ifdef PROFILE_OPCODES
+    // Keep profiled functions alive so their addresses can't be reused by new ones.
+    for (auto& entry : opcodeProfile_) gcMarkObject(entry.first);
+#endif
   }
 
-  void VM::gcBlackenObjects() {
+  void VM::gcMarkRememberedObjects() {
+    // Remembered objects are old, so marking them would stop at them; their references are marked
+    // instead.
+    for (int i = 0; i < gcRememberedSet_.size(); i++) {
+      Obj* obj = gcRememberedSet_[i];
+      obj->isGCRemembered_ = false;
+      obj->gcBlacken(*this);
+    }
+    gcRememberedSet_.truncate(0);
+  }
+
+  bool VM::gcBlackenObjects(int budget) {
     while (gcGrayStack_.size() > 0) {
+      if (budget-- == 0) return false;
       Obj* obj = gcGrayStack_.removeAt(gcGrayStack_.size() - 1);
 #ifdef DEBUG_LOG_GC
       std::cout << "blacken " << *obj << " @ " << obj << std::endl;
 #endif
       obj->gcBlacken(*this);
     }
+    return true;
+  }
+
+  void VM::gcBlackenObjectsInParallel() {
+    if (config_.gcMarkThreads <= 1) {
+      gcBlackenObjects(INT_MAX);
+      return;
+    }
+    if (!gcMarker_) gcMarker_ = new ParallelMarker(*this, config_.gcMarkThreads);
+    gcMarkingInParallel_ = true;
+    gcMarker_->mark(gcGrayStack_);
+    gcMarkingInParallel_ = false;
   }
 
   void VM::gcRemoveWeakReferences() {
-    strings_.removeUnmarkedStrings();
+    strings_.removeUnmarkedStrings(memory_.epoch());
   }
 
-  void VM::gcSweep() {
-    Obj* previous = nullptr;
-    Obj* obj = objects_;
+  void VM::gcSweepYoung() {
+    // Survivors keep their marks, which is what makes them old.
+    Obj* obj = youngObjects_;
     while (obj) {
-      if (obj->isGCMarked_) {
-        obj->isGCMarked_ = false;
-        previous = obj;
-        obj = obj->next_;
+      Obj* next = obj->next_;
+      if (obj->isGCMarked(memory_.epoch())) {
+        obj->next_ = objects_;
+        objects_ = obj;
       } else {
-        Obj* unreached = obj;
-        obj = obj->next_;
-        if (previous) {
-          previous->next_ = obj;
-        } else {
-          objects_ = obj;
-        }
+        if (obj->isString()) strings_.remove(obj->asString());
+        freeObject(obj);
+      }
+      obj = next;
+    }
+    youngObjects_ = nullptr;
+  }
 
-        freeObject(unreached);
+  void VM::gcBeginSweep() {
+    unswept_ = objects_;
+    unsweptYoung_ = youngObjects_;
+    objects_ = nullptr;
+    youngObjects_ = nullptr;
+  }
+
+  bool VM::gcSweepObjects(int budget) {
+    for (; budget > 0; budget--) {
+      if (!unswept_) {
+        if (!unsweptYoung_) return true;
+        unswept_ = unsweptYoung_;
+        unsweptYoung_ = nullptr;
+      }
+      Obj* obj = unswept_;
+      unswept_ = obj->next_;
+      // Unmarked strings have already been dropped from the table.
+      if (obj->isGCMarked(memory_.epoch())) {
+        obj->next_ = objects_;
+        objects_ = obj;
+      } else {
+        freeObject(obj);
       }
     }
+    return !unswept_ && !unsweptYoung_;
+  }
+
+  void VM::gcRemember(Obj* obj) {
+    obj->isGCRemembered_ = true;
+    gcRememberedSet_.push(obj);
   }
 
   void VM::gcMarkValue(Value value) {
@@ -605,12 +1350,21 @@ namespace lox {
 
   void VM::gcMarkObject(Obj* obj) {
     if (!obj) return;
-    if (obj->isGCMarked_) return;
+    if (gcMarkingInParallel_) {
+      // Of the threads that reach `obj`, the one that sets its mark traces it.
+      uint8_t epoch = memory_.epoch();
+      std::atomic_ref<uint8_t> mark(obj->gcMark_);
+      if (mark.load(std::memory_order_relaxed) == epoch) return;
+      if (mark.exchange(epoch, std::memory_order_relaxed) == epoch) return;
+      ParallelMarker::push(obj);
+      return;
+    }
+    if (obj->isGCMarked(memory_.epoch())) return;
 
 #ifdef DEBUG_LOG_GC
     std::cout << "mark " << *obj << " @ " << obj << std::endl;
 #endif
-    obj->isGCMarked_ = true;
+    obj->gcMark_ = memory_.epoch();
     gcGrayStack_.push(obj);
   }
 
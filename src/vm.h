@@ -1,37 +1,96 @@
 #pragma once
 
 #include <type_traits>
+#ifdef PROFILE_OPCODES
+#include <unordered_map>
+#include <vector>
+#endif
 
 #include "common.h"
 #include "compiler.h"
 #include "lib/vector.h"
+#include "op_code.h"
+#include "register_compiler.h"
 #include "string_table.h"
 #include "value/object.h"
 #include "value/value.h"
 
 namespace lox {
 
+  class ParallelMarker;
+
   enum InterpretResult {
     INTERPRET_OK,
     INTERPRET_COMPILE_ERROR,
     INTERPRET_RUNTIME_ERROR
   };
 
+  struct VMConfig {
+    // Fuse common opcode sequences into superinstructions when compiling.
+    bool superinstructions = true;
+    // Compile scripts to register bytecode and run them with VM::runRegisters. Scripts the
+    // RegisterCompiler doesn't support still run on the stack interpreter, and functions of either
+    // tier can call the other's.
+    bool registerTier = false;
+    // Replace calls to small global functions with their bodies (see Inliner).
+    bool inlining = true;
+    // Largest function body the Inliner copies into a call site, in expression nodes.
+    int inlineBudget = 24;
+    // Maximum number of nested calls; a call beyond it fails with "Stack overflow.".
+    int maxFrames = 1 << 16;
+    // Compile hot functions to native code (see Jit). Off by default, and ignored where the Jit
+    // has no backend.
+    bool jit = false;
+    // Calls, returns into and loop iterations of a function before the Jit compiles it.
+    int jitThreshold = 1000;
+    // Record and compile traces of hot loops (see Tracer). Off by default, and ignored where the
+    // Tracer has no backend.
+    bool tracing = false;
+    // Back edges of a loop before its next iteration is recorded.
+    int traceThreshold = 100;
+    // Major collections, which trace the whole heap, happen once the allocated bytes reach this
+    // many times what the previous major collection left live, or gcMinHeapSize, whichever is
+    // larger. Builds with STRESS_GC collect on every allocation instead.
+    double gcHeapGrowthFactor = 2.0;
+    size_t gcMinHeapSize = 1 << 20;
+    // Bytes allocated after a collection before a minor one, which only frees objects allocated
+    // since the previous collection. 0 makes every collection major.
+    size_t gcNurserySize = 256 << 10;
+    // Mark major collections incrementally, in slices between allocations that trace at most
+    // gcSliceBudget objects each, instead of in one pause.
+    bool gcIncremental = false;
+    // Free the garbage of major collections in steps between allocations that visit at most
+    // gcSliceBudget objects each, instead of in the pause. Other collections wait for the sweep.
+    bool gcLazySweep = true;
+    // Budgets below 1 count as 1. A slice the allocation that runs it overshoots visits more, one
+    // object per 16 bytes allocated since the previous one.
+    int gcSliceBudget = 10000;
+    // Threads that mark major collections that aren't incremental, including the VM's own (see
+    // ParallelMarker).
+    int gcMarkThreads = 1;
+  };
+
   struct CallFrame {
     CallFrame() {}
 
-    CallFrame(ObjClosure* closure, int stackStart)
-      : closure(closure)
-      , stackStart(stackStart) {}
+    CallFrame(ObjClosure* closure, Value* slots)
+      : ip(closure->fn()->chunk().code())
+      , closure(closure)
+      , slots(slots) {}
 
-    int ip = 0;
+    const instruction* ip = nullptr;
     ObjClosure* closure = nullptr;
-    int stackStart = 0;
+    Value* slots = nullptr; // First stack slot of the frame (the callee itself).
   };
 
   class VM {
+    friend class Jit;
+    friend class JitCompiler;
+    friend class TraceRecorder;
+    friend class TraceCompiler;
+
    public:
-    VM(std::ostream& out = std::cout);
+    VM(std::ostream& out = std::cout, const VMConfig& config = VMConfig());
 
     ~VM();
 
@@ -40,6 +99,7 @@ namespace lox {
     // TODO: Right place to manage heap allocation?
     template <typename T, typename... Args>
     T* allocateObj(Args&&... args) {
+      memory_.makeCurrent();
       if constexpr (std::is_same_v<T, ObjString>) {
         return findOrAllocateString(std::forward<Args>(args)...);
       }
@@ -52,11 +112,78 @@ namespace lox {
       compiler_ = compiler;
     }
 
+    void setRegisterCompiler(RegisterCompiler* compiler) {
+      registerCompiler_ = compiler;
+    }
+
+    const VMConfig& config() const {
+      return config_;
+    }
+
+    // Defines a global variable `name` holding a native function that takes `arity` arguments.
+    void defineNative(const char* name, NativeFn fn, int arity);
+
+    // Reports an error with a stack trace. Natives call it before failing.
+    void runtimeError(const char* format, ...) const;
+
+    // Returns the slot of the global variable `name`, adding one if the name is new. Compilers
+    // resolve globals to slots so the interpreter can access them by index.
+    int globalSlot(ObjString* name);
+
+    // The heap of the VM's objects, with its collection statistics.
+    const Memory& memory() const {
+      return memory_;
+    }
+
+    // Number of functions the Jit has compiled.
+    int jitCompiledFunctions() const {
+      return jitCompiledFunctions_;
+    }
+
+    // Number of loop traces the Tracer has compiled.
+    int compiledTraces() const {
+      return compiledTraces_;
+    }
+
+#ifdef PROFILE_OPCODES
+    // Execution count of every instruction, indexed by code offset, per function.
+    typedef std::unordered_map<ObjFunction*, std::vector<long>> OpcodeProfile;
+
+    const OpcodeProfile& opcodeProfile() const {
+      return opcodeProfile_;
+    }
+
+    struct CacheStats {
+      long hits = 0;
+      long misses = 0;
+    };
+
+    // Lookups answered by the property inline caches of OP_GET_PROPERTY and OP_SET_PROPERTY.
+    const CacheStats& propertyCacheStats() const {
+      return propertyCacheStats_;
+    }
+
+    // Method lookups answered by the invoke inline caches of OP_INVOKE and OP_SUPER_INVOKE.
+    const CacheStats& invokeCacheStats() const {
+      return invokeCacheStats_;
+    }
+#endif
+
     // GC procedures
+    void gcClearMarks();
     void gcMarkRoots();
-    void gcBlackenObjects();
+    void gcMarkRememberedObjects();
+    // Traces gray objects until none are left, which returns true, or `budget` have been traced.
+    bool gcBlackenObjects(int budget);
+    // Traces all gray objects, on gcMarkThreads threads.
+    void gcBlackenObjectsInParallel();
     void gcRemoveWeakReferences();
-    void gcSweep();
+    void gcSweepYoung();
+    // Major collections sweep both generations, in steps of gcSweepObjects() that return true once
+    // everything has been swept.
+    void gcBeginSweep();
+    bool gcSweepObjects(int budget);
+    void gcRemember(Obj* obj);
     void gcMarkValue(Value value);
     void gcMarkObject(Obj* obj);
 
@@ -74,6 +201,8 @@ namespace lox {
 
    private:
     ObjFunction* compileSource(const char* source);
+    // Defines the built-in natives (see natives.cpp).
+    void defineNatives();
 
     void freeObjects();
     void freeObject(Obj* obj);
@@ -83,115 +212,240 @@ namespace lox {
     ObjString* findOrAllocateString(const char* src, int length);
 
     InterpretResult run();
+    InterpretResult runRegisters();
+
+    // Native code address to continue `fn` at `ip` from, or null if it is still interpreted. Counts
+    // towards the function's hotness and compiles it once it crosses the threshold.
+    const void* jitEntry(ObjFunction* fn, const instruction* ip);
+    // Called on the back edge of a loop, with `frame`'s ip at the loop header. Runs the loop's
+    // trace if it has one, or records an iteration and compiles it once the loop is hot. Returns
+    // the new stack top, with the frame's ip where to continue, or null if neither happened.
+    Value* traceLoop(CallFrame* frame, Value* sp);
 
     void traceStack();
 
-    void runtimeError(const char* format, ...) const;
+#ifdef PROFILE_OPCODES
+    void profileInstruction(ObjFunction* fn, const instruction* ip);
+#endif
 
-    void appendCallFrame(ObjClosure* closure, int stackStart);
+    // Pushes a frame whose callee is at `slots`, growing both stacks as needed.
+    void appendCallFrame(ObjClosure* closure, Value* slots);
+    void growFrames();
+    void growStack(int capacity);
 
     bool callValue(Value callee, int argCount);
     bool call(ObjClosure* closure, int argCount);
+    // Calls `closure` from code of the other tier: runs it in a nested interpreter loop of its own
+    // tier until it returns, leaving the result in place of the callee as natives do.
+    bool callAcrossTiers(ObjClosure* closure, int argCount);
+    // Runs `native` on the arguments at `args` and stores its result in the callee's slot, just
+    // below them.
+    bool callNative(ObjNative* native, Value* args, int argCount);
+    // Calls `closure` in place of the current frame, whose upvalues are closed first. Calls that
+    // would fail are made with call() instead, so the error is reported from the calling frame.
+    bool tailCall(ObjClosure* closure, int argCount);
+    // Check of OP_INLINE_GUARD: whether `callee` is the function of inlined call `index` of
+    // `caller`, which then caches it (see InlinedCall).
+    bool isInlinedCallee(ObjFunction* caller, int index, Value callee);
 
     ObjUpvalue* captureUpvalue(Value* location);
-    void closeUpvalues(Value* last);
-
-    void defineMethod(ObjString* name);
-    void createBoundMethod(Method method);
+    // Closes the open upvalues of the stack slots in [first, end).
+    void closeUpvalues(Value* first, Value* end);
+
+    // Instructions whose semantics run() and the Jit's slow paths share. Each takes the stack top
+    // and returns the new one, or null once it has reported a runtime error, so the caller stores
+    // the frame's ip first. Anything that may allocate stores the stack top itself.
+    Value* getGlobal(Value* sp, int slot) {
+      Value value = globals_[slot];
+      if (value.isUninitialized()) return undefinedVariable(sp, slot);
+      *sp++ = value;
+      return sp;
+    }
 
-    bool invoke(ObjString* name, int argCount);
-    bool invokeFromClass(ObjClass* klass, ObjString* name, int argCount);
+    Value* setGlobal(Value* sp, int slot) {
+      if (globals_[slot].isUninitialized()) return undefinedVariable(sp, slot);
+      globals_[slot] = sp[-1];
+      return sp;
+    }
 
-    instruction readByte() {
-      return currentChunk().getCode(currentFrame().ip++);
+    Value* defineGlobal(Value* sp, int slot) {
+      globals_[slot] = sp[-1];
+      return sp - 1;
     }
 
-    uint16_t readShort() {
-      instruction firstByte = currentChunk().getCode(currentFrame().ip++);
-      instruction secondByte = currentChunk().getCode(currentFrame().ip++);
-      return (uint16_t)(firstByte << 8 | secondByte);
+    Value* getUpvalue(ObjClosure* closure, Value* sp, int slot) {
+      *sp++ = *closure->upvalue(slot)->location();
+      return sp;
     }
 
-    Value readConstant() {
-      return currentChunk().getConstant(readByte());
+    Value* setUpvalue(ObjClosure* closure, Value* sp, int slot) {
+      closure->upvalue(slot)->set(sp[-1]);
+      return sp;
     }
 
-    ObjString* readString() {
-      return readConstant().asString();
+    Value* getCaptured(ObjClosure* closure, Value* sp, int slot) {
+      *sp++ = closure->upvalues()[slot];
+      return sp;
     }
 
-    CallFrame& currentFrame() {
-      return frames_[frameCount_ - 1];
-    };
+    Value* closeUpvalue(Value* sp) {
+      closeUpvalues(sp - 1, sp);
+      return sp - 1;
+    }
 
-    const CallFrame& currentFrame() const {
-      return frames_[frameCount_ - 1];
-    };
+    Value* equal(Value* sp) {
+      sp[-2] = Bool(sp[-2] == sp[-1]).asValue();
+      return sp - 1;
+    }
 
-    ObjFunction* currentFn() const {
-      return currentFrame().closure->fn();
-    };
+    // OP_SUBTRACT, OP_MULTIPLY, OP_DIVIDE, OP_GREATER and OP_LESS.
+    Value* numberOp(Value* sp, instruction op) {
+      if (!sp[-1].isNumber() || !sp[-2].isNumber()) return notNumbers(sp);
+      Number b = sp[-1].asNumber();
+      Number a = sp[-2].asNumber();
+      switch (op) {
+        case OP_SUBTRACT: sp[-2] = (a - b).asValue(); break;
+        case OP_MULTIPLY: sp[-2] = (a * b).asValue(); break;
+        case OP_DIVIDE: sp[-2] = (a / b).asValue(); break;
+        case OP_GREATER: sp[-2] = Bool(a > b).asValue(); break;
+        case OP_LESS: sp[-2] = Bool(a < b).asValue(); break;
+        default: UNREACHABLE();
+      }
+      return sp - 1;
+    }
 
-    const Chunk& currentChunk() const {
-      return currentFn()->chunk();
-    };
+    Value* negate(Value* sp) {
+      if (!sp[-1].isNumber()) return operandError(sp, "Operand must be a number.");
+      sp[-1] = (-sp[-1].asNumber()).asValue();
+      return sp;
+    }
 
-    int currentStackStart() const {
-      return currentFrame().stackStart;
+    Value* addValues(Value* sp);
+    // OP_GET_PROPERTY and OP_SET_PROPERTY with the name in constant `constant` of `frame`'s
+    // function, whose property cache they update.
+    Value* getProperty(CallFrame* frame, Value* sp, int constant);
+    Value* setProperty(CallFrame* frame, Value* sp, int constant);
+    // Pushes a closure of `fn`, which captures the upvalues `captures` describes (see
+    // CaptureKind) from `frame`.
+    Value* makeClosure(CallFrame* frame, Value* sp, ObjFunction* fn, const instruction* captures);
+
+    // Report the runtime errors of the helpers above and return null.
+    Value* undefinedVariable(Value* sp, int slot);
+    Value* notNumbers(Value* sp) {
+      return operandError(sp, "Operands must be numbers.");
     }
+    Value* operandError(Value* sp, const char* message);
 
+    void defineMethod(ObjString* name);
+    // Gives every method name a dense index into the class dispatch tables.
+    int methodSelector(ObjString* name);
+    // Builds the dispatch table of `klass` once its body has defined its methods.
+    void finalizeClass(ObjClass* klass);
+    void createBoundMethod(Method method);
+
+    // Slow paths of OP_INVOKE and OP_SUPER_INVOKE. A method found in a class is added to `cache`
+    // under `key`.
+    bool invoke(ObjString* name, int argCount, InvokeCache& cache);
+    bool invokeFromClass(ObjClass* klass, ObjString* name, int argCount, InvokeCache& cache,
+                         const void* key);
+
+    // Updates the cached initializer of `klass` and drops every invoke cache entry if `klass` may
+    // be in one. Called once its dispatch table is built.
+    void methodsChanged(ObjClass* klass);
+
+    // Stack helpers for code outside of the interpreter loop. VM::run keeps its own cached stack
+    // pointer and syncs it with stackTop_ before calling into them.
     void push(Value value) {
-      // TODO: Consider the case stackTop_ exceeds the limit.
-      // https://github.com/si0005hp/lox/tree/weired-stacktop-bug
-      stack_[stackTop_++] = value;
+      if (stackTop_ == stackEnd_) growStack(stackTop_ - stack_ + 1);
+      *stackTop_++ = value;
     }
 
     Value pop() {
-      stackTop_--;
-      return stack_[stackTop_];
+      return *--stackTop_;
     }
 
     Value peek(int offset) const {
-      return stack_[stackTop_ - 1 - offset];
-    }
-
-    Value load(int index) const {
-      return stack_[index];
-    }
-
-    void store(int index, Value value) {
-      // Access from the tail if the index is negative
-      if (index < 0) index += stackTop_;
-      stack_[index] = value;
+      return stackTop_[-1 - offset];
     }
 
     ObjString* concatString(ObjString* left, ObjString* right); // TODO: Change place
 
    private:
-    Obj* objects_ = nullptr;
-
-    static constexpr int FRAMES_MAX = 64;
-    std::array<CallFrame, FRAMES_MAX> frames_;
+    // Declared first so that it goes away last, after every member that allocates from it.
+    Memory memory_;
+
+    // The collector is generational without moving objects. Objects are allocated young, and the
+    // ones a collection finds live are promoted to the old generation, where they stay marked
+    // until the next major collection. Minor collections mark from the roots and the remembered
+    // set, stopping at old objects, and sweep only the young generation.
+    Obj* objects_ = nullptr; // Old generation.
+    Obj* youngObjects_ = nullptr;
+    // What the last major collection left to sweep, from either generation. Marked objects in
+    // them are old.
+    Obj* unswept_ = nullptr;
+    Obj* unsweptYoung_ = nullptr;
+
+    // Both stacks start small and grow on demand. The value stack moves when it grows, so
+    // growStack() fixes up every pointer into it: frame slots, open upvalues and stackTop_. The
+    // interpreter loops reload their cached pointers after calls, the only place it can grow while
+    // they run.
+    static constexpr int INITIAL_FRAMES = 16;
+    CallFrame* frames_ = nullptr;
+    int frameCapacity_ = 0;
     int frameCount_ = 0;
-
-    static constexpr int STACK_MAX = FRAMES_MAX * 256;
-    std::array<Value, STACK_MAX> stack_;
-    int stackTop_ = 0;
+    // Frames below this one belong to a caller on the other tier (see callAcrossTiers), so
+    // returning to it ends the interpreter loop.
+    int baseFrame_ = 0;
+
+    static constexpr int INITIAL_STACK = 256;
+    // Slots reserved above each frame for values that VM helpers push as GC roots.
+    static constexpr int FRAME_STACK_RESERVE = 8;
+    Value* stack_ = nullptr;
+    Value* stackEnd_ = nullptr;
+    Value* stackTop_ = nullptr;
+    // The open upvalue of each value stack slot, or null. It parallels stack_ so that capturing
+    // and closing index it by slot instead of searching a list.
+    ObjUpvalue** openUpvalues_ = nullptr;
+    int openUpvalueCount_ = 0;
 
     StringTable strings_;
-    Map<StringKey, Value> globals_;
-
-    ObjUpvalue* openUpvalues_ = nullptr;
+    // Global variable values by slot. A slot holds an uninitialized Value until its variable is
+    // defined, which is how the interpreter reports undefined variables.
+    Vector<Value> globals_;
+    Vector<ObjString*> globalNames_;
+    Map<StringKey, int> globalSlots_;
 
     std::ostream& out_;
+    VMConfig config_;
 
     // Pointer to the Compiler that is currently compiling.
     Compiler* compiler_ = nullptr;
+    RegisterCompiler* registerCompiler_ = nullptr;
 
     // Gray stack has to use bare reallocator to avoid calling new GC recursively (causing infinite
     // loop).
     Vector<Obj*, Memory::DefaultReallocator> gcGrayStack_;
+    // Old objects that got references to young ones since the last collection.
+    Vector<Obj*, Memory::DefaultReallocator> gcRememberedSet_;
+    // Started by the first collection that marks in parallel.
+    ParallelMarker* gcMarker_ = nullptr;
+    // Set while gcMarker_ runs, when marks are set atomically.
+    bool gcMarkingInParallel_ = false;
 
     ObjString* initString_ = nullptr;
+
+    // Invoke caches are valid only for the epoch they were filled in.
+    uint32_t methodEpoch_ = 0;
+    // Number of method names given a selector so far.
+    int selectorCount_ = 0;
+
+    int jitCompiledFunctions_ = 0;
+    int compiledTraces_ = 0;
+
+#ifdef PROFILE_OPCODES
+    OpcodeProfile opcodeProfile_;
+    CacheStats propertyCacheStats_;
+    CacheStats invokeCacheStats_;
+#endif
   };
 } // namespace lox
@@ -0,0 +1,284 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lib/vector.h"
+#include "memory.h"
+
+#if defined(__x86_64__) && defined(__unix__)
+#define JIT_X64
+#include <sys/mman.h>
+#endif
+
+namespace lox {
+
+#ifdef JIT_X64
+
+  enum Reg {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+  };
+
+  enum Xmm {
+    XMM0, XMM1, XMM2, XMM3, XMM4, XMM5, XMM6, XMM7,
+    XMM8, XMM9, XMM10, XMM11, XMM12, XMM13, XMM14, XMM15
+  };
+
+  // Condition codes of Jcc and SETcc.
+  enum Cond {
+    COND_E = 0x4,
+    COND_NE = 0x5,
+    COND_BE = 0x6,
+    COND_A = 0x7,
+    COND_P = 0xa,
+    COND_NP = 0xb,
+  };
+
+  // Encodes the few x86-64 instructions the native code generators use. Memory operands are
+  // always [base + disp32].
+  class Assembler {
+   public:
+    // Copies the code into a new executable mapping. Returns null if it can't be mapped.
+    void* install() const {
+      size_t size = code_.size();
+      void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (memory == MAP_FAILED) return nullptr;
+      memcpy(memory, code_.data(), size);
+      if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, size);
+        return nullptr;
+      }
+      return memory;
+    }
+
+    static void uninstall(void* memory, size_t size) {
+      munmap(memory, size);
+    }
+
+    int offset() const {
+      return code_.size();
+    }
+
+    const uint8_t* code() const {
+      return code_.data();
+    }
+
+    void push(Reg reg) {
+      if (reg >= R8) byte(0x41);
+      byte(0x50 + (reg & 7));
+    }
+
+    void pop(Reg reg) {
+      if (reg >= R8) byte(0x41);
+      byte(0x58 + (reg & 7));
+    }
+
+    void ret() {
+      byte(0xc3);
+    }
+
+    void movImm(Reg dst, uint64_t imm) {
+      rex(true, 0, dst);
+      byte(0xb8 + (dst & 7));
+      for (int i = 0; i < 8; i++) byte((uint8_t)(imm >> (i * 8)));
+    }
+
+    void mov(Reg dst, Reg src) {
+      alu(0x89, dst, src);
+    }
+
+    void load(Reg dst, Reg base, int32_t disp) {
+      rex(true, dst, base);
+      byte(0x8b);
+      memOperand(dst, base, disp);
+    }
+
+    void store(Reg base, int32_t disp, Reg src) {
+      rex(true, src, base);
+      byte(0x89);
+      memOperand(src, base, disp);
+    }
+
+    void add(Reg dst, Reg src) {
+      alu(0x01, dst, src);
+    }
+
+    void and_(Reg dst, Reg src) {
+      alu(0x21, dst, src);
+    }
+
+    void xor_(Reg dst, Reg src) {
+      alu(0x31, dst, src);
+    }
+
+    void cmp(Reg left, Reg right) {
+      alu(0x39, left, right);
+    }
+
+    void test(Reg left, Reg right) {
+      alu(0x85, left, right);
+    }
+
+    void addImm(Reg dst, int32_t imm) {
+      immOp(0, dst, imm);
+    }
+
+    void subImm(Reg dst, int32_t imm) {
+      immOp(5, dst, imm);
+    }
+
+    // movq xmm, r64 and movq r64, xmm.
+    void movq(Xmm dst, Reg src) {
+      byte(0x66);
+      rex(true, dst, src);
+      byte(0x0f);
+      byte(0x6e);
+      modrm(3, dst, src);
+    }
+
+    void movq(Reg dst, Xmm src) {
+      byte(0x66);
+      rex(true, src, dst);
+      byte(0x0f);
+      byte(0x7e);
+      modrm(3, src, dst);
+    }
+
+    void movapd(Xmm dst, Xmm src) {
+      sse(0x66, 0x28, dst, src);
+    }
+
+    void xorpd(Xmm dst, Xmm src) {
+      sse(0x66, 0x57, dst, src);
+    }
+
+    void addsd(Xmm dst, Xmm src) {
+      sse(0xf2, 0x58, dst, src);
+    }
+
+    void subsd(Xmm dst, Xmm src) {
+      sse(0xf2, 0x5c, dst, src);
+    }
+
+    void mulsd(Xmm dst, Xmm src) {
+      sse(0xf2, 0x59, dst, src);
+    }
+
+    void divsd(Xmm dst, Xmm src) {
+      sse(0xf2, 0x5e, dst, src);
+    }
+
+    void ucomisd(Xmm left, Xmm right) {
+      sse(0x66, 0x2e, left, right);
+    }
+
+    // Sets the low byte of RAX or RCX.
+    void setcc(Cond cond, Reg dst) {
+      byte(0x0f);
+      byte(0x90 + cond);
+      modrm(3, 0, dst);
+    }
+
+    // and al, cl / or al, cl
+    void andAlCl() {
+      byte(0x20);
+      byte(0xc8);
+    }
+
+    void orAlCl() {
+      byte(0x08);
+      byte(0xc8);
+    }
+
+    // movzx eax, al
+    void movzxEaxAl() {
+      byte(0x0f);
+      byte(0xb6);
+      byte(0xc0);
+    }
+
+    void call(Reg target) {
+      rex(false, 0, target);
+      byte(0xff);
+      modrm(3, 2, target);
+    }
+
+    void jmp(Reg target) {
+      rex(false, 0, target);
+      byte(0xff);
+      modrm(3, 4, target);
+    }
+
+    // Jumps return the offset of their rel32 operand, to be given to patch().
+    int jmp() {
+      byte(0xe9);
+      return rel32();
+    }
+
+    int jcc(Cond cond) {
+      byte(0x0f);
+      byte(0x80 + cond);
+      return rel32();
+    }
+
+    void patch(int at, int target) {
+      int32_t rel = target - (at + 4);
+      for (int i = 0; i < 4; i++) code_[at + i] = (uint8_t)(rel >> (i * 8));
+    }
+
+   private:
+    void byte(uint8_t b) {
+      code_.push(b);
+    }
+
+    int rel32() {
+      int at = offset();
+      for (int i = 0; i < 4; i++) byte(0);
+      return at;
+    }
+
+    void rex(bool wide, int reg, int rm) {
+      uint8_t prefix = 0x40 | (wide ? 8 : 0) | (reg >= 8 ? 4 : 0) | (rm >= 8 ? 1 : 0);
+      if (prefix != 0x40) byte(prefix);
+    }
+
+    void modrm(int mod, int reg, int rm) {
+      byte((uint8_t)(mod << 6 | (reg & 7) << 3 | (rm & 7)));
+    }
+
+    void memOperand(int reg, Reg base, int32_t disp) {
+      modrm(2, reg, base);
+      if ((base & 7) == RSP) byte(0x24); // RSP and R12 need a SIB byte.
+      for (int i = 0; i < 4; i++) byte((uint8_t)(disp >> (i * 8)));
+    }
+
+    // op r/m64, r64
+    void alu(uint8_t op, Reg dst, Reg src) {
+      rex(true, src, dst);
+      byte(op);
+      modrm(3, src, dst);
+    }
+
+    void immOp(int ext, Reg dst, int32_t imm) {
+      rex(true, 0, dst);
+      byte(0x81);
+      modrm(3, ext, dst);
+      for (int i = 0; i < 4; i++) byte((uint8_t)(imm >> (i * 8)));
+    }
+
+    void sse(uint8_t prefix, uint8_t op, Xmm dst, Xmm src) {
+      byte(prefix);
+      rex(false, dst, src);
+      byte(0x0f);
+      byte(op);
+      modrm(3, dst, src);
+    }
+
+   private:
+    Vector<uint8_t, Memory::DefaultReallocator> code_;
+  };
+
+#endif
+
+} // namespace lox
@@ -0,0 +1,269 @@
+#include <sstream>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "memory.h"
+#include "test_common.h"
+#include "vm.h"
+
+using namespace lox;
+
+class GCTest : public TestBase {
+ public:
+  static VMConfig smallHeapConfig() {
+    VMConfig config;
+    config.gcMinHeapSize = 64 * 1024;
+    return config;
+  }
+
+ public:
+  std::ostringstream out_;
+};
+
+TEST_F(GCTest, FreeingGivesBackEveryByte) {
+  VM vm(out_);
+  size_t before = vm.memory().totalBytesAllocated();
+  {
+    // A VM of its own, whose allocations and frees are none of the first one's.
+    std::ostringstream out;
+    VM other(out);
+    ASSERT_EQ(other.interpret("class A { init(n) { this.n = n; this.s = \"x\" + \"y\"; } }"
+                              "class B < A { get() { return this.n; } }"
+                              "var list = nil;"
+                              "for (var i = 0; i < 100; i = i + 1) {"
+                              "  var b = B(i);"
+                              "  b.f1 = 1; b.f2 = 2; b.f3 = 3; b.f4 = 4; b.f5 = 5;"
+                              "  fun keep() { return b; }"
+                              "  list = keep;"
+                              "}"
+                              "print list().get();"),
+              INTERPRET_OK);
+    ASSERT_EQ(out.str(), "99\n");
+    ASSERT_GT(other.memory().totalBytesAllocated(), before);
+  }
+  ASSERT_EQ(vm.memory().totalBytesAllocated(), before);
+}
+
+TEST_F(GCTest, VMsCollectOnlyTheirOwnObjects) {
+  VM a(out_, smallHeapConfig());
+  std::ostringstream out;
+  VM b(out, smallHeapConfig());
+  const char* source = "class P { init(x) { this.x = x; } }"
+                       "var kept = P(\"kept\");"
+                       "for (var i = 0; i < 20000; i = i + 1) P(i);"
+                       "print kept.x;";
+  // Each VM collects while the other holds objects and sits between collections.
+  ASSERT_EQ(a.interpret(source), INTERPRET_OK);
+  int aCount = a.memory().gcCount();
+  ASSERT_EQ(b.interpret(source), INTERPRET_OK);
+  ASSERT_EQ(a.memory().gcCount(), aCount);
+  ASSERT_GT(b.memory().gcCount(), 0);
+  ASSERT_EQ(a.interpret("print kept.x;"), INTERPRET_OK);
+  ASSERT_EQ(out_.str(), "kept\nkept\n");
+  ASSERT_EQ(out.str(), "kept\n");
+
+  // A VM going away leaves the other one collecting.
+  {
+    std::ostringstream out;
+    VM c(out);
+  }
+  ASSERT_EQ(a.interpret(source), INTERPRET_OK);
+  ASSERT_GT(a.memory().gcCount(), aCount);
+  ASSERT_LT(a.memory().totalBytesAllocated(), 1 << 20);
+}
+
+TEST_F(GCTest, AllocationTriggersCollection) {
+  VM vm(out_, smallHeapConfig());
+  int before = vm.memory().gcCount();
+  ASSERT_EQ(vm.interpret("class P { init(x) { this.x = x; } }"
+                         "var kept;"
+                         "for (var i = 0; i < 20000; i = i + 1) {"
+                         "  var p = P(\"a\" + \"b\");"
+                         "  if (i == 100) kept = p;"
+                         "}"
+                         "print kept.x;"),
+            INTERPRET_OK);
+  ASSERT_EQ(out_.str(), "ab\n");
+  ASSERT_GT(vm.memory().gcCount(), before);
+  // The instances alone took megabytes; the heap stays within a few collection thresholds.
+  ASSERT_LT(vm.memory().totalBytesAllocated(), 1 << 20);
+}
+
+TEST_F(GCTest, MinorCollectionsFreeYoungGarbage) {
+  VMConfig config;
+  config.gcMinHeapSize = 64 << 20;
+  config.gcNurserySize = 16 * 1024;
+  VM vm(out_, config);
+  ASSERT_EQ(vm.interpret("class P { init(x) { this.x = x; } }"
+                         "for (var i = 0; i < 20000; i = i + 1) P(i);"),
+            INTERPRET_OK);
+  ASSERT_GT(vm.memory().minorGCCount(), 0);
+#ifndef DEBUG_STRESS_GC
+  // The heap never gets near gcMinHeapSize, so no collection was major.
+  ASSERT_EQ(vm.memory().gcCount(), vm.memory().minorGCCount());
+#endif
+  ASSERT_LT(vm.memory().totalBytesAllocated(), 1 << 20);
+}
+
+TEST_F(GCTest, OldObjectsKeepTheYoungObjectsStoredInThem) {
+  VMConfig config;
+  config.gcMinHeapSize = 64 << 20;
+  config.gcNurserySize = 4 * 1024;
+  VM vm(out_, config);
+  // `head` and the closure's upvalue are promoted early on; afterwards each new node is referenced
+  // only from an old object until the next one is added.
+  ASSERT_EQ(vm.interpret("class Node { init(n, next) { this.n = n; this.next = next; } }"
+                         "fun sum(node) {"
+                         "  var total = 0;"
+                         "  for (; node; node = node.next) total = total + node.n;"
+                         "  return total;"
+                         "}"
+                         "var head = Node(0, nil);"
+                         "fun makeCell() {"
+                         "  var value;"
+                         "  fun cell(v) { if (v) value = v; return value; }"
+                         "  return cell;"
+                         "}"
+                         "var cell = makeCell();"
+                         "for (var i = 1; i <= 500; i = i + 1) {"
+                         "  head.next = Node(i, head.next);"
+                         "  cell(Node(-i, cell(nil)));"
+                         "  Node(nil, nil);"
+                         "}"
+                         "for (var i = 0; i < 500; i = i + 1) Node(nil, nil);"
+                         "print sum(head);"
+                         "print sum(cell(nil));"),
+            INTERPRET_OK);
+  ASSERT_EQ(out_.str(), "125250\n-125250\n");
+}
+
+TEST_F(GCTest, IncrementalMarkingKeepsWhatTheProgramStores) {
+  VMConfig config;
+  config.gcIncremental = true;
+  config.gcSliceBudget = 8;
+  config.gcNurserySize = 0; // Every collection is major.
+  config.gcMinHeapSize = 16 * 1024;
+  config.gcHeapGrowthFactor = 1.0; // A new cycle starts as soon as the previous one ends.
+  VM vm(out_, config);
+  int before = vm.memory().gcCount();
+  // Nodes move back and forth between two lists while cycles come and go. The roots are traced in
+  // reverse, so `b` is traced first and `a` only after the long `ballast`; meanwhile nodes the
+  // marker hasn't reached move from `a` to `b`, which it has.
+  ASSERT_EQ(vm.interpret("class Node { init(n, next) { this.n = n; this.next = next; } }"
+                         "class Box {}"
+                         "fun sum(node) {"
+                         "  var total = 0;"
+                         "  for (; node; node = node.next) total = total + node.n;"
+                         "  return total;"
+                         "}"
+                         "fun move(from, to) {"
+                         "  while (from.list) {"
+                         "    var node = from.list;"
+                         "    from.list = node.next;"
+                         "    node.next = to.list;"
+                         "    to.list = node;"
+                         "    Node(nil, nil);"
+                         "  }"
+                         "}"
+                         "var a = Box();"
+                         "a.list = nil;"
+                         "for (var i = 1; i <= 3000; i = i + 1) a.list = Node(i, a.list);"
+                         "var ballast;"
+                         "for (var i = 0; i < 20000; i = i + 1) ballast = Node(i, ballast);"
+                         "var b = Box();"
+                         "b.list = nil;"
+                         "for (var i = 0; i < 10; i = i + 1) {"
+                         "  move(a, b);"
+                         "  move(b, a);"
+                         "}"
+                         "print sum(a.list) == 4501500;"),
+            INTERPRET_OK);
+  ASSERT_EQ(out_.str(), "true\n");
+  ASSERT_GT(vm.memory().gcCount(), before);
+  ASSERT_GT(vm.memory().maxGCPauseNanos(), 0u);
+}
+
+TEST_F(GCTest, ParallelMarking) {
+  VMConfig config;
+  config.gcMarkThreads = 4;
+  config.gcNurserySize = 0; // Every collection is major.
+  config.gcMinHeapSize = 16 * 1024;
+  VM vm(out_, config);
+  int before = vm.memory().gcCount();
+  ASSERT_EQ(vm.interpret("class Tree {"
+                         "  init(depth) {"
+                         "    if (depth > 0) {"
+                         "      this.left = Tree(depth - 1);"
+                         "      this.right = Tree(depth - 1);"
+                         "    } else {"
+                         "      this.left = nil;"
+                         "      this.right = nil;"
+                         "    }"
+                         "  }"
+                         "  count() {"
+                         "    if (!this.left) return 1;"
+                         "    return 1 + this.left.count() + this.right.count();"
+                         "  }"
+                         "}"
+                         "var trees = Tree(0);"
+                         "for (var i = 0; i < 20; i = i + 1) {"
+                         "  var tree = Tree(10);"
+                         "  if (i < 4) { tree.next = trees; trees = tree; }"
+                         "}"
+                         "var total = 0;"
+                         "for (; trees.left; trees = trees.next) total = total + trees.count();"
+                         "print total;"),
+            INTERPRET_OK);
+  ASSERT_EQ(out_.str(), "8188\n");
+  ASSERT_GT(vm.memory().gcCount(), before);
+}
+
+TEST_F(GCTest, LazySweepingFreesGarbageBetweenAllocations) {
+  VMConfig config;
+  config.gcSliceBudget = 16;
+  config.gcNurserySize = 0; // Every collection is major.
+  config.gcMinHeapSize = 16 * 1024;
+  VM vm(out_, config);
+  int before = vm.memory().gcCount();
+  // Strings built anew while the last collection's are still being swept must not find the dead
+  // ones in the string table, and the nodes kept must survive being swept in small steps.
+  ASSERT_EQ(vm.interpret("class Node { init(s, next) { this.s = s; this.next = next; } }"
+                         "var kept;"
+                         "for (var i = 0; i < 20000; i = i + 1) {"
+                         "  var node = Node(\"a\" + \"b\", nil);"
+                         "  if (i < 1000) { node.next = kept; kept = node; }"
+                         "}"
+                         "var count = 0;"
+                         "for (; kept; kept = kept.next) if (kept.s == \"ab\") count = count + 1;"
+                         "print count;"),
+            INTERPRET_OK);
+  ASSERT_EQ(out_.str(), "1000\n");
+  ASSERT_GT(vm.memory().gcCount(), before);
+  ASSERT_LT(vm.memory().totalBytesAllocated(), 1 << 20);
+}
+
+TEST_F(GCTest, SliceBudgetsBelowOneStillMakeProgress) {
+  for (int budget : {0, -5}) {
+    VMConfig config;
+    config.gcIncremental = true;
+    config.gcSliceBudget = budget;
+    config.gcNurserySize = 0; // Every collection is major.
+    config.gcMinHeapSize = 16 * 1024;
+    std::ostringstream out;
+    VM vm(out, config);
+    ASSERT_EQ(vm.interpret("class Node { init(next) { this.next = next; } }"
+                           "var kept = nil;"
+                           "for (var i = 0; i < 20000; i = i + 1) {"
+                           "  var node = Node(nil);"
+                           "  if (i < 100) { node.next = kept; kept = node; }"
+                           "}"
+                           "var count = 0;"
+                           "for (; kept; kept = kept.next) count = count + 1;"
+                           "print count;"),
+              INTERPRET_OK);
+    ASSERT_EQ(out.str(), "100\n");
+    // Cycles still finish, one object per slice or sweep step.
+    ASSERT_GT(vm.memory().gcCount(), 1);
+    ASSERT_LT(vm.memory().totalBytesAllocated(), 1 << 20);
+  }
+}
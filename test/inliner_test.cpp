@@ -0,0 +1,78 @@
+#include "inliner.h"
+
+#include <sstream>
+#include <string>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "test_common.h"
+#include "vm.h"
+
+using namespace lox;
+
+class InlinerTest : public TestBase {
+ public:
+  InlinerTest()
+    : vm_(out_) {}
+
+  // Runs `source` on a VM of its own and returns what it reported on stderr.
+  static std::string errorOutput(const char* source, bool inlining) {
+    std::ostringstream out;
+    VMConfig config;
+    config.inlining = inlining;
+    VM vm(out, config);
+    testing::internal::CaptureStderr();
+    vm.interpret(source);
+    return testing::internal::GetCapturedStderr();
+  }
+
+ public:
+  std::ostringstream out_;
+  VM vm_;
+};
+
+TEST_F(InlinerTest, RedefinedCalleeIsCalled) {
+  ASSERT_EQ(vm_.interpret("fun f() { return 1; } fun g() { return f(); } print g();"),
+            INTERPRET_OK);
+  // Globals outlive the script, so a later one can redefine the function inlined into g.
+  ASSERT_EQ(vm_.interpret("fun f() { return 2; } print g();"), INTERPRET_OK);
+  ASSERT_EQ(out_.str(), "1\n2\n");
+}
+
+TEST_F(InlinerTest, AssignedCalleeIsCalled) {
+  ASSERT_EQ(vm_.interpret("fun f() { return 1; } fun g() { return f(); } print g();"),
+            INTERPRET_OK);
+  testing::internal::CaptureStderr();
+  ASSERT_EQ(vm_.interpret("f = nil; print g();"), INTERPRET_RUNTIME_ERROR);
+  EXPECT_THAT(testing::internal::GetCapturedStderr(),
+              testing::StartsWith("Can only call functions and classes."));
+}
+
+TEST_F(InlinerTest, ArgumentsAreEvaluatedInOrder) {
+  ASSERT_EQ(vm_.interpret("var log = \"\";"
+                          "fun note(s) { log = log + s; return s; }"
+                          "fun concat(a, b) { return b + a; }"
+                          "print concat(note(\"a\"), note(\"b\"));"
+                          "print log;"),
+            INTERPRET_OK);
+  ASSERT_EQ(out_.str(), "ba\nab\n");
+
+  const char* undefined = "fun f(a, b) { return b + a; } print f(undefinedA, undefinedB);";
+  EXPECT_THAT(errorOutput(undefined, true), testing::StartsWith("Undefined variable 'undefinedA'."));
+  const char* properties = "class P {} fun f(a, b) { return b + a; } var p = P(); print f(p.x, p.y);";
+  EXPECT_THAT(errorOutput(properties, true), testing::StartsWith("Undefined property 'x'."));
+}
+
+TEST_F(InlinerTest, RuntimeErrorReportsInlinedFrames) {
+  const char* source = "fun inc(a) { return a + 1; }\n"
+                       "fun twice(a) { return inc(inc(a)); }\n"
+                       "fun g() {\n"
+                       "  print twice(nil);\n"
+                       "}\n"
+                       "g();\n";
+  std::string trace = errorOutput(source, true);
+  EXPECT_THAT(trace, testing::HasSubstr("[line 1] in <fn inc>\n"
+                                        "[line 2] in <fn twice>\n"
+                                        "[line 4] in <fn g>\n"));
+  EXPECT_EQ(trace, errorOutput(source, false));
+}
@@ -23,6 +23,56 @@ class IntegrationTest : public TestBase {
     std::ostringstream testOut;
     Lox::runFile(testPath(fileName).c_str(), testOut);
     ASSERT_EQ(expected, testOut.str());
+
+    // Every script must behave the same on the register tier, including the ones it hands back to
+    // the stack interpreter.
+    VMConfig registerTier;
+    registerTier.registerTier = true;
+    std::ostringstream registerOut;
+    Lox::runFile(testPath(fileName).c_str(), registerOut, registerTier);
+    ASSERT_EQ(expected, registerOut.str());
+
+    // Inlining must not change what a script does.
+    VMConfig noInlining;
+    noInlining.inlining = false;
+    std::ostringstream noInliningOut;
+    Lox::runFile(testPath(fileName).c_str(), noInliningOut, noInlining);
+    ASSERT_EQ(expected, noInliningOut.str());
+
+    // Neither must the Jit, here compiling every function as soon as it runs.
+    VMConfig jit;
+    jit.jit = true;
+    jit.jitThreshold = 1;
+    std::ostringstream jitOut;
+    Lox::runFile(testPath(fileName).c_str(), jitOut, jit);
+    ASSERT_EQ(expected, jitOut.str());
+
+    // Nor traces, recorded for every loop on its first back edge.
+    VMConfig tracing;
+    tracing.tracing = true;
+    tracing.traceThreshold = 1;
+    std::ostringstream tracingOut;
+    Lox::runFile(testPath(fileName).c_str(), tracingOut, tracing);
+    ASSERT_EQ(expected, tracingOut.str());
+
+    // Nor collecting garbage incrementally, with slices as small as they get.
+    VMConfig incremental;
+    incremental.gcIncremental = true;
+    incremental.gcSliceBudget = 1;
+    incremental.gcNurserySize = 0;
+    incremental.gcMinHeapSize = 0;
+    std::ostringstream incrementalOut;
+    Lox::runFile(testPath(fileName).c_str(), incrementalOut, incremental);
+    ASSERT_EQ(expected, incrementalOut.str());
+
+    // Nor marking on several threads.
+    VMConfig parallel;
+    parallel.gcMarkThreads = 4;
+    parallel.gcNurserySize = 0;
+    parallel.gcMinHeapSize = 0;
+    std::ostringstream parallelOut;
+    Lox::runFile(testPath(fileName).c_str(), parallelOut, parallel);
+    ASSERT_EQ(expected, parallelOut.str());
   }
 };
 
@@ -53,3 +103,20 @@ INTEGRATION_TEST(base\n, call_super)
 INTEGRATION_TEST(base\nderived\n, call_super_override)
 INTEGRATION_TEST(A method\n, call_super_nest)
 INTEGRATION_TEST(A method\n, super_bound_method)
+INTEGRATION_TEST(10\n5\n4\nstring\n5\n, superinstructions)
+INTEGRATION_TEST(kept\nboth\ntrue\nfalse\ntrue\n-2\n4\ninner!\n12\n<fn logical>\n, register_tier)
+INTEGRATION_TEST(3\nab\n7\ntrue\ntrue\nfalse\nfalse\nababab\n, quickening)
+INTEGRATION_TEST(1\n3\n6\n10\nfield\n21\npq\n, shape)
+INTEGRATION_TEST(ABCDEAABCDEA\nfield\nA\n, invoke_cache)
+INTEGRATION_TEST(first\nsecond\nredefined\nlocal\nredefined\n, global)
+INTEGRATION_TEST(20000\ncaptured!\ncaptured\nopen\n, deep_recursion)
+INTEGRATION_TEST(500500\ndone\ntrue\n300000\nvalue closed\n7\n, tail_call)
+INTEGRATION_TEST(499500\ntrue\n<native fn>\ntrue\ntrue\n, native)
+INTEGRATION_TEST(7\nab!!\n10\nliftoff\n10\nhi alice\n, closure_capture)
+INTEGRATION_TEST(inner!\nouter?\nouter??\n150\n, upvalue_close)
+INTEGRATION_TEST(12\n21\n8\n4\nn\nPlain instance\n, initializer)
+INTEGRATION_TEST(hi from A\nhi from B\nhi from B\nhi from B!\nB\nOther\nfield\n, vtable)
+INTEGRATION_TEST(49\n7\n25\na\n3\n9\n36\n8\n9\n0\n2\n10\n15\n100\n285\n, inline)
+INTEGRATION_TEST(20\n70\n20\ntrue\nEmpty instance\n5\ndone\n, call_arity)
+INTEGRATION_TEST(-67.5\nfirst\nsecond\ntrue\ntrue\nfalse\nfalse\nfalse\nfalse\nfalse\nfalse\nfalse\ntrue\ntrue\nhey!hey\n2\n20\n34\n5.0005e+07\n6765\n, jit)
+INTEGRATION_TEST(499500\n100053\n-120\n0\n5\n3\n0\n, trace)
@@ -0,0 +1,85 @@
+#include "jit.h"
+
+#include <sstream>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "test_common.h"
+#include "vm.h"
+
+using namespace lox;
+
+class JitTest : public TestBase {
+ public:
+  JitTest()
+    : vm_(out_, jitConfig()) {}
+
+  static VMConfig jitConfig() {
+    VMConfig config;
+    config.jit = true;
+    config.jitThreshold = 10;
+    return config;
+  }
+
+ public:
+  std::ostringstream out_;
+  VM vm_;
+};
+
+#ifdef __x86_64__
+
+TEST_F(JitTest, CompilesHotFunctions) {
+  ASSERT_EQ(vm_.interpret("fun square(x) { var y = x * x; return y; }"
+                          "var sum = 0;"
+                          "for (var i = 0; i < 100; i = i + 1) sum = sum + square(i);"
+                          "print sum;"),
+            INTERPRET_OK);
+  ASSERT_EQ(out_.str(), "328350\n");
+  // The loop makes the script hot as well as the function it calls. (Their bodies are too big for
+  // the Inliner.)
+  ASSERT_EQ(vm_.jitCompiledFunctions(), 2);
+}
+
+TEST_F(JitTest, ColdFunctionsStayInterpreted) {
+  ASSERT_EQ(vm_.interpret("fun f() { return 1; } print f() + f();"), INTERPRET_OK);
+  ASSERT_EQ(out_.str(), "2\n");
+  ASSERT_EQ(vm_.jitCompiledFunctions(), 0);
+}
+
+TEST_F(JitTest, RuntimeErrorInNativeCode) {
+  ASSERT_EQ(vm_.interpret("fun f(x) { var y = x - 1; return y; }"
+                          "for (var i = 0; i < 20; i = i + 1) f(i);"
+                          "f(\"one\");"),
+            INTERPRET_RUNTIME_ERROR);
+  ASSERT_EQ(vm_.jitCompiledFunctions(), 2);
+}
+
+TEST_F(JitTest, GlobalsAddedAfterCompiling) {
+  ASSERT_EQ(vm_.interpret("var a = 1;"
+                          "fun get() { var v = a; return v; }"
+                          "for (var i = 0; i < 20; i = i + 1) get();"),
+            INTERPRET_OK);
+  // Defining more globals moves their values; the compiled function must still find `a`.
+  ASSERT_EQ(vm_.interpret("var b1 = 1; var b2 = 2; var b3 = 3; var b4 = 4; var b5 = 5;"
+                          "var b6 = 6; var b7 = 7; var b8 = 8; var b9 = 9; var b10 = 10;"
+                          "var b11 = 11; var b12 = 12; var b13 = 13; var b14 = 14; var b15 = 15;"
+                          "var b16 = 16; var b17 = 17; var b18 = 18; var b19 = 19; var b20 = 20;"
+                          "a = 42;"
+                          "print get();"),
+            INTERPRET_OK);
+  ASSERT_EQ(out_.str(), "42\n");
+}
+
+TEST_F(JitTest, RedefinedInlinedCallee) {
+  ASSERT_EQ(vm_.interpret("fun f(x) { return x + 1; }"
+                          "fun g(x) { var y = f(x); return y; }"
+                          "for (var i = 0; i < 20; i = i + 1) g(i);"
+                          "print g(1);"),
+            INTERPRET_OK);
+  ASSERT_EQ(vm_.jitCompiledFunctions(), 2);
+  // The native code of g still checks that f is the function inlined into it.
+  ASSERT_EQ(vm_.interpret("fun f(x) { return x + 2; } print g(1);"), INTERPRET_OK);
+  ASSERT_EQ(out_.str(), "2\n3\n");
+}
+
+#endif
@@ -121,3 +121,19 @@ TEST_F(MapTest, putAll) {
   ASSERT_TRUE(dst.get(2, &v2));
   ASSERT_EQ(v2, 200);
 }
+
+TEST_F(MapTest, size) {
+  Map<IntKey, int> map;
+  map.put(1, 100);
+  map.put(2, 200);
+  ASSERT_EQ(map.size(), 2);
+
+  // overwrite
+  map.put(2, 300);
+  ASSERT_EQ(map.size(), 2);
+
+  // grow
+  for (int i = 3; i <= 20; i++) map.put(i, i);
+  ASSERT_EQ(map.size(), 20);
+  ASSERT_EQ(map.capacity(), 32);
+}
@@ -28,3 +28,104 @@ TEST_F(ObjectTest, String_) {
   s = vm_.allocateObj<ObjString>("foo", 3);
   assertString(s, "foo", 3, 2851307223);
 }
+
+TEST_F(ObjectTest, Shape_) {
+  ObjClass* klass = vm_.allocateObj<ObjClass>(vm_.allocateObj<ObjString>("Foo", 3));
+  ObjString* x = vm_.allocateObj<ObjString>("x", 1);
+  ObjString* y = vm_.allocateObj<ObjString>("y", 1);
+
+  Shape* root = klass->rootShape();
+  ASSERT_EQ(root->slotCount(), 0);
+  ASSERT_EQ(root->findSlot(x), -1);
+
+  // Adding the same field twice follows the same transition.
+  Shape* shapeX = root->transition(x);
+  ASSERT_EQ(root->transition(x), shapeX);
+  ASSERT_EQ(shapeX->slotCount(), 1);
+  ASSERT_EQ(shapeX->findSlot(x), 0);
+
+  Shape* shapeXY = shapeX->transition(y);
+  Shape* shapeYX = root->transition(y)->transition(x);
+  ASSERT_NE(shapeXY, shapeYX);
+  ASSERT_EQ(shapeXY->findSlot(y), 1);
+  ASSERT_EQ(shapeYX->findSlot(y), 0);
+}
+
+TEST_F(ObjectTest, Shape_manyFields) {
+  ObjClass* klass = vm_.allocateObj<ObjClass>(vm_.allocateObj<ObjString>("Foo", 3));
+
+  const char* names[] = {"a", "b", "c", "d", "e", "f", "g", "h", "i", "j", "k", "l"};
+  Shape* shape = klass->rootShape();
+  for (const char* name : names) {
+    shape = shape->transition(vm_.allocateObj<ObjString>(name, 1));
+  }
+  ASSERT_EQ(shape->slotCount(), 12);
+  for (int i = 0; i < 12; i++) {
+    ASSERT_EQ(shape->findSlot(vm_.allocateObj<ObjString>(names[i], 1)), i);
+  }
+  ASSERT_EQ(shape->findSlot(vm_.allocateObj<ObjString>("z", 1)), -1);
+}
+
+static bool sumNative(VM& vm, Value* args, int argCount, Value* result) {
+  if (!args[0].isNumber() || !args[1].isNumber()) {
+    vm.runtimeError("Arguments must be numbers.");
+    return false;
+  }
+  *result = (args[0].asNumber() + args[1].asNumber()).asValue();
+  return true;
+}
+
+TEST_F(ObjectTest, Native_) {
+  for (bool registerTier : {false, true}) {
+    std::ostringstream out;
+    VMConfig config;
+    config.registerTier = registerTier;
+    VM vm(out, config);
+    vm.defineNative("sum", sumNative, 2);
+
+    ASSERT_EQ(vm.interpret("var s = sum; print s(1, sum(2, 3)); print s;"), INTERPRET_OK);
+    ASSERT_EQ(out.str(), "6\n<native fn>\n");
+    ASSERT_EQ(vm.interpret("sum(1);"), INTERPRET_RUNTIME_ERROR);
+    ASSERT_EQ(vm.interpret("sum(1, nil);"), INTERPRET_RUNTIME_ERROR);
+  }
+}
+
+TEST_F(ObjectTest, Closure_arity) {
+  std::ostringstream out;
+  VM vm(out);
+
+  ASSERT_EQ(vm.interpret("fun f(a, b) { return a + b; }"
+                         "class A { m(x) { return x; } }"
+                         "class B { m() { return 0; } }"
+                         "fun call(o) { return o.m(1); }"
+                         "print f(1, 2); print call(A());"),
+            INTERPRET_OK);
+  ASSERT_EQ(out.str(), "3\n1\n");
+  // Calls that take the fast paths once their callee is known still check the argument count.
+  ASSERT_EQ(vm.interpret("f(1);"), INTERPRET_RUNTIME_ERROR);
+  ASSERT_EQ(vm.interpret("f(1, 2, 3);"), INTERPRET_RUNTIME_ERROR);
+  ASSERT_EQ(vm.interpret("call(B());"), INTERPRET_RUNTIME_ERROR);
+  ASSERT_EQ(vm.interpret("print call(A());"), INTERPRET_OK);
+  ASSERT_EQ(out.str(), "3\n1\n1\n");
+}
+
+TEST_F(ObjectTest, Closure_acrossTiers) {
+  std::ostringstream out;
+  VMConfig config;
+  config.registerTier = true;
+  VM vm(out, config);
+
+  // Classes aren't supported by the register tier, so the second script runs on the stack tier
+  // and the others call into it and back.
+  ASSERT_EQ(vm.interpret("fun add(a, b) { return a + b; }"), INTERPRET_OK);
+  ASSERT_EQ(vm.interpret("class A { m(x) { return add(x, 1); } }"
+                         "fun twice(f, x) { return f(f(x)); }"
+                         "print A().m(2);"),
+            INTERPRET_OK);
+  ASSERT_EQ(vm.interpret("fun inc(x) { return add(x, 1); } print twice(inc, 5);"), INTERPRET_OK);
+  ASSERT_EQ(out.str(), "3\n7\n");
+  ASSERT_EQ(vm.interpret("print twice(inc, nil);"), INTERPRET_RUNTIME_ERROR);
+  ASSERT_EQ(vm.interpret("print twice(add, 1);"), INTERPRET_RUNTIME_ERROR);
+  ASSERT_EQ(vm.interpret("print add(twice(inc, 1), 1);"), INTERPRET_OK);
+  ASSERT_EQ(out.str(), "3\n7\n4\n");
+}
@@ -0,0 +1,95 @@
+#include "trace.h"
+
+#include <sstream>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "test_common.h"
+#include "vm.h"
+
+using namespace lox;
+
+class TraceTest : public TestBase {
+ public:
+  TraceTest()
+    : vm_(out_, tracingConfig()) {}
+
+  static VMConfig tracingConfig() {
+    VMConfig config;
+    config.tracing = true;
+    config.traceThreshold = 10;
+    return config;
+  }
+
+ public:
+  std::ostringstream out_;
+  VM vm_;
+};
+
+#ifdef __x86_64__
+
+TEST_F(TraceTest, CompilesHotNumericLoops) {
+  ASSERT_EQ(vm_.interpret("var sum = 0;"
+                          "for (var i = 0; i < 100; i = i + 1) sum = sum + i * 2;"
+                          "print sum;"),
+            INTERPRET_OK);
+  ASSERT_EQ(out_.str(), "9900\n");
+  ASSERT_EQ(vm_.compiledTraces(), 1);
+}
+
+TEST_F(TraceTest, ColdLoopsAreNotRecorded) {
+  ASSERT_EQ(vm_.interpret("var sum = 0;"
+                          "for (var i = 0; i < 5; i = i + 1) sum = sum + i;"
+                          "print sum;"),
+            INTERPRET_OK);
+  ASSERT_EQ(out_.str(), "10\n");
+  ASSERT_EQ(vm_.compiledTraces(), 0);
+}
+
+TEST_F(TraceTest, LoopsThatCallAreNotCompiled) {
+  ASSERT_EQ(vm_.interpret("fun f(x) { var y = x; return y; }"
+                          "var sum = 0;"
+                          "for (var i = 0; i < 100; i = i + 1) sum = sum + f(i);"
+                          "print sum;"),
+            INTERPRET_OK);
+  ASSERT_EQ(out_.str(), "4950\n");
+  ASSERT_EQ(vm_.compiledTraces(), 0);
+}
+
+TEST_F(TraceTest, InlinedCallsAreTraced) {
+  ASSERT_EQ(vm_.interpret("fun twice(x) { return x * 2; }"
+                          "fun run() {"
+                          "  var sum = 0;"
+                          "  for (var i = 0; i < 100; i = i + 1) sum = sum + twice(i);"
+                          "  return sum;"
+                          "}"
+                          "print run();"),
+            INTERPRET_OK);
+  ASSERT_EQ(vm_.compiledTraces(), 1);
+  // The trace checks on entry that twice is still the function inlined into it.
+  ASSERT_EQ(vm_.interpret("fun twice(x) { return x * 3; } print run();"), INTERPRET_OK);
+  ASSERT_EQ(out_.str(), "9900\n14850\n");
+}
+
+TEST_F(TraceTest, SideExitsResumeInTheInterpreter) {
+  // The branch not taken while recording leaves the trace every other iteration.
+  ASSERT_EQ(vm_.interpret("var a = 0; var b = 0; var flip = 0;"
+                          "for (var i = 0; i < 100; i = i + 1) {"
+                          "  if (flip == 0) { a = a + i; flip = 1; } else { b = b - i; flip = 0; }"
+                          "}"
+                          "print a; print b;"),
+            INTERPRET_OK);
+  ASSERT_EQ(out_.str(), "2450\n-2500\n");
+  ASSERT_EQ(vm_.compiledTraces(), 1);
+}
+
+TEST_F(TraceTest, RuntimeErrorAfterTraceExit) {
+  ASSERT_EQ(vm_.interpret("var x = 0;"
+                          "for (var i = 0; i < 100; i = i + 1) {"
+                          "  x = x + 1;"
+                          "  if (i == 50) x = \"s\";"
+                          "}"),
+            INTERPRET_RUNTIME_ERROR);
+}
+
+#endif
@@ -0,0 +1,21 @@
+#!/usr/bin/env bash
+# Runs every script under bench/ and reports the best wall time of several runs.
+#
+# Usage: tool/bench.sh <path to lox binary> [runs] [extra lox args...]
+
+set -eu
+
+LOX=${1:?"lox binary path is required"}
+RUNS=${2:-3}
+shift $(($# < 2 ? $# : 2))
+
+TIMEFORMAT=%R
+for script in bench/*.lox; do
+  best=""
+  for ((i = 0; i < RUNS; i++)); do
+    t=$({ time "$LOX" "$@" "$script" > /dev/null; } 2>&1)
+    ms=$((10#${t/./}))
+    if [[ -z "$best" ]] || ((ms < best)); then best=$ms; fi
+  done
+  printf "%-24s %6d ms\n" "$(basename "$script" .lox)" "$best"
+done
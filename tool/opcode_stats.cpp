@@ -0,0 +1,198 @@
+// Counts adjacent opcode pairs and triples executed while running a corpus of scripts, to choose
+// which sequences are worth a superinstruction.
+//
+// The tool is built with PROFILE_OPCODES so the VM records how often every instruction runs, and
+// scripts run with superinstructions disabled so the counts are over the plain instruction set.
+// A sequence is weighted by how often its last instruction ran; sequences that straddle a jump
+// target are skipped since they can't be fused. The hit rates of the property and invoke inline
+// caches are printed after the sequences.
+//
+// With --tiers it instead prints, per script, the number of instructions executed by the stack
+// interpreter with and without superinstructions and by the register tier.
+//
+// Usage: opcode_stats [-n <top>] [--tiers] <script.lox>...
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "debug.h"
+#include "op_code.h"
+#include "vm.h"
+
+using namespace lox;
+
+typedef std::vector<int> Sequence;
+
+struct Stats {
+  std::map<Sequence, long> pairs;
+  std::map<Sequence, long> triples;
+  long instructions = 0;
+  VM::CacheStats propertyCache;
+  VM::CacheStats invokeCache;
+};
+
+static bool readSource(const char* path, std::string* source) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) return false;
+
+  std::stringstream ss;
+  ss << file.rdbuf();
+  *source = ss.str();
+  return true;
+}
+
+static std::vector<bool> jumpTargets(const Chunk& chunk) {
+  std::vector<bool> targets(chunk.count() + 1, false);
+  for (int offset = 0; offset < chunk.count(); offset = Disassembler::nextOffset(chunk, offset)) {
+    int sign;
+    switch (chunk.getCode(offset)) {
+      case OP_JUMP:
+      case OP_JUMP_IF_FALSE:
+      case OP_AND:
+      case OP_OR: sign = 1; break;
+      case OP_LOOP: sign = -1; break;
+      default: continue;
+    }
+    int jump = chunk.getCode(offset + 1) << 8 | chunk.getCode(offset + 2);
+    targets[offset + 3 + sign * jump] = true;
+  }
+  return targets;
+}
+
+static long totalInstructions(const VM& vm) {
+  long total = 0;
+  for (auto& entry : vm.opcodeProfile()) {
+    for (long count : entry.second) total += count;
+  }
+  return total;
+}
+
+// Runs the script under `config` and returns how many instructions were executed.
+static long runScript(const std::string& source, const VMConfig& config) {
+  std::ostringstream out; // Script output is discarded.
+  VM vm(out, config);
+  if (vm.interpret(source.c_str()) != INTERPRET_OK) return -1;
+  return totalInstructions(vm);
+}
+
+static void compareTiers(const std::vector<const char*>& paths,
+                         const std::vector<std::string>& sources) {
+  VMConfig stack;
+  stack.superinstructions = false;
+  VMConfig fused;
+  VMConfig registers;
+  registers.registerTier = true;
+
+  printf("%-28s %12s %12s %12s %8s\n", "script", "stack", "+superinstr", "register", "ratio");
+  for (size_t i = 0; i < paths.size(); i++) {
+    long plain = runScript(sources[i], stack);
+    long super = runScript(sources[i], fused);
+    long reg = runScript(sources[i], registers);
+    printf("%-28s %12ld %12ld %12ld %7.0f%%\n", paths[i], plain, super, reg,
+           plain > 0 ? 100.0 * reg / plain : 0.0);
+  }
+}
+
+static void countFunction(ObjFunction* fn, const std::vector<long>& counts, Stats* stats) {
+  const Chunk& chunk = fn->chunk();
+  std::vector<bool> targets = jumpTargets(chunk);
+
+  // Opcodes of the current straight-line run, newest last.
+  Sequence run;
+  for (int offset = 0; offset < chunk.count(); offset = Disassembler::nextOffset(chunk, offset)) {
+    if (targets[offset]) run.clear();
+
+    run.push_back(chunk.getCode(offset));
+    long executed = counts[offset];
+    stats->instructions += executed;
+    if (executed == 0) continue;
+
+    int n = run.size();
+    if (n >= 2) stats->pairs[Sequence(run.end() - 2, run.end())] += executed;
+    if (n >= 3) stats->triples[Sequence(run.end() - 3, run.end())] += executed;
+  }
+}
+
+static void printTop(const char* title, const std::map<Sequence, long>& counts, long total, int top) {
+  std::vector<std::pair<Sequence, long>> sorted(counts.begin(), counts.end());
+  std::sort(sorted.begin(), sorted.end(),
+            [](const auto& a, const auto& b) { return a.second > b.second; });
+
+  std::cout << "== " << title << " ==" << std::endl;
+  for (int i = 0; i < (int)sorted.size() && i < top; i++) {
+    std::string name;
+    for (int op : sorted[i].first) {
+      if (!name.empty()) name += " ";
+      name += opcodeName(op);
+    }
+    printf("%8ld %6.2f%%  %s\n", sorted[i].second, 100.0 * sorted[i].second / total, name.c_str());
+  }
+}
+
+static void printCacheStats(const char* title, const VM::CacheStats& cache) {
+  long lookups = cache.hits + cache.misses;
+  printf("== %s ==\n%8ld hits %8ld misses %6.2f%% hit rate\n", title, cache.hits, cache.misses,
+         lookups > 0 ? 100.0 * cache.hits / lookups : 0.0);
+}
+
+int main(int argc, char const* argv[]) {
+  int top = 20;
+  bool tiers = false;
+  std::vector<const char*> paths;
+  for (int i = 1; i < argc; i++) {
+    if (std::string(argv[i]) == "-n" && i + 1 < argc) {
+      top = std::atoi(argv[++i]);
+    } else if (std::string(argv[i]) == "--tiers") {
+      tiers = true;
+    } else {
+      paths.push_back(argv[i]);
+    }
+  }
+  if (paths.empty()) {
+    std::cerr << "Usage: opcode_stats [-n <top>] [--tiers] <script.lox>..." << std::endl;
+    return 64;
+  }
+
+  std::vector<std::string> sources(paths.size());
+  for (size_t i = 0; i < paths.size(); i++) {
+    if (!readSource(paths[i], &sources[i])) {
+      std::cerr << "Failed to load " << paths[i] << "." << std::endl;
+      return 74;
+    }
+  }
+
+  if (tiers) {
+    compareTiers(paths, sources);
+    return 0;
+  }
+
+  VMConfig config;
+  config.superinstructions = false;
+
+  Stats stats;
+  for (size_t i = 0; i < paths.size(); i++) {
+    std::ostringstream out; // Script output is discarded.
+    VM vm(out, config);
+    if (vm.interpret(sources[i].c_str()) != INTERPRET_OK) {
+      std::cerr << "Failed to run " << paths[i] << "." << std::endl;
+    }
+    for (auto& entry : vm.opcodeProfile()) countFunction(entry.first, entry.second, &stats);
+    stats.propertyCache.hits += vm.propertyCacheStats().hits;
+    stats.propertyCache.misses += vm.propertyCacheStats().misses;
+    stats.invokeCache.hits += vm.invokeCacheStats().hits;
+    stats.invokeCache.misses += vm.invokeCacheStats().misses;
+  }
+
+  std::cout << stats.instructions << " instructions executed by " << paths.size() << " scripts"
+            << std::endl;
+  printTop("pairs", stats.pairs, stats.instructions, top);
+  printTop("triples", stats.triples, stats.instructions, top);
+  printCacheStats("property cache", stats.propertyCache);
+  printCacheStats("invoke cache", stats.invokeCache);
+  return 0;
+}